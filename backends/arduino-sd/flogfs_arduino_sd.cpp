@@ -118,6 +118,36 @@ flog_result_t flash_read_spare(uint8_t *dst, flog_sector_idx_t sector) {
     return FLOG_RESULT(sd_raw_read_data(&sd, sd_block, sector * 0x10, sizeof(flog_file_sector_spare_t), dst));
 }
 
+flog_result_t flash_read_sectors(flog_block_idx_t block, flog_sector_idx_t sector, uint16_t n, uint8_t *dst, uint8_t *spares) {
+    fslog_trace("flash_read_sectors(%d, %d, %d)", block, sector, n);
+    // Whole SD blocks straight into dst, then the page's spares in one pass
+    // over its spare block
+    while (n > 0) {
+        flog_page_index_t page = sector / FS_SECTORS_PER_PAGE;
+        flog_sector_idx_t first = sector % FS_SECTORS_PER_PAGE;
+        uint16_t count = FS_SECTORS_PER_PAGE - first;
+        if (count > n) {
+            count = n;
+        }
+        for (uint16_t i = 0; i < count; ++i) {
+            if (!sd_raw_read_block(&sd, get_sd_block(block, page, first + i), dst)) {
+                return FLOG_FAILURE;
+            }
+            dst += FS_SECTOR_SIZE;
+        }
+        auto sd_block = get_sd_block(block, page, FS_SECTORS_PER_PAGE);
+        for (uint16_t i = 0; i < count; ++i) {
+            if (!sd_raw_read_data(&sd, sd_block, (first + i) * 0x10, sizeof(flog_file_sector_spare_t), spares)) {
+                return FLOG_FAILURE;
+            }
+            spares += sizeof(flog_file_sector_spare_t);
+        }
+        sector += count;
+        n -= count;
+    }
+    return FLOG_SUCCESS;
+}
+
 void flash_write_sector(uint8_t const *src, flog_sector_idx_t sector, uint16_t offset, uint16_t n) {
     bool preserve_partial_write = last_block_erased != open_block;
     fslog_trace("flash_write_sector(%p, %d, %d, %d, %s)", src, sector, offset, n, preserve_partial_write ? "PRESERVE" : "IGNORE-EXISTING");
@@ -132,6 +162,20 @@ void flash_write_spare(uint8_t const *src, flog_sector_idx_t sector) {
     sd_raw_write_data(&sd, sd_block, sector * 0x10, sizeof(flog_file_sector_spare_t), src, true);
 }
 
+void flash_write_page(flog_block_idx_t block, flog_page_index_t page, uint8_t const *data, uint8_t const *spares) {
+    fslog_trace("flash_write_page(%d, %d)", block, page);
+    // Whole SD blocks need no read-modify-write
+    for (flog_sector_idx_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        sd_raw_write_block(&sd, get_sd_block(block, page, i), data);
+        data += FS_SECTOR_SIZE;
+    }
+    auto sd_block = get_sd_block(block, page, FS_SECTORS_PER_PAGE);
+    for (flog_sector_idx_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        sd_raw_write_data(&sd, sd_block, i * 0x10, sizeof(flog_file_sector_spare_t), spares, true);
+        spares += sizeof(flog_file_sector_spare_t);
+    }
+}
+
 uint32_t flash_random(uint32_t max) {
     return random(max);
 }
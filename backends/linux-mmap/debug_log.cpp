@@ -5,6 +5,12 @@ std::ostream& operator<<(std::ostream& os, const LogEntry& e) {
     case OperationType::Opened:
         os << "Opened()";
         break;
+    case OperationType::OpenPage:
+        os << "OpenPage(" << e.block_ << "." << e.page_ << ")";
+        break;
+    case OperationType::ReadSectors:
+        os << "ReadSectors(" << e.block_ << "." << e.page_ << "." << e.sector_ << ", " << e.size_ << ")";
+        break;
     case OperationType::EraseBlock:
         os << "EraseBlock(" << e.block_ << ")";
         break;
@@ -14,6 +20,9 @@ std::ostream& operator<<(std::ostream& os, const LogEntry& e) {
     case OperationType::WriteSpare:
         os << "WriteSpare(" << e.block_ << "." << e.page_ << "." << e.sector_ << ")";
         break;
+    case OperationType::WritePage:
+        os << "WritePage(" << e.block_ << "." << e.page_ << ")";
+        break;
     case OperationType::FormatBegin:
         os << "FormatBegin()";
         break;
@@ -15,9 +15,12 @@
 
 enum class OperationType {
     Opened,
+    OpenPage,
+    ReadSectors,
     EraseBlock,
     WriteSector,
     WriteSpare,
+    WritePage,
     FormatBegin,
     FormatEnd,
     PrimeBegin,
@@ -93,6 +96,16 @@ public:
         return entries_.size();
     }
 
+    uint32_t count(OperationType type) {
+        uint32_t n = 0;
+        for (auto &e : entries_) {
+            if (e.type() == type) {
+                n++;
+            }
+        }
+        return n;
+    }
+
     void clear() {
         entries_.erase(entries_.begin(), entries_.end());
     }
@@ -1,8 +1,11 @@
 #ifndef __FLOGFS_LINUX_MMAP_IMPLEMENT_H_
 #define __FLOGFS_LINUX_MMAP_IMPLEMENT_H_
 
-typedef void *fs_lock_t;
+#include <pthread.h>
 
+typedef pthread_mutex_t fs_lock_t;
+
+//! Locks must be recursive, see the backend locks in flogfs.h
 void fs_lock_initialize(fs_lock_t *lock);
 
 void fs_lock(fs_lock_t *lock);
@@ -35,6 +38,26 @@ void flash_write_sector(uint8_t const *src, flog_sector_idx_t sector, uint16_t o
 
 void flash_write_spare(uint8_t const *src, flog_sector_idx_t sector);
 
+#define FS_FLASH_READ_SECTORS (1)
+
+flog_result_t flash_read_sectors(flog_block_idx_t block, flog_sector_idx_t sector, uint16_t n, uint8_t *dst, uint8_t *spares);
+
+#define FS_FLASH_WRITE_PAGE (1)
+
+void flash_write_page(flog_block_idx_t block, flog_page_index_t page, uint8_t const *data, uint8_t const *spares);
+
+#define FS_FLASH_WRITE_SECTOR_GATHER (1)
+
+void flash_write_sector_gather(uint8_t const *head, uint16_t head_n, uint8_t const *src, flog_sector_idx_t sector, uint16_t n);
+
+#define FS_FLASH_WRITE_BEHIND_READY (1)
+
+void flash_write_behind_ready();
+
+#define FS_FLASH_MAP_SECTOR (1)
+
+uint8_t const *flash_map_sector(flog_sector_idx_t sector, uint16_t offset);
+
 void flash_debug_warn(char const *f, ...);
 
 void flash_debug_error(char const *f, ...);
@@ -7,6 +7,11 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <flogfs.h>
 #include <flogfs_private.h>
@@ -28,6 +33,9 @@ static flog_block_idx_t open_block = FLOG_BLOCK_IDX_INVALID;
 static flog_page_index_t open_page{ 0 };
 static uint16_t pages_per_block{ 0 };
 static Log log;
+//! Programs and erases left before power is lost, negative for no limit
+static int32_t power_remaining{ -1 };
+static std::set<flog_block_idx_t> bad_blocks;
 
 static inline uint32_t sectors_per_block() {
     return FS_SECTORS_PER_PAGE_INTERNAL * pages_per_block;
@@ -59,6 +67,10 @@ flog_result_t flogfs_linux_open(const char *path, bool truncate, flog_initialize
         return FLOG_FAILURE;
     }
 
+    power_remaining = -1;
+    if (truncate) {
+        bad_blocks.clear();
+    }
     log.clear();
     log.append(LogEntry{ OperationType::Opened });
 
@@ -69,6 +81,72 @@ Log &flogfs_linux_get_log() {
     return log;
 }
 
+void flogfs_linux_lose_power_after(int32_t operations) {
+    power_remaining = operations;
+}
+
+void flogfs_linux_mark_bad_block(flog_block_idx_t block) {
+    bad_blocks.insert(block);
+}
+
+static bool powered() {
+    if (power_remaining < 0) {
+        return true;
+    }
+    if (power_remaining == 0) {
+        return false;
+    }
+    power_remaining--;
+    return true;
+}
+
+static std::thread flusher;
+static std::mutex flusher_mutex;
+static std::condition_variable flusher_wake;
+static bool flusher_running{ false };
+static bool flusher_pending{ false };
+
+void flash_write_behind_ready() {
+    std::lock_guard<std::mutex> guard(flusher_mutex);
+    flusher_pending = true;
+    flusher_wake.notify_one();
+}
+
+flog_result_t flogfs_linux_start_flusher() {
+#if FS_WRITE_BEHIND
+    std::lock_guard<std::mutex> guard(flusher_mutex);
+    if (flusher_running) {
+        return FLOG_FAILURE;
+    }
+    flusher_running = true;
+    flusher = std::thread([] {
+        std::unique_lock<std::mutex> guard(flusher_mutex);
+        while (flusher_running || flusher_pending) {
+            flusher_wake.wait(guard, [] { return flusher_pending || !flusher_running; });
+            flusher_pending = false;
+            guard.unlock();
+            while (flogfs_write_behind_flush()) {
+            }
+            guard.lock();
+        }
+    });
+    return FLOG_SUCCESS;
+#else
+    return FLOG_FAILURE;
+#endif
+}
+
+void flogfs_linux_stop_flusher() {
+    {
+        std::lock_guard<std::mutex> guard(flusher_mutex);
+        flusher_running = false;
+        flusher_wake.notify_one();
+    }
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+}
+
 flog_result_t flogfs_linux_close() {
     if (mapped != nullptr) {
         munmap(mapped, mapped_size);
@@ -101,28 +179,42 @@ static inline void *mapped_sector_ptr(flog_sector_idx_t sector, uint16_t offset)
 }
 
 void fs_lock_initialize(fs_lock_t *lock) {
+    // Locks are retaken by the same thread, such as when unmounting closes
+    // files with the file system already locked
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 void fs_lock(fs_lock_t *lock) {
+    pthread_mutex_lock(lock);
 }
 
 void fs_unlock(fs_lock_t *lock) {
+    pthread_mutex_unlock(lock);
 }
 
 flog_result_t flash_initialize() {
     return FLOG_RESULT(mapped != nullptr);
 }
 
+static std::recursive_mutex flash_mutex;
+
 void flash_lock() {
+    flash_mutex.lock();
 }
 
 void flash_unlock() {
+    flash_mutex.unlock();
 }
 
 flog_result_t flash_open_page(flog_block_idx_t block, flog_page_index_t page) {
     // fslog_trace("flash_open_page(%d, %d)", block, page);
     open_block = block;
     open_page = page;
+    log.append(LogEntry{ OperationType::OpenPage, block, page });
     return FLOG_RESULT(FLOG_SUCCESS);
 }
 
@@ -132,16 +224,20 @@ void flash_close_page() {
 
 flog_result_t flash_erase_block(flog_block_idx_t block) {
     fslog_trace("flash_erase_block(%d)", block);
+    if (!powered()) {
+        return FLOG_RESULT(FLOG_SUCCESS);
+    }
     log.append(LogEntry{ OperationType::EraseBlock, block });
     memset(mapped_sector_absolute_ptr(block, 0, 0, 0), FS_ERASE_CHAR, sectors_per_block() * FS_SECTOR_SIZE);
     return FLOG_RESULT(FLOG_SUCCESS);
 }
 
 flog_result_t flash_block_is_bad() {
-    return FLOG_RESULT(0);
+    return FLOG_RESULT(bad_blocks.count(open_block));
 }
 
 void flash_set_bad_block() {
+    bad_blocks.insert(open_block);
 }
 
 void flash_commit() {
@@ -171,20 +267,75 @@ flog_result_t flash_read_spare(uint8_t *dst, flog_sector_idx_t sector) {
     return FLOG_SUCCESS;
 }
 
+flog_result_t flash_read_sectors(flog_block_idx_t block, flog_sector_idx_t sector, uint16_t n, uint8_t *dst, uint8_t *spares) {
+    fslog_trace("flash_read_sectors(%d, %d, %d)", block, sector, n);
+    log.append(LogEntry{ OperationType::ReadSectors, block, (flog_page_index_t)(sector / FS_SECTORS_PER_PAGE), sector, nullptr, 0, n });
+    // Sectors are contiguous within a page, the spares come after them
+    while (n > 0) {
+        auto page = sector / FS_SECTORS_PER_PAGE;
+        auto first = sector % FS_SECTORS_PER_PAGE;
+        auto count = std::min<uint16_t>(n, FS_SECTORS_PER_PAGE - first);
+        memcpy(dst, mapped_sector_absolute_ptr(block, page, first, 0), count * FS_SECTOR_SIZE);
+        for (auto i = 0; i < count; ++i) {
+            memcpy(spares, mapped_sector_absolute_ptr(block, page, 0, 0x804 + (first + i) * 0x10), sizeof(flog_file_sector_spare_t));
+            spares += sizeof(flog_file_sector_spare_t);
+        }
+        dst += count * FS_SECTOR_SIZE;
+        sector += count;
+        n -= count;
+    }
+    return FLOG_SUCCESS;
+}
+
+uint8_t const *flash_map_sector(flog_sector_idx_t sector, uint16_t offset) {
+    fslog_trace("flash_map_sector(%d/%d, %d, %d)", open_block, open_page, sector, offset);
+    return (uint8_t const *)mapped_sector_ptr(sector % FS_SECTORS_PER_PAGE, offset);
+}
+
 void flash_write_sector(uint8_t const *src, flog_sector_idx_t sector, uint16_t offset, uint16_t n) {
     fslog_trace("flash_write_sector(%d/%d, %d, %d, %d)", open_block, open_page, sector, offset, n);
+    if (!powered()) {
+        return;
+    }
     auto dst = mapped_sector_ptr(sector % FS_SECTORS_PER_PAGE, offset);
     log.append(LogEntry{ OperationType::WriteSector, open_block, open_page, sector, dst, offset, n });
     verified_memcpy(dst, src, n);
 }
 
+void flash_write_sector_gather(uint8_t const *head, uint16_t head_n, uint8_t const *src, flog_sector_idx_t sector, uint16_t n) {
+    fslog_trace("flash_write_sector_gather(%d/%d, %d, %d, %d)", open_block, open_page, sector, head_n, n);
+    if (!powered()) {
+        return;
+    }
+    auto dst = (uint8_t *)mapped_sector_ptr(sector % FS_SECTORS_PER_PAGE, 0);
+    log.append(LogEntry{ OperationType::WriteSector, open_block, open_page, sector, dst, 0, (uint16_t)(head_n + n) });
+    verified_memcpy(dst, head, head_n);
+    verified_memcpy(dst + head_n, src, n);
+}
+
 void flash_write_spare(uint8_t const *src, flog_sector_idx_t sector) {
     fslog_trace("flash_write_spare(%d/%d, %d)", open_block, open_page, sector);
+    if (!powered()) {
+        return;
+    }
     auto dst = mapped_sector_ptr(0, 0x804 + (sector % FS_SECTORS_PER_PAGE) * 0x10);
     log.append(LogEntry{ OperationType::WriteSpare, open_block, open_page, sector, dst });
     verified_memcpy(dst, src, sizeof(flog_file_sector_spare_t));
 }
 
+void flash_write_page(flog_block_idx_t block, flog_page_index_t page, uint8_t const *data, uint8_t const *spares) {
+    fslog_trace("flash_write_page(%d/%d)", block, page);
+    if (!powered()) {
+        return;
+    }
+    log.append(LogEntry{ OperationType::WritePage, block, page, (flog_sector_idx_t)(page * FS_SECTORS_PER_PAGE) });
+    verified_memcpy(mapped_sector_absolute_ptr(block, page, 0, 0), data, FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE);
+    for (auto i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        verified_memcpy(mapped_sector_absolute_ptr(block, page, 0, 0x804 + i * 0x10), spares, sizeof(flog_file_sector_spare_t));
+        spares += sizeof(flog_file_sector_spare_t);
+    }
+}
+
 uint32_t flash_random(uint32_t max) {
     return random() % max;
 }
@@ -15,6 +15,33 @@ flog_result_t flogfs_linux_close();
 
 Log &flogfs_linux_get_log();
 
+/*!
+ @brief Simulate losing power after a number of programs and erases
+ @param operations How many more to carry out, negative for no limit
+
+ Everything after that is dropped without a trace, until the next
+ flogfs_linux_open().
+ */
+void flogfs_linux_lose_power_after(int32_t operations);
+
+/*!
+ @brief Mark a block bad, as a factory bad block would be
+
+ Bad blocks stay bad until the file is opened with truncate.
+ */
+void flogfs_linux_mark_bad_block(flog_block_idx_t block);
+
+/*!
+ @brief Start a thread which writes data queued by flogfs_write_async()
+ @retval FLOG_FAILURE if it's already running or FS_WRITE_BEHIND is off
+ */
+flog_result_t flogfs_linux_start_flusher();
+
+/*!
+ @brief Stop the flusher thread once it has written all full queued sectors
+ */
+void flogfs_linux_stop_flusher();
+
 }
 
 #endif
@@ -55,6 +55,31 @@ extern "C" {
 
 #include "flogfs_conf_implement.h"
 
+//! Set by backends that implement flash_map_sector
+#ifndef FS_FLASH_MAP_SECTOR
+#define FS_FLASH_MAP_SECTOR (0)
+#endif
+
+//! Set by backends that implement flash_read_sectors
+#ifndef FS_FLASH_READ_SECTORS
+#define FS_FLASH_READ_SECTORS (0)
+#endif
+
+//! Set by backends that implement flash_write_page
+#ifndef FS_FLASH_WRITE_PAGE
+#define FS_FLASH_WRITE_PAGE (0)
+#endif
+
+//! Set by backends that implement flash_write_sector_gather
+#ifndef FS_FLASH_WRITE_SECTOR_GATHER
+#define FS_FLASH_WRITE_SECTOR_GATHER (0)
+#endif
+
+//! Set by backends that implement flash_write_behind_ready
+#ifndef FS_FLASH_WRITE_BEHIND_READY
+#define FS_FLASH_WRITE_BEHIND_READY (0)
+#endif
+
 static void flog_assert(const char *msg, const char *file, int lineno) {
     flash_debug_error("Assertion failed: %s:%d %s", file, lineno, msg);
     flash_debug_panic();
@@ -68,30 +93,47 @@ static void flog_assert(const char *msg, const char *file, int lineno) {
 typedef struct flog_block_alloc_t {
     flog_block_idx_t block;
     flog_block_age_t age;
-    flog_block_alloc_t *next;
 } flog_block_alloc_t;
 
 typedef struct {
-    //! Block indices and ages
-    flog_block_alloc_t blocks[FS_PREALLOCATE_SIZE];
-    //! The number of entries
+    //! A min-heap of erased blocks, youngest first
+    flog_block_alloc_t available[FS_PREALLOCATE_SIZE];
+    //! The number of entries in @ref available
     uint16_t n;
-    //! The sum of all ages
-    flog_block_age_t age_sum;
-    flog_block_alloc_t *free;
-    flog_block_alloc_t *available;
-    flog_block_alloc_t *pending;
+    //! The number of bits set in @ref pending
+    uint16_t npending;
+    //! One bit per block in @ref available
+    uint8_t contains[(FS_MAXIMUM_BLOCKS + 7) / 8];
+    //! One bit per block handed out but not yet opened
+    uint8_t pending[(FS_MAXIMUM_BLOCKS + 7) / 8];
 } flog_prealloc_list_t;
 
 typedef struct {
+    flog_file_id_t file_id;
+    flog_block_idx_t first_block;
+} flog_file_find_result_t;
+
+//! Where to start walking a file, from the newest close record
+typedef struct {
+    //! A block of the file, FLOG_BLOCK_IDX_INVALID if there's no record
     flog_block_idx_t block;
-    flog_write_file_t *file;
-} flog_dirty_block_t;
+    //! The number of bytes in the file before @ref block
+    uint32_t position;
+} flog_file_hint_t;
 
 typedef struct {
-    flog_file_id_t file_id;
+    //! A hash of the file name, @ref FLOG_FILE_INDEX_EMPTY if the slot is unused
+    uint16_t hash;
+    //! The allocation sector of the inode entry
+    flog_sector_idx_t sector;
+    //! The inode block holding the entry
+    flog_block_idx_t block;
     flog_block_idx_t first_block;
-} flog_file_find_result_t;
+    flog_file_id_t file_id;
+    flog_file_hint_t hint;
+} flog_file_index_entry_t;
+
+#define FLOG_FILE_INDEX_EMPTY (0)
 
 /*!
  @brief The complete FLogFS state structure
@@ -121,28 +163,98 @@ typedef struct {
 
     //! The location of the first inode block
     flog_block_idx_t inode0;
+    //! The last block in the inode chain
+    flog_block_idx_t inode_tail_block;
+    //! The first unallocated inode entry sector in @ref inode_tail_block
+    flog_sector_idx_t inode_tail_sector;
+
+    //! The block holding mount checkpoints
+    flog_block_idx_t checkpoint_block;
+    //! The next unwritten checkpoint entry in @ref checkpoint_block
+    uint16_t checkpoint_slot;
+    //! The age table referenced by the checkpoint
+    flog_block_idx_t age_table;
 
     //! @brief Flash cache status
-    //! @note This must be protected under @ref flogfs_t::lock !
+    //! @note This must be protected under flash_lock()
     struct {
         flog_block_idx_t current_open_block;
         flog_page_index_t current_open_page;
         uint_fast8_t page_open;
         flog_result_t page_open_result;
+        //! The page actually open in flash, which stays put while reads of
+        //! the current page are served from the read cache
+        flog_block_idx_t flash_block;
+        flog_page_index_t flash_page;
+        uint_fast8_t flash_open;
+        flog_result_t flash_open_result;
     } cache_status;
 
-    //! A lock to serialize some FS operations
+    //! @brief Recently read pages
+    //! @note This must be protected under flash_lock(), as it follows the
+    //! open page
+    struct {
+#if FS_READ_CACHE_PAGES
+        flog_read_cache_page_t pages[FS_READ_CACHE_PAGES];
+        //! Incremented on every hit to order pages by use
+        uint32_t clock;
+#endif
+        flog_read_cache_stats_t stats;
+    } read_cache;
+
+    //! A lock to serialize some FS operations. Reads of open files take
+    //! flash_lock() alone: whatever changes the open page, the read cache or
+    //! the files they read holds it too, and buffered writes skip files with
+    //! readers.
     fs_lock_t lock;
     //! A lock to block any allocation-related operations
     fs_lock_t allocate_lock;
     //! A lock to serialize deletion operations
     fs_lock_t delete_lock;
+#if FS_WRITE_BEHIND
+    //! A lock for the write-behind queues of write files, never held across
+    //! flash operations so queueing doesn't wait on them
+    fs_lock_t write_behind_lock;
+#endif
+    //! Locks for the state of write files, so writes which only fill a
+    //! file's buffer don't need @ref flogfs_t::lock. They're taken after it
+    //! and before the write-behind lock, and never two at once.
+    fs_lock_t write_locks[FLOG_WRITE_LOCKS];
 
-    //! The one dirty_block
-    //! @note This may only be accessed under @ref flogfs_t::allocate_lock
-    flog_dirty_block_t dirty_block;
     //! The moving allocator head
     flog_block_idx_t allocate_head;
+    //! One bit per block, set while a block holds nothing worth keeping
+    //! @note This may only be accessed under @ref flogfs_t::allocate_lock
+    uint8_t free_blocks[(FS_MAXIMUM_BLOCKS + 7) / 8];
+    //! One bit per free block that has to be erased before it can be used
+    //! @note This may only be accessed under @ref flogfs_t::allocate_lock
+    uint8_t erase_blocks[(FS_MAXIMUM_BLOCKS + 7) / 8];
+
+    //! @brief Deleted files whose blocks are yet to be erased
+    //! @note This may only be accessed under @ref flogfs_t::delete_lock
+    struct {
+        flog_reclaim_entry_t queue[FLOG_RECLAIM_QUEUE_SIZE];
+        uint8_t head;
+        uint8_t n;
+        //! Set if deleted files may be waiting in the inode table instead
+        uint8_t overflow;
+        //! The tail end of the chain at the head of the queue, last block on top
+        flog_block_idx_t stack[FLOG_RECLAIM_STACK_SIZE];
+        uint8_t depth;
+    } reclaim;
+
+#if FS_FILE_INDEX_SIZE
+    //! @brief Live files by name, an open addressed hash table
+    //! @note This may only be accessed under @ref flogfs_t::lock
+    struct {
+        flog_file_index_entry_t entries[FS_FILE_INDEX_SIZE];
+        uint16_t n;
+        //! Set once every live file has been inserted
+        uint8_t built;
+        //! Set if some live file didn't fit, so a miss proves nothing
+        uint8_t overflowed;
+    } file_index;
+#endif
 
     //! Initialized parameters.
     flog_initialize_params_t params;
@@ -159,10 +271,30 @@ static inline void flog_unlock_fs() {
 }
 
 static inline void flog_lock_allocate() {
+    // Allocating may reclaim deleted files' blocks, which needs the delete
+    // lock, so that's always taken first
+    fs_lock(&flogfs.delete_lock);
     fs_lock(&flogfs.allocate_lock);
 }
 static inline void flog_unlock_allocate() {
     fs_unlock(&flogfs.allocate_lock);
+    fs_unlock(&flogfs.delete_lock);
+}
+
+#if FS_WRITE_BEHIND
+static inline void flog_lock_write_behind() {
+    fs_lock(&flogfs.write_behind_lock);
+}
+static inline void flog_unlock_write_behind() {
+    fs_unlock(&flogfs.write_behind_lock);
+}
+#endif
+
+static inline void flog_lock_write_file(flog_write_file_t const *file) {
+    fs_lock(&flogfs.write_locks[file->id % FLOG_WRITE_LOCKS]);
+}
+static inline void flog_unlock_write_file(flog_write_file_t const *file) {
+    fs_unlock(&flogfs.write_locks[file->id % FLOG_WRITE_LOCKS]);
 }
 
 static inline void flog_lock_delete() {
@@ -172,6 +304,32 @@ static inline void flog_unlock_delete() {
     fs_unlock(&flogfs.delete_lock);
 }
 
+static inline uint_fast8_t flog_bitset_test(uint8_t const *bits, flog_block_idx_t block) {
+    return (bits[block / 8] >> (block % 8)) & 1;
+}
+static inline void flog_bitset_set(uint8_t *bits, flog_block_idx_t block) {
+    bits[block / 8] |= (1 << (block % 8));
+}
+static inline void flog_bitset_clear(uint8_t *bits, flog_block_idx_t block) {
+    bits[block / 8] &= ~(1 << (block % 8));
+}
+
+static inline void flog_free_blocks_set(flog_block_idx_t block) {
+    flog_bitset_set(flogfs.free_blocks, block);
+}
+static inline void flog_free_blocks_clear(flog_block_idx_t block) {
+    flog_bitset_clear(flogfs.free_blocks, block);
+}
+static inline uint_fast8_t flog_free_blocks_test(flog_block_idx_t block) {
+    return flog_bitset_test(flogfs.free_blocks, block);
+}
+
+//! Mark a block as free but still holding stale data
+static inline void flog_free_blocks_set_stale(flog_block_idx_t block) {
+    flog_bitset_set(flogfs.free_blocks, block);
+    flog_bitset_set(flogfs.erase_blocks, block);
+}
+
 /*!
  @brief Go find a suitable free block to use
  @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
@@ -183,6 +341,35 @@ static inline void flog_unlock_delete() {
  */
 static flog_block_alloc_t flog_allocate_block(int32_t threshold);
 
+/*!
+ @brief Take a block from the preallocation list and nowhere else
+ @return A block. The index will be FLOG_BLOCK_IDX_INVALID if the list is empty.
+
+ Unlike flog_allocate_block() this never touches flash, for bounded writes.
+
+ @note This requires flogfs_t::allocate_lock
+ */
+static flog_block_alloc_t flog_allocate_preallocated();
+
+/*!
+ @brief Find a block for the first block of a new inode table
+ @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
+
+ Mounting only looks for the inode table below FS_INODE0_MAX_BLOCK, so this
+ takes the first erased or free block there.
+
+ @note This requires flogfs_t::allocate_lock
+ */
+static flog_block_alloc_t flog_allocate_inode0();
+
+/*!
+ @brief Hand every block of an inode chain to the allocator to be erased
+ @param block The first block of the chain
+
+ @note This requires flogfs_t::allocate_lock
+ */
+static void flog_inode_chain_release(flog_block_idx_t block);
+
 /*!
  @brief Get the next block entry from any valid block
  @param block The previous block
@@ -199,11 +386,78 @@ static inline flog_block_idx_t flog_universal_get_next_block(flog_block_idx_t bl
  @param[in] filename The filename to check for
  @param[out] iter An inode iterator -- If nothing is found, this will point to
                   the next free inode iterator
+ @param[out] hint The newest close record of the file, may be NULL
  @retval Fileinfo with first_block == FLOG_BLOCK_IDX_INVALID if not found
 
+ With FS_FILE_INDEX_SIZE set, live files are looked up by name hash and the
+ inode table is only walked when the index has overflowed. Without the index,
+ asking for a hint means walking the rest of the inode table.
+
+ @note This requires the FS lock, \ref flogfs_t::lock
+ */
+static flog_file_find_result_t flog_find_file(char const *filename, flog_inode_iterator_t *iter, flog_file_hint_t *hint);
+
+/*!
+ @brief Point an inode iterator at an entry without walking the inode table
+ @param block The inode block holding the entry
+ @param sector The allocation sector of the entry
+
+ Flash is only read when the entry is the last in its block, which is the only
+ time the iterator needs to know what follows it.
+ */
+static void flog_inode_iterator_seek(flog_inode_iterator_t *iter, flog_block_idx_t block, flog_sector_idx_t sector);
+
+/*!
+ @brief Append a close record for a file to the inode table
+ @param file The file, whose current block must have its init sector written
+
  @note This requires the FS lock, \ref flogfs_t::lock
  */
-static flog_file_find_result_t flog_find_file(char const *filename, flog_inode_iterator_t *iter);
+static flog_result_t flog_close_record_write(flog_write_file_t *file);
+
+static inline uint_fast8_t flog_inode_is_close_record(flog_inode_file_allocation_t const *allocation) {
+    return allocation->filename[0] == '\0';
+}
+
+#if FS_FILE_INDEX_SIZE
+static uint16_t flog_file_index_hash(char const *filename);
+
+/*!
+ @brief Empty the filename index, it's rebuilt on the next lookup
+ */
+static void flog_file_index_reset();
+
+/*!
+ @brief Fill the filename index from the inode table
+ */
+static void flog_file_index_build();
+
+/*!
+ @brief Add a live file to the filename index
+ @param iter Points at the allocation sector of the file's inode entry
+
+ The index only ever fills to three quarters so probing always ends on an
+ empty slot. Files that don't fit mark the index as overflowed.
+ */
+static void flog_file_index_insert(char const *filename, flog_inode_iterator_t const *iter, flog_file_id_t file_id,
+                                   flog_block_idx_t first_block);
+
+/*!
+ @brief Remove a deleted file from the filename index
+ @param iter Points at the allocation sector of the file's inode entry
+ */
+static void flog_file_index_remove(char const *filename, flog_inode_iterator_t const *iter);
+
+/*!
+ @brief Remember the newest close record of an indexed file
+ */
+static void flog_file_index_hint(flog_file_id_t file_id, flog_file_hint_t const *hint);
+#else
+static inline void flog_file_index_reset() {
+}
+static inline void flog_file_index_hint(flog_file_id_t file_id, flog_file_hint_t const *hint) {
+}
+#endif
 
 /*!
  @brief Open a page (read to flash cache) only if necessary
@@ -219,7 +473,188 @@ static inline flog_result_t flog_open_sector(flog_block_idx_t block, flog_sector
 
 static void flog_close_sector();
 
-static flog_result_t flogfs_read_calc_file_size(flog_read_file_t *file);
+/*!
+ @brief Open a page in flash, skipping the read cache
+ */
+static flog_result_t flog_flash_open_page(flog_block_idx_t block, flog_page_index_t page);
+
+/*!
+ @brief Make sure the page chosen by the last flog_open_page is open in flash
+
+ flog_open_page leaves flash alone when the page is in the read cache, so this
+ has to come first whenever the open page is accessed in flash.
+ */
+static flog_result_t flog_flash_select();
+
+//! @name Flash access
+//! These stand in for the flash_* calls of the same name, going through the
+//! read cache and making sure the right page is open in flash
+//! @{
+static flog_result_t flog_read_sector(uint8_t *dst, flog_sector_idx_t sector, uint16_t offset, uint16_t n);
+static flog_result_t flog_read_spare(uint8_t *dst, flog_sector_idx_t sector);
+static void flog_write_sector(uint8_t const *src, flog_sector_idx_t sector, uint16_t offset, uint16_t n);
+static void flog_write_sector_gather(uint8_t const *head, uint16_t head_n, uint8_t const *src, flog_sector_idx_t sector, uint16_t n);
+static void flog_write_spare(uint8_t const *src, flog_sector_idx_t sector);
+static flog_result_t flog_erase_block(flog_block_idx_t block);
+static flog_result_t flog_block_is_bad();
+//! @}
+
+/*!
+ @brief Get a pointer to data in the open page without copying it
+ @param sector The sector
+ @param offset The offset into the sector
+ @return A pointer into the read cache or flash itself, or NULL if neither is
+ possible and the data has to be copied out with flog_read_sector
+ */
+static uint8_t const *flog_map_sector(flog_sector_idx_t sector, uint16_t offset);
+
+/*!
+ @brief Forget every cached page and zero the counters
+ */
+static void flog_read_cache_reset();
+
+/*!
+ @brief Drop cached pages that are about to change
+ @param block The block being written or erased
+ @param page The page being written, FLOG_PAGE_IDX_INVALID for all of them
+ */
+static void flog_read_cache_invalidate(flog_block_idx_t block, flog_page_index_t page);
+
+#if FS_READ_CACHE_PAGES
+/*!
+ @brief Find a page in the read cache
+ @return The cached page or NULL
+ */
+static flog_read_cache_page_t *flog_read_cache_find(flog_block_idx_t block, flog_page_index_t page);
+
+/*!
+ @brief Get the currently open page from the read cache
+ @return The cached page, or NULL if it couldn't be read
+
+ On a miss the least recently used slot is refilled with the whole page,
+ data and spare, in one go.
+ */
+static flog_read_cache_page_t *flog_read_cache_get();
+#endif
+
+/*!
+ @brief Find the size of a file opened for reading
+ @param hint Where to start counting, invalid to walk the whole file
+ */
+static flog_result_t flogfs_read_calc_file_size(flog_read_file_t *file, flog_file_hint_t const *hint);
+
+/*!
+ @brief Move a read file on to the next sector holding data
+ @param file The file, whose current sector has been used up
+ @retval FLOG_SUCCESS if the read head moved, possibly to an empty sector
+ @retval FLOG_FAILURE at the end of the file
+ */
+static flog_result_t flogfs_read_next_sector(flog_read_file_t *file);
+
+/*!
+ @brief The work of flogfs_read(), for callers which hold the locks
+ */
+static uint32_t flogfs_read_data(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
+
+/*!
+ @brief Add data to a file's buffer if it all fits without a commit
+ @returns The number of bytes written, all or nothing
+
+ This only takes the file's write lock. Nothing is written while readers have
+ the file open, since they only lock the file system to look at the buffer.
+ */
+static uint32_t flog_write_buffered(flog_write_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt);
+
+/*!
+ @brief The work of flogfs_write(), for callers which hold the locks
+ @param budget The sectors left to commit, counted down, or NULL for no limit
+ */
+static uint32_t flogfs_write_data(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes, uint_fast8_t *budget);
+
+/*!
+ @brief Move a read file back to the end of the previous sector holding data
+ @param file The file, at the start of its current sector
+ @retval FLOG_FAILURE at the start of the file
+ */
+static flog_result_t flogfs_read_previous_sector(flog_read_file_t *file);
+
+/*!
+ @brief Find the block before another in a file
+ @param[in,out] block A block of the file and its position, replaced by the
+ block before it
+ @retval FLOG_FAILURE if it's the first block
+ */
+static flog_result_t flogfs_read_previous_block(flog_read_file_t *file, flog_read_skip_t *block);
+
+/*!
+ @brief Move the read head of a file to the start
+ */
+static void flogfs_read_rewind(flog_read_file_t *file);
+
+/*!
+ @brief The work of flogfs_read_seek(), for callers which hold the locks
+ */
+static flog_result_t flogfs_read_seek_to(flog_read_file_t *file, uint32_t position);
+
+/*!
+ @brief Read data which a file's writer is still holding in its sector buffer
+ @returns The number of bytes read
+
+ The file must have read everything committed to flash.
+ */
+static uint32_t flogfs_read_unflushed(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
+
+/*!
+ @brief Find the writer of a file
+ @returns The writer or NULL if the file isn't open for writing
+ */
+static flog_write_file_t *flog_find_writer(uint32_t id);
+
+/*!
+ @brief Count a reader opening or closing against the file's writer, if any
+ @param file The reader
+ @param change 1 when opening, -1 when closing
+ */
+static void flog_count_reader(flog_read_file_t const *file, int_fast8_t change);
+
+/*!
+ @brief Get the offset of the first data byte in a file sector
+ */
+static uint16_t flog_sector_data_offset(flog_sector_idx_t sector);
+
+/*!
+ @brief Read whole sectors of a file straight into the caller's buffer
+ @param file The file, whose current sector has been used up
+ @param dst The destination
+ @param nbytes The space in dst
+ @return The number of bytes read, always a multiple of FS_SECTOR_SIZE
+
+ This takes the run of full data sectors following the read head, stopping at
+ the end of the block or the first sector that isn't full, and moves them with
+ as few backend calls as possible. Zero means flogfs_read should carry on a
+ sector at a time.
+ */
+static uint32_t flogfs_read_bulk(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
+
+/*!
+ @brief Remember where a block of a read file starts
+ @param file The file
+ @param block A block of the file
+ @param position The number of bytes in the file before @ref block
+
+ Entries closer than flog_read_file_t::skip_span to a neighbor are dropped.
+ When the table fills up every other entry goes and the span doubles, so the
+ entries stay spread over everything that's been walked so far.
+ */
+static void flog_read_skip_add(flog_read_file_t *file, flog_block_idx_t block, uint32_t position);
+
+/*!
+ @brief Find the last known block start at or before a position
+ @param file The file
+ @param position An offset into the file
+ @return The entry to start walking from
+ */
+static flog_read_skip_t const *flog_read_skip_find(flog_read_file_t const *file, uint32_t position);
 
 /*!
  @brief Initialize an inode iterator
@@ -260,6 +695,13 @@ static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t *iter);
  */
 static inline flog_sector_idx_t flog_increment_sector(flog_sector_idx_t sector);
 
+/*!
+ @brief Get the value of the previous sector in sequence
+ @param sector A sector other than @ref FLOG_INIT_SECTOR
+ @return Previous sector
+ */
+static inline flog_sector_idx_t flog_decrement_sector(flog_sector_idx_t sector);
+
 static flog_result_t flog_flush_write(flog_write_file_t *file);
 
 /*!
@@ -271,13 +713,31 @@ static void flog_prealloc_push(flog_block_idx_t block, flog_block_age_t age);
 
 /*!
  @brief Take the youngest block from the preallocation list
+ @param threshold The number of extra free blocks that may be examined in
+ search of a younger block than those already preallocated
  @retval Index The allocated block index
- @retval FLOG_BLOCK_IDX_INVALID if empty
 
  @note This requires the allocation lock
  */
 static flog_block_alloc_t flog_prealloc_pop(int32_t threshold);
 
+/*!
+ @brief Take the next block from @ref flogfs_t::free_blocks, erasing it if
+ necessary
+ @param[out] claimed The block and its age. The block is FLOG_BLOCK_IDX_INVALID
+ if no free blocks remain.
+ @returns FLOG_FAILURE if an erase failed
+ */
+static flog_result_t flog_prealloc_claim(flog_block_alloc_t *claimed);
+
+/*!
+ @brief Trade preallocated blocks for younger free ones
+ @param budget The number of free blocks to examine
+
+ @note This requires the allocation lock
+ */
+static flog_result_t flog_prealloc_refine(int32_t budget);
+
 static uint_fast8_t flog_prealloc_contains(flog_block_idx_t block);
 
 static flog_result_t flog_prealloc_initialize();
@@ -285,20 +745,135 @@ static flog_result_t flog_prealloc_initialize();
 static flog_result_t flog_prealloc_prime();
 
 /*!
- @brief Invalidate a chain of blocks
- @param base The first block in the chain
+ @brief Queue a deleted file's blocks for reclamation
+ @param first_block The first block of the file
+ @param file_id The file ID, used to recognize blocks which still belong to it
+
+ If the queue is full the file is left for flog_reclaim_refill() to find
+ again, rather than erasing anything here.
+
+ @note This requires the delete lock
  */
-static void flog_invalidate_chain(flog_block_idx_t base, flog_file_id_t file_id);
+static void flog_reclaim_enqueue(flog_block_idx_t first_block, flog_file_id_t file_id);
 
 /*!
- @brief Check for a dirty block and flush it to allow for a new allocation
+ @brief Check whether a deleted file is waiting for its blocks to be erased
 
- @note This requires the allocation lock
+ @note This requires the delete lock
  */
-static void flog_flush_dirty_block();
+static uint_fast8_t flog_reclaim_is_queued(flog_file_id_t file_id);
+
+/*!
+ @brief Check whether a block is still part of a file
+ */
+static uint_fast8_t flog_file_owns(flog_block_idx_t block, flog_file_id_t file_id);
+
+/*!
+ @brief Erase one block from the oldest queued deleted file
+ @returns Non-zero if a block was erased, zero if there was nothing to do
+
+ Blocks are erased from the end of the chain towards the start so that the
+ rest of the chain stays reachable from the inode table if power is lost.
+ Freed blocks go straight to the preallocation list when there's room.
+
+ @note This requires the delete lock
+ */
+static uint_fast8_t flog_reclaim_step();
+
+/*!
+ @brief Queue deleted files which didn't fit in the queue when they were deleted
+
+ This reads the whole inode table, so it's only done once the queue is empty.
+
+ @note This requires the delete lock
+ */
+static void flog_reclaim_refill();
 
 static flog_result_t flog_commit_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n);
 
+/*!
+ @brief Program the write head's sector with what's buffered followed by data
+ */
+static void flog_program_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n);
+
+#if FS_WRITE_PAGES
+/*!
+ @brief Hold a full sector back until the rest of its page is ready
+ @returns Nonzero if the sector was held, zero if it has to be programmed now
+
+ The page is programmed once its last sector is held.
+ */
+static uint_fast8_t flog_hold_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n);
+
+/*!
+ @brief Program any held sectors, all at once if they make up a whole page
+ */
+static void flog_program_held_sectors(flog_write_file_t *file);
+
+/*!
+ @brief Program a whole page of file data
+ @param first The first sector of the page
+ @param data FS_SECTORS_PER_PAGE full sectors of data
+ */
+static void flog_program_file_page(flog_write_file_t *file, flog_sector_idx_t first, uint8_t const *data);
+
+/*!
+ @brief Program a whole page straight from the caller's buffer
+ @param file The file, which must be at the start of a data page
+ @param data FS_SECTORS_PER_PAGE full sectors of data
+ @returns Nonzero if the page was programmed, zero if the write head isn't at
+          the start of an empty data page
+
+ This skips the copy into the file's buffer and the commit for each sector.
+ */
+static uint_fast8_t flog_commit_file_page(flog_write_file_t *file, uint8_t const *data);
+#endif
+
+/*!
+ @brief Get the buffer for the write head's sector
+ */
+static uint8_t *flog_write_buffer(flog_write_file_t *file);
+
+/*!
+ @brief Get the first byte of a file which hasn't been programmed yet
+ */
+static uint8_t const *flog_write_unflushed(flog_write_file_t const *file);
+
+/*!
+ @brief Get the number of bytes of a file which have been programmed
+ */
+static uint32_t flog_write_committed(flog_write_file_t const *file);
+
+/*!
+ @brief Tell readers of a file how much of it has been committed
+ @param file The writer, with nothing left in its sector buffer
+ */
+static void flog_update_readers(flog_write_file_t const *file);
+
+/*!
+ @brief Call the notification of each reader following a file
+ */
+static void flog_notify_readers(flog_write_file_t const *file);
+
+/*!
+ @brief The work of flogfs_sync(), for callers which hold the locks
+ */
+static flog_result_t flog_sync_write(flog_write_file_t *file, flog_sync_level_t level);
+
+#if FS_WRITE_BEHIND
+/*!
+ @brief Write a file's queued data
+ @param file The file
+ @param partial Whether to take a partly filled sector at the end of the queue
+ @param budget As for flogfs_write_data()
+ @returns Nonzero if anything was written
+
+ The file system must be locked. The queue is only locked to look at it, so
+ more can be queued while this writes.
+ */
+static uint_fast8_t flog_write_behind_drain(flog_write_file_t *file, uint_fast8_t partial, uint_fast8_t *budget);
+#endif
+
 static flog_block_type_t flog_get_block_type(flog_block_idx_t block);
 
 static void flog_block_statistics_write(flog_block_idx_t block, flog_block_statistics_sector_with_key_t const *stat);
@@ -314,6 +889,11 @@ static uint_fast8_t invalid_block_or_older_version(flog_block_statistics_sector_
     return sector->header.version != flogfs.version || invalid_block(sector);
 }
 
+static uint_fast8_t invalid_checkpoint(flog_checkpoint_sector_t *sector) {
+    return sector->header.version != flogfs.version ||
+           memcmp(sector->key, flog_checkpoint_key, sizeof(flog_checkpoint_key)) != 0;
+}
+
 static uint_fast8_t invalid_sector_spare(flog_file_sector_spare_t *spare) {
     return spare->type_id == FLOG_SECTOR_TYPE_ID_ERASED && spare->nbytes == FLOG_SECTOR_NBYTES_ERASED;
 }
@@ -350,15 +930,97 @@ static uint_fast8_t is_file_init_sector_header_for_file(flog_file_init_sector_he
     return (file_id != FLOG_FILE_ID_ERASED) && (header->file_id == file_id);
 }
 
-static uint_fast8_t flog_prealloc_is_empty();
+/*!
+ @brief Restore the state saved by flogfs_unmount()
+ @retval FLOG_SUCCESS if a clean checkpoint was found and consumed
+ @retval FLOG_FAILURE if the volume must be inspected
 
-static uint_fast8_t flog_prealloc_is_full();
+ Checkpoint entries are appended sequentially, so the most recent one is found
+ with a binary search. Once restored, the entry is released so that a crash
+ before the next unmount falls back to a full inspection.
+ */
+static flog_result_t flog_checkpoint_restore();
 
-static flog_result_t unlock_and_fail() {
-    flash_unlock();
-    flog_unlock_fs();
-    return FLOG_FAILURE;
-}
+/*!
+ @brief Append a checkpoint entry describing the current state
+ */
+static flog_result_t flog_checkpoint_write();
+
+/*!
+ @brief Write a snapshot of every block's age and state
+ @returns The first block of the table or FLOG_BLOCK_IDX_INVALID
+
+ This visits the first page of every block, so it's only done on unmount where
+ it saves the following mount from having to do the same.
+ */
+static flog_block_idx_t flog_age_table_write();
+
+/*!
+ @brief Write a sector of age table entries and advance to the next sector
+ @param[in,out] link The index in @p chain of the table block being written
+ @param[in,out] sector The sector to write
+ */
+static void flog_age_table_write_sector(flog_block_alloc_t const *chain, uint16_t nchain, uint16_t *link, flog_sector_idx_t *sector,
+                                        flog_timestamp_t timestamp, flog_age_table_entry_t const *entries, uint16_t nentries);
+
+/*!
+ @brief Prime the preallocation list and @ref flogfs_t::free_blocks from the age
+ table in @ref flogfs_t::age_table
+ @returns FLOG_FAILURE if the table couldn't be read in its entirety
+
+ @note This requires the allocation lock
+ */
+static flog_result_t flog_age_table_load();
+
+/*!
+ @brief Rebuild @ref flogfs_t::free_blocks by visiting the first page of every
+ block
+
+ This is only necessary when there's no age table to rebuild it from, which
+ includes every mount after a power loss. Unwritten blocks found by
+ flog_linked_blocks_find() are kept for the file that names them. File blocks
+ newer than the inode table lost power before their file's entry was written
+ and are freed.
+
+ @note This has to follow flogfs_inspect(), which queues deleted files
+ */
+static void flog_free_blocks_scan();
+
+/*!
+ @brief Find the blocks named as the next block by a live file's tail sector
+ @param[out] linked One bit per block, set for each block found
+
+ A file's next block is allocated when its tail sector is written but only
+ written at its next commit. Power lost in between leaves it looking free.
+ */
+static void flog_linked_blocks_find(uint8_t *linked);
+
+/*!
+ @brief Check whether an unallocated block was written to before power was lost
+ @returns Non-zero if the block has to be erased before it's used
+
+ A block is only marked allocated by its init sector's spare, which goes after
+ the init sector and, for a table written by flogfs_compact(), after the
+ table's first entries too.
+ */
+static uint_fast8_t flog_unallocated_block_is_written(flog_block_idx_t block);
+
+/*!
+ @brief Erase a block, preserving and incrementing its age
+ @param block The block to erase
+ @param[in,out] stat The statistics previously read from the block
+ */
+static flog_result_t flog_erase_block_and_age(flog_block_idx_t block, flog_block_statistics_sector_with_key_t *stat);
+
+static uint_fast8_t flog_prealloc_is_empty();
+
+static uint_fast8_t flog_prealloc_is_full();
+
+static flog_result_t unlock_and_fail() {
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_FAILURE;
+}
 
 //! @}
 
@@ -366,12 +1028,22 @@ flog_result_t flogfs_initialize(flog_initialize_params_t *params) {
     fs_lock_initialize(&flogfs.allocate_lock);
     fs_lock_initialize(&flogfs.lock);
     fs_lock_initialize(&flogfs.delete_lock);
+#if FS_WRITE_BEHIND
+    fs_lock_initialize(&flogfs.write_behind_lock);
+#endif
+    for (uint_fast8_t i = 0; i < FLOG_WRITE_LOCKS; ++i) {
+        fs_lock_initialize(&flogfs.write_locks[i]);
+    }
 
     flogfs.state = FLOG_STATE_RESET;
     flogfs.cache_status.page_open = 0;
+    flogfs.cache_status.flash_open = 0;
+    flog_read_cache_reset();
     flogfs.version = 31337;
-    flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-    flogfs.dirty_block.file = NULL;
+
+    if (params->number_of_blocks > FS_MAXIMUM_BLOCKS) {
+        return FLOG_FAILURE;
+    }
 
     flogfs.params = *params;
 
@@ -382,16 +1054,19 @@ flog_result_t flogfs_initialize(flog_initialize_params_t *params) {
 flog_result_t flogfs_format() {
     flog_block_idx_t block;
     flog_block_idx_t first_valid = FLOG_BLOCK_IDX_INVALID;
+    flog_block_idx_t checkpoint_block = FLOG_BLOCK_IDX_INVALID;
 
     union {
         flog_inode_init_sector_t main_buffer;
         flog_inode_init_sector_spare_t spare_buffer;
+        flog_universal_init_sector_t checkpoint_buffer;
+        flog_checkpoint_init_sector_spare_t checkpoint_spare_buffer;
     } buffer_union;
 
     flog_block_statistics_sector_with_key_t statistics_sector;
 
-    flash_lock();
     flog_lock_fs();
+    flash_lock();
 
     flash_high_level(FLOG_FORMAT_BEGIN);
 
@@ -400,7 +1075,7 @@ flog_result_t flogfs_format() {
     }
     for (block = FS_FIRST_BLOCK; block < flogfs.params.number_of_blocks; block++) {
         flog_open_page(block, 0);
-        if (FLOG_FAILURE == flash_erase_block(block)) {
+        if (FLOG_FAILURE == flog_erase_block(block)) {
             flog_unlock_fs();
             flash_unlock();
             flash_debug_error("FLogFS:" LINESTR);
@@ -409,7 +1084,7 @@ flog_result_t flogfs_format() {
     }
     for (block = FS_FIRST_BLOCK; block < flogfs.params.number_of_blocks; block++) {
         flog_open_page(block, 0);
-        if (FLOG_SUCCESS == flash_block_is_bad()) {
+        if (FLOG_SUCCESS == flog_block_is_bad()) {
             continue;
         }
         flog_block_statistics_read(block, &statistics_sector);
@@ -429,7 +1104,7 @@ flog_result_t flogfs_format() {
         statistics_sector.header.next_age = FLOG_BLOCK_AGE_INVALID;
         statistics_sector.header.timestamp = 0;
         
-        if (FLOG_FAILURE == flash_erase_block(block)) {
+        if (FLOG_FAILURE == flog_erase_block(block)) {
             flog_unlock_fs();
             flash_unlock();
             flash_debug_error("FLogFS:" LINESTR);
@@ -441,23 +1116,41 @@ flog_result_t flogfs_format() {
 
         if (first_valid == FLOG_BLOCK_IDX_INVALID) {
             first_valid = block;
+        }
+        else {
+            checkpoint_block = block;
             break;
         }
     }
     
     assert(first_valid != FLOG_BLOCK_IDX_INVALID);
+    assert(checkpoint_block != FLOG_BLOCK_IDX_INVALID);
 
     flog_open_sector(first_valid, FLOG_INIT_SECTOR);
 
     buffer_union.main_buffer.universal.timestamp = 0;
     buffer_union.main_buffer.previous = FLOG_BLOCK_IDX_INVALID;
-    flash_write_sector((const uint8_t *)&buffer_union.main_buffer, FLOG_INIT_SECTOR, 0, sizeof(buffer_union.main_buffer));
+    buffer_union.main_buffer.max_file_id = 0;
+    flog_write_sector((const uint8_t *)&buffer_union.main_buffer, FLOG_INIT_SECTOR, 0, sizeof(buffer_union.main_buffer));
 
     buffer_union.spare_buffer.inode_index = 0;
     buffer_union.spare_buffer.type_id = FLOG_BLOCK_TYPE_INODE;
-    flash_write_spare((const uint8_t *)&buffer_union.spare_buffer, FLOG_INIT_SECTOR);
+    flog_write_spare((const uint8_t *)&buffer_union.spare_buffer, FLOG_INIT_SECTOR);
     
 
+    flash_commit();
+
+    // The block following the first inode block holds mount checkpoints
+    flog_open_sector(checkpoint_block, FLOG_INIT_SECTOR);
+
+    buffer_union.checkpoint_buffer.timestamp = 0;
+    flog_write_sector((const uint8_t *)&buffer_union.checkpoint_buffer, FLOG_INIT_SECTOR, 0, sizeof(buffer_union.checkpoint_buffer));
+
+    buffer_union.checkpoint_spare_buffer.type_id = FLOG_BLOCK_TYPE_CHECKPOINT;
+    buffer_union.checkpoint_spare_buffer.nothing = 0;
+    buffer_union.checkpoint_spare_buffer.reserved = 0;
+    flog_write_spare((const uint8_t *)&buffer_union.checkpoint_spare_buffer, FLOG_INIT_SECTOR);
+
     flash_commit();
 
     flash_high_level(FLOG_FORMAT_END);
@@ -469,27 +1162,16 @@ flog_result_t flogfs_format() {
 
 flog_result_t flog_prealloc_initialize() {
     flogfs.prealloc.n = 0;
-    flogfs.prealloc.free = NULL;
-    flogfs.prealloc.available = NULL;
-    flogfs.prealloc.pending = NULL;
-
-    for (uint8_t i = 0; i < FS_PREALLOCATE_SIZE; ++i) {
-        flog_block_alloc_t *block = &flogfs.prealloc.blocks[i];
-        block->block = FLOG_BLOCK_IDX_INVALID;
-        block->age = FLOG_BLOCK_AGE_INVALID;
-        block->next = flogfs.prealloc.free;
-        flogfs.prealloc.free = block;
-    }
+    flogfs.prealloc.npending = 0;
+    memset(flogfs.prealloc.contains, 0, sizeof(flogfs.prealloc.contains));
+    memset(flogfs.prealloc.pending, 0, sizeof(flogfs.prealloc.pending));
 
     return FLOG_SUCCESS;
 }
 
 flog_result_t flog_prealloc_prime() {
-    flog_block_statistics_sector_with_key_t statistics_sector;
-    flog_inode_init_sector_spare_t inode_spare;
-    flog_block_idx_t block;
+    flog_block_alloc_t claimed;
     flog_result_t fr;
-    uint32_t tries = 64;
 
     flog_lock_fs();
     flash_lock();
@@ -498,29 +1180,88 @@ flog_result_t flog_prealloc_prime() {
 
     flash_debug_warn("Priming");
 
-    while (!flog_prealloc_is_full() && --tries > 0) {
-        block = flash_random(flogfs.params.number_of_blocks);
+    while (!flog_prealloc_is_full()) {
+        if (FLOG_FAILURE == flog_prealloc_claim(&claimed)) {
+            return unlock_and_fail();
+        }
+        if (claimed.block != FLOG_BLOCK_IDX_INVALID) {
+            flog_prealloc_push(claimed.block, claimed.age);
+            continue;
+        }
+
+        // Out of free blocks, so deleted files can't wait any longer. Just
+        // enough is done to keep the allocator going.
+        if (!flog_prealloc_is_empty()) {
+            break;
+        }
+        flog_lock_delete();
+        uint_fast8_t reclaimed = flog_reclaim_step();
+        flog_unlock_delete();
+        if (!reclaimed) {
+            break;
+        }
+    }
+
+    fr = FLOG_RESULT(!flog_prealloc_is_empty());
+    if (fr == FLOG_FAILURE) {
+        flash_debug_error("flog_prealloc_prime: flog_prealloc_is_empty");
+    }
+
+    flash_high_level(FLOG_PRIME_END);
+
+    flog_unlock_fs();
+    flash_unlock();
+    return FLOG_SUCCESS;
+}
+
+static flog_result_t flog_prealloc_claim(flog_block_alloc_t *claimed) {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_inode_init_sector_spare_t inode_spare;
+    flog_block_idx_t block;
+    uint_fast8_t stale;
+
+    claimed->block = FLOG_BLOCK_IDX_INVALID;
+    claimed->age = FLOG_BLOCK_AGE_INVALID;
+
+    // Sweep the free bitmap from where the last sweep left off so that
+    // allocations rotate through the whole device. Blocks that are already
+    // erased are preferred, the others are left for flogfs_gc_step if possible.
+    for (flog_block_idx_t i = 2 * flogfs.params.number_of_blocks; i; i--) {
+        uint_fast8_t const erased_only = i > flogfs.params.number_of_blocks;
+
+        block = flogfs.allocate_head;
+        if (++flogfs.allocate_head >= flogfs.params.number_of_blocks) {
+            flogfs.allocate_head = 0;
+        }
 
-        if (block == 0) {
+        if (!flog_free_blocks_test(block)) {
+            continue;
+        }
+        if (erased_only && flog_bitset_test(flogfs.erase_blocks, block)) {
             continue;
         }
 
+        // Whatever happens below, the block is no longer up for grabs
+        stale = flog_bitset_test(flogfs.erase_blocks, block);
+        flog_free_blocks_clear(block);
+        flog_bitset_clear(flogfs.erase_blocks, block);
+
         if (flog_prealloc_contains(block)) {
             flash_debug_warn("%d: Prealloc contains", block);
             continue;
         }
 
-        if (FLOG_FAILURE == flash_open_page(block, 0)) {
+        if (FLOG_FAILURE == flog_open_page(block, 0)) {
             flash_debug_warn("%d: Unable to open", block);
             continue;
         }
 
-        if (FLOG_SUCCESS == flash_block_is_bad()) {
+        if (FLOG_SUCCESS == flog_block_is_bad()) {
             flash_debug_warn("%d: Bad block", block);
             continue;
         }
         flog_block_statistics_read(block, &statistics_sector);
-        flash_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
         flog_close_sector();
 
         if (invalid_block_or_older_version(&statistics_sector)) {
@@ -531,69 +1272,125 @@ flog_result_t flog_prealloc_prime() {
             statistics_sector.header.version = flogfs.version;
             memcpy(statistics_sector.key, flog_block_statistics_key, sizeof(flog_block_statistics_key));
 
-            if (FLOG_FAILURE == flash_erase_block(block)) {
-                return unlock_and_fail();
+            if (FLOG_FAILURE == flog_erase_block(block)) {
+                return FLOG_FAILURE;
             }
 
             flog_block_statistics_write(block, &statistics_sector);
             flash_commit();
-
-            flog_prealloc_push(block, statistics_sector.header.age);
         }
         else {
             switch (inode_spare.type_id) {
             case FLOG_BLOCK_TYPE_UNALLOCATED: {
-                flog_prealloc_push(block, statistics_sector.header.age);
+                // Such as the start of a table flogfs_compact() didn't finish
+                if (stale && FLOG_FAILURE == flog_erase_block_and_age(block, &statistics_sector)) {
+                    return FLOG_FAILURE;
+                }
+                break;
+            }
+            case FLOG_BLOCK_TYPE_INODE:
+            case FLOG_BLOCK_TYPE_AGE_TABLE: {
+                // Age tables are consumed by the mount that follows them and
+                // inode blocks only get here once compaction has replaced them
+                if (FLOG_FAILURE == flog_erase_block_and_age(block, &statistics_sector)) {
+                    return FLOG_FAILURE;
+                }
                 break;
             }
             default: {
+                // Such as file blocks orphaned by a power loss, which the
+                // free block scan marks stale
+                if (stale) {
+                    if (FLOG_FAILURE == flog_erase_block_and_age(block, &statistics_sector)) {
+                        return FLOG_FAILURE;
+                    }
+                    break;
+                }
                 flash_debug_warn("%d: Bad type (%d)", block, inode_spare.type_id);
-                break;
+                continue;
             }
             }
         }
-    }
 
-    fr = FLOG_RESULT(!flog_prealloc_is_empty());
-    if (fr == FLOG_FAILURE) {
-        flash_debug_error("flog_prealloc_prime: flog_prealloc_is_empty");
+        claimed->block = block;
+        claimed->age = statistics_sector.header.age;
+        return FLOG_SUCCESS;
     }
 
-    flash_high_level(FLOG_PRIME_END);
-
-    flog_unlock_fs();
-    flash_unlock();
     return FLOG_SUCCESS;
 }
 
-static flog_block_idx_t flogfs_find_first_inode() {
+static flog_block_idx_t flogfs_find_first_inode(flog_inode_init_sector_t *init_sector) {
     flog_block_statistics_sector_with_key_t statistics_sector;
     flog_inode_init_sector_spare_t inode_spare;
+    flog_inode_init_sector_t candidate;
     flog_block_idx_t block;
+    flog_block_idx_t found = FLOG_BLOCK_IDX_INVALID;
+
+    memset(init_sector, 0, sizeof(flog_inode_init_sector_t));
 
     for (block = FS_FIRST_BLOCK; block < FS_INODE0_MAX_BLOCK; block++) {
-        if (!flash_open_page(block, 0)) {
+        if (!flog_open_page(block, 0)) {
             continue;
         }
 
-        if (flash_block_is_bad()) {
+        if (flog_block_is_bad()) {
             continue;
         }
 
         flog_block_statistics_read(block, &statistics_sector);
-        flash_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
         flog_close_sector();
 
         if (invalid_block_or_older_version(&statistics_sector)) {
             continue;
         }
 
-        // TODO: Previous if we found two inode0 blocks we would compare
-        // timestamps. Should we be guarding against that?
-        if (inode_spare.type_id == FLOG_BLOCK_TYPE_INODE) {
-            if (inode_spare.inode_index == 0) {
-                return block;
-            }
+        if (inode_spare.type_id != FLOG_BLOCK_TYPE_INODE || inode_spare.inode_index != 0) {
+            continue;
+        }
+
+        // The table replaced by flogfs_compact() lingers until it's erased
+        flog_open_sector(block, FLOG_INIT_SECTOR);
+        flog_read_sector((uint8_t *)&candidate, FLOG_INIT_SECTOR, 0, sizeof(flog_inode_init_sector_t));
+        flog_close_sector();
+
+        if (found == FLOG_BLOCK_IDX_INVALID || candidate.universal.timestamp > init_sector->universal.timestamp) {
+            found = block;
+            *init_sector = candidate;
+        }
+    }
+
+    return found;
+}
+
+static flog_block_idx_t flogfs_find_checkpoint() {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_checkpoint_init_sector_spare_t checkpoint_spare;
+    flog_block_idx_t block;
+    flog_block_idx_t last_block = MIN((flog_block_idx_t)FS_INODE0_MAX_BLOCK, (flog_block_idx_t)flogfs.params.number_of_blocks);
+
+    // Formatting places this right after the first inode block, but the inode
+    // table may have been moved by flogfs_compact()
+    for (block = FS_FIRST_BLOCK; block < last_block; block++) {
+        if (!flog_open_page(block, 0)) {
+            continue;
+        }
+
+        if (flog_block_is_bad()) {
+            continue;
+        }
+
+        flog_block_statistics_read(block, &statistics_sector);
+        flog_read_spare((uint8_t *)&checkpoint_spare, FLOG_INIT_SECTOR);
+        flog_close_sector();
+
+        if (invalid_block_or_older_version(&statistics_sector)) {
+            continue;
+        }
+
+        if (checkpoint_spare.type_id == FLOG_BLOCK_TYPE_CHECKPOINT) {
+            return block;
         }
     }
 
@@ -602,24 +1399,63 @@ static flog_block_idx_t flogfs_find_first_inode() {
 
 static flog_result_t flogfs_inspect() {
     flog_inode_iterator_t inode_iter;
-    flog_inode_file_allocation_header_t allocation;
+    flog_inode_file_allocation_t allocation;
+    flog_inode_file_invalidation_header_t invalidation;
+    flog_file_hint_t hint;
 
     for (flog_inode_iterator_initialize(&inode_iter, flogfs.inode0); ; flog_inode_iterator_next(&inode_iter)) {
         flog_open_sector(inode_iter.block, inode_iter.sector);
-        flash_read_sector((uint8_t *)&allocation, inode_iter.sector, 0, sizeof(flog_inode_file_allocation_header_t));
-        if (invalid_inode_file_allocation_header(&allocation)) {
+        flog_read_sector((uint8_t *)&allocation, inode_iter.sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (invalid_inode_file_allocation_header(&allocation.header)) {
             break;
         }
 
-        if (allocation.file_id > flogfs.max_file_id) {
-            flogfs.max_file_id = allocation.file_id;
+        if (allocation.header.file_id > flogfs.max_file_id) {
+            flogfs.max_file_id = allocation.header.file_id;
+        }
+        if (allocation.header.timestamp > flogfs.t) {
+            flogfs.t = allocation.header.timestamp;
+        }
+
+        // Deletions are the only other thing stamped in the inode table
+        flog_open_sector(inode_iter.block, inode_iter.sector + 1);
+        flog_read_sector((uint8_t *)&invalidation, inode_iter.sector + 1, 0, sizeof(flog_inode_file_invalidation_header_t));
+        if (invalid_timestamp(invalidation.timestamp)) {
+#if FS_FILE_INDEX_SIZE
+            allocation.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+            flog_file_index_insert(allocation.filename, &inode_iter, allocation.header.file_id, allocation.header.first_block);
+#endif
+            continue;
+        }
+        if (invalidation.timestamp > flogfs.t) {
+            flogfs.t = invalidation.timestamp;
+        }
+
+        if (flog_inode_is_close_record(&allocation)) {
+            hint.block = allocation.header.first_block;
+            hint.position = ((flog_inode_close_record_t *)&allocation)->position;
+            flog_file_index_hint(allocation.header.file_id, &hint);
+            continue;
+        }
+
+        // The first block goes last, so if it's still there so is reclamation
+        if (flog_file_owns(allocation.header.first_block, allocation.header.file_id)) {
+            flog_reclaim_enqueue(allocation.header.first_block, allocation.header.file_id);
         }
     }
 
+    flogfs.inode_tail_block = inode_iter.block;
+    flogfs.inode_tail_sector = inode_iter.sector;
+#if FS_FILE_INDEX_SIZE
+    flogfs.file_index.built = 1;
+#endif
+
     return FLOG_SUCCESS;
 }
 
 flog_result_t flogfs_mount() {
+    flog_inode_init_sector_t inode_init_sector;
+
     flog_lock_fs();
 
     if (flogfs.state == FLOG_STATE_MOUNTED) {
@@ -632,23 +1468,53 @@ flog_result_t flogfs_mount() {
     flogfs.allocate_head = 0;
     flogfs.max_file_id = 0;
     flogfs.cache_status = { 0 };
+    flog_read_cache_reset();
     flogfs.read_head = NULL;
     flogfs.write_head = NULL;
-    flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-    flogfs.dirty_block.file = NULL;
-    flogfs.inode0 = flogfs_find_first_inode();
+    flogfs.t = 0;
+    flogfs.age_table = FLOG_BLOCK_IDX_INVALID;
+    flogfs.reclaim.head = 0;
+    flogfs.reclaim.n = 0;
+    flogfs.reclaim.overflow = 0;
+    flogfs.reclaim.depth = 0;
+    flog_file_index_reset();
+    flogfs.inode0 = flogfs_find_first_inode(&inode_init_sector);
 
     if (flogfs.inode0 == FLOG_BLOCK_IDX_INVALID) {
         return unlock_and_fail();
     }
+
+    // Compaction drops deleted entries, these remember what they stamped
+    flogfs.t = inode_init_sector.universal.timestamp;
+    flogfs.max_file_id = inode_init_sector.max_file_id;
     printk("1 Debug FLogFS Mount Error!\n");
 
-    if (!flogfs_inspect()) {
-        return unlock_and_fail();
+    flogfs.checkpoint_block = flogfs_find_checkpoint();
+
+    // Reclaiming deleted files found by inspection may already free blocks
+    flog_prealloc_initialize();
+    memset(flogfs.free_blocks, 0, sizeof(flogfs.free_blocks));
+    memset(flogfs.erase_blocks, 0, sizeof(flogfs.erase_blocks));
+
+    // Only fall back to scanning the inode table after an unclean unmount
+    if (!flog_checkpoint_restore()) {
+        if (!flogfs_inspect()) {
+            return unlock_and_fail();
+        }
     }
     printk("2 Debug FLogFS Mount Error!\n");
 
-    flog_prealloc_initialize();
+    if (flogfs.age_table != FLOG_BLOCK_IDX_INVALID && !flog_age_table_load()) {
+        // Only a clean mount gets here, so there's nothing else to lose
+        flog_prealloc_initialize();
+        memset(flogfs.free_blocks, 0, sizeof(flogfs.free_blocks));
+        memset(flogfs.erase_blocks, 0, sizeof(flogfs.erase_blocks));
+        flogfs.age_table = FLOG_BLOCK_IDX_INVALID;
+    }
+    if (flogfs.age_table == FLOG_BLOCK_IDX_INVALID) {
+        flog_free_blocks_scan();
+    }
+    flogfs.age_table = FLOG_BLOCK_IDX_INVALID;
 
     if (!flog_prealloc_prime()) {
         return unlock_and_fail();
@@ -662,6 +1528,111 @@ flog_result_t flogfs_mount() {
     return FLOG_SUCCESS;
 }
 
+flog_result_t flogfs_unmount() {
+    flog_result_t fr;
+
+    flog_lock_fs();
+
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flog_unlock_fs();
+        return FLOG_FAILURE;
+    }
+
+    // Everything has to be on flash before the checkpoint can describe it
+    while (flogfs.write_head != NULL) {
+        if (!flogfs_close_write(flogfs.write_head)) {
+            flog_unlock_fs();
+            return FLOG_FAILURE;
+        }
+    }
+    flogfs.read_head = NULL;
+
+    flash_lock();
+
+    // Without a checkpoint nothing would ever find the table
+    if (flogfs.checkpoint_block != FLOG_BLOCK_IDX_INVALID) {
+        flogfs.age_table = flog_age_table_write();
+    }
+
+    fr = flog_checkpoint_write();
+
+    flogfs.state = FLOG_STATE_RESET;
+
+    flash_unlock();
+    flog_unlock_fs();
+    return fr;
+}
+
+void flogfs_read_cache_stats(flog_read_cache_stats_t *stats) {
+    flash_lock();
+    *stats = flogfs.read_cache.stats;
+    flash_unlock();
+}
+
+uint32_t flogfs_gc_step(uint32_t budget) {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_block_alloc_t claimed;
+    uint32_t used = 0;
+
+    flog_lock_fs();
+
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flog_unlock_fs();
+        return 0;
+    }
+
+    flash_lock();
+    flog_lock_delete();
+    flog_lock_allocate();
+
+    // Deleted files come first, their blocks go straight to the allocator
+    while (used < budget && flog_reclaim_step()) {
+        used++;
+    }
+
+    // Then stale blocks, so that priming never has to erase
+    for (flog_block_idx_t block = 0; block < flogfs.params.number_of_blocks && used < budget; ++block) {
+        if (!flog_bitset_test(flogfs.erase_blocks, block)) {
+            continue;
+        }
+
+        flog_bitset_clear(flogfs.erase_blocks, block);
+        used++;
+
+        if (FLOG_FAILURE == flog_open_page(block, 0) || FLOG_SUCCESS == flog_block_is_bad()) {
+            flog_free_blocks_clear(block);
+            continue;
+        }
+
+        flog_block_statistics_read(block, &statistics_sector);
+        flog_close_sector();
+
+        // As in flog_prealloc_claim, blocks from another version start over
+        if (invalid_block_or_older_version(&statistics_sector)) {
+            memset(&statistics_sector, 0, sizeof(statistics_sector));
+        }
+
+        // A failure leaves the block for flog_prealloc_claim to sort out
+        flog_erase_block_and_age(block, &statistics_sector);
+    }
+
+    // Then top up the preallocation list
+    while (used < budget && !flog_prealloc_is_full()) {
+        if (FLOG_FAILURE == flog_prealloc_claim(&claimed) || claimed.block == FLOG_BLOCK_IDX_INVALID) {
+            break;
+        }
+
+        flog_prealloc_push(claimed.block, claimed.age);
+        used++;
+    }
+
+    flog_unlock_allocate();
+    flog_unlock_delete();
+    flash_unlock();
+    flog_unlock_fs();
+    return used;
+}
+
 flog_result_t flogfs_fsck() {
     flog_lock_fs();
 
@@ -679,8 +1650,8 @@ flog_result_t flogfs_fsck() {
 
 flog_result_t flogfs_open_read(flog_read_file_t *file, char const *filename) {
     flog_file_find_result_t find_result;
+    flog_file_hint_t hint;
     flog_inode_iterator_t inode_iter;
-    flog_file_sector_spare_t file_sector_spare;
     flog_read_file_t *file_iter;
 
     if (strlen(filename) >= FLOG_MAX_FNAME_LEN) {
@@ -690,33 +1661,26 @@ flog_result_t flogfs_open_read(flog_read_file_t *file, char const *filename) {
     flog_lock_fs();
     flash_lock();
 
-    find_result = flog_find_file(filename, &inode_iter);
+    find_result = flog_find_file(filename, &inode_iter, &hint);
     if (find_result.first_block == FLOG_BLOCK_IDX_INVALID) {
         goto failure;
     }
 
-    file->read_head = 0;
     file->first_block = find_result.first_block;
-    file->block = file->first_block;
     file->id = find_result.file_id;
+    flogfs_read_rewind(file);
 
-    if (!flogfs_read_calc_file_size(file)) {
-        goto failure;
-    }
+    file->skip_n = 0;
+    file->skip_span = 0;
+    flog_read_skip_add(file, file->first_block, 0);
+    file->last = file->skip[0];
 
-    flog_open_sector(file->block, FLOG_INIT_SECTOR);
-    flash_read_spare((uint8_t *)&file_sector_spare, FLOG_INIT_SECTOR);
-    if (file_sector_spare.nbytes != 0) {
-        file->sector = FLOG_INIT_SECTOR;
-        file->offset = sizeof(flog_file_init_sector_header_t);
-    } else {
-        flog_open_sector(file->block, 1);
-        flash_read_spare((uint8_t *)&file_sector_spare, 1);
-        file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-        file->offset = 0;
-    }
+    file->notify = NULL;
+    file->notify_arg = NULL;
 
-    file->sector_remaining_bytes = file_sector_spare.nbytes;
+    if (!flogfs_read_calc_file_size(file, &hint)) {
+        goto failure;
+    }
 
     file->next = 0;
     if (flogfs.read_head) {
@@ -726,6 +1690,7 @@ flog_result_t flogfs_open_read(flog_read_file_t *file, char const *filename) {
     } else {
         flogfs.read_head = file;
     }
+    flog_count_reader(file, 1);
 
     flash_unlock();
     flog_unlock_fs();
@@ -745,16 +1710,16 @@ flog_result_t flogfs_close_read(flog_read_file_t *file) {
         flogfs.read_head = file->next;
     } else {
         iter = flogfs.read_head;
-        while (iter->next) {
-            if (iter->next == file) {
-                iter->next = file->next;
-                break;
-            }
+        while (iter && iter->next != file) {
             iter = iter->next;
         }
-        flog_unlock_fs();
-        return FLOG_FAILURE;
+        if (!iter) {
+            flog_unlock_fs();
+            return FLOG_FAILURE;
+        }
+        iter->next = file->next;
     }
+    flog_count_reader(file, -1);
     flog_unlock_fs();
     return FLOG_SUCCESS;
 }
@@ -766,7 +1731,7 @@ flog_result_t flogfs_check_exists(char const *filename) {
     flog_lock_fs();
     flash_lock();
 
-    find_result = flog_find_file(filename, &inode_iter);
+    find_result = flog_find_file(filename, &inode_iter, NULL);
 
     flash_unlock();
     flog_unlock_fs();
@@ -775,89 +1740,70 @@ flog_result_t flogfs_check_exists(char const *filename) {
 }
 
 uint32_t flogfs_read(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
-    uint32_t count = 0;
-    uint16_t to_read;
-    flog_file_sector_spare_t file_sector_spare;
-    flog_block_idx_t block;
-    flog_sector_idx_t sector;
+    uint32_t count;
 
-    union {
-        flog_file_tail_sector_header_t file_tail_sector_header;
-        flog_file_init_sector_header_t file_init_sector_header;
-    } buffer_union;
+    flash_lock();
+
+    count = flogfs_read_data(file, dst, nbytes);
+
+    flash_unlock();
+
+    return count;
+}
+
+uint32_t flogfs_readv(flog_read_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt) {
+    uint32_t count = 0;
+    uint32_t n;
 
-    flog_lock_fs();
     flash_lock();
 
-    while (nbytes) {
-        if (file->sector_remaining_bytes == 0) {
-            // We are/were at the end of file, look into the existence of new data
-            // This block is responsible for setting:
-            // -- file->sector_remaining_bytes
-            // -- file->offset
-            // -- file->sector
-            // -- file->block
-            // and bailing on the loop if EOF is encountered
-            if (file->sector == FLOG_TAIL_SECTOR) {
-                // This was the last sector in the block, check the next
-                flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-                flash_read_sector((uint8_t *)&buffer_union.file_tail_sector_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
-                block = buffer_union.file_tail_sector_header.universal.next_block;
-                // Now check out that new block and make sure it's legit
-                flog_open_sector(block, FLOG_INIT_SECTOR);
-                flash_read_sector((uint8_t *)&buffer_union.file_init_sector_header, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
-                if (buffer_union.file_init_sector_header.file_id != file->id) {
-                    // This next block hasn't been written. EOF for now
-                    goto done;
-                }
+    for (uint_fast8_t i = 0; i < iovcnt; ++i) {
+        n = flogfs_read_data(file, (uint8_t *)iov[i].data, iov[i].length);
+        count += n;
+        if (n < iov[i].length) {
+            break;
+        }
+    }
 
-                file->block = block;
+    flash_unlock();
 
-                flash_read_spare((uint8_t *)&file_sector_spare, FLOG_INIT_SECTOR);
-                if (file_sector_spare.nbytes == 0) {
-                    // It's possible for the first sector to have 0 bytes
-                    // Data is in next sector
-                    file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-                }
-                else {
-                    file->sector = FLOG_INIT_SECTOR;
-                }
-            } else {
-                // Increment to next sector but don't necessarily update file state
-                sector = flog_increment_sector(file->sector);
+    return count;
+}
 
-                flog_open_sector(file->block, sector);
-                flash_read_spare((uint8_t *)&file_sector_spare, sector);
+static uint32_t flogfs_read_data(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
+    uint32_t count = 0;
+    uint16_t to_read;
 
-                if (invalid_sector_spare(&file_sector_spare)) {
-                    // We're looking at an empty sector, GTFO
-                    goto done;
-                }
-                else {
-                    file->sector = sector;
-                }
-            }
+    while (nbytes) {
+        // Writers keep file_size current, so there's no need to go looking on
+        // flash. Anything more is still with the writer.
+        if (file->sector_remaining_bytes == 0 && file->read_head - file->unflushed_bytes >= file->file_size) {
+            count += flogfs_read_unflushed(file, dst, nbytes);
+            break;
+        }
 
-            file->sector_remaining_bytes = file_sector_spare.nbytes;
-            switch (file->sector) {
-            case FLOG_TAIL_SECTOR:
-                file->offset = sizeof(flog_file_tail_sector_header_t);
-                break;
-            case FLOG_INIT_SECTOR:
-                file->offset = sizeof(flog_file_init_sector_header_t);
-                break;
-            default:
-                file->offset = 0;
+        if (file->sector_remaining_bytes == 0 && !file->unflushed_bytes && nbytes >= 2 * FS_SECTOR_SIZE) {
+            to_read = flogfs_read_bulk(file, dst, nbytes);
+            count += to_read;
+            nbytes -= to_read;
+            dst += to_read;
+            // That may have been the last of what's on flash
+            if (to_read) {
+                continue;
             }
         }
 
+        if (file->sector_remaining_bytes == 0 && !flogfs_read_next_sector(file)) {
+            break;
+        }
+
         // Figure out how many to read
         to_read = MIN(nbytes, file->sector_remaining_bytes);
 
         if (to_read) {
             // Read this sector now
             flog_open_sector(file->block, file->sector);
-            flash_read_sector(dst, file->sector, file->offset, to_read);
+            flog_read_sector(dst, file->sector, file->offset, to_read);
             count += to_read;
             nbytes -= to_read;
             dst += to_read;
@@ -868,1080 +1814,3120 @@ uint32_t flogfs_read(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
         }
     }
 
+    return count;
+}
+
+uint16_t flogfs_read_view(flog_read_file_t *file, flog_read_span_t *span, uint8_t *buffer) {
+    uint8_t const *mapped;
+
+    span->data = NULL;
+    span->length = 0;
+
+    flash_lock();
+
+    while (file->sector_remaining_bytes == 0) {
+        if (file->read_head - file->unflushed_bytes >= file->file_size) {
+            // The writer's buffer may change under a view, so copy it out
+            span->length = flogfs_read_unflushed(file, buffer, FS_SECTOR_SIZE);
+            if (span->length) {
+                span->data = buffer;
+            }
+            goto done;
+        }
+        if (!flogfs_read_next_sector(file)) {
+            goto done;
+        }
+    }
+
+    span->length = file->sector_remaining_bytes;
+    flog_open_sector(file->block, file->sector);
+    mapped = flog_map_sector(file->sector, file->offset);
+    if (mapped) {
+        span->data = mapped;
+    } else {
+        flog_read_sector(buffer, file->sector, file->offset, span->length);
+        span->data = buffer;
+    }
+
+    file->offset += span->length;
+    file->sector_remaining_bytes = 0;
+    file->read_head += span->length;
+
 done:
     flash_unlock();
-    flog_unlock_fs();
 
-    return count;
+    return span->length;
 }
 
-uint32_t flogfs_write(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes) {
+uint32_t flogfs_read_reverse(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
+    flog_write_file_t const *writer;
     uint32_t count = 0;
-    flog_sector_nbytes_t bytes_written;
+    uint16_t to_read;
 
-    flog_lock_fs();
     flash_lock();
 
+    // Anything past the end of flash is still in the writer's buffer, unless
+    // the writer has since gone without committing it
+    writer = flog_find_writer(file->id);
+    if (!writer && file->read_head > file->file_size && !flogfs_read_seek_to(file, file->file_size)) {
+        goto done;
+    }
+
+    // Bring the flash position up to the read head first
+    if (file->unflushed_bytes && !flogfs_read_seek_to(file, file->read_head)) {
+        goto done;
+    }
+
+    // Fill dst from the end
+    nbytes = MIN(nbytes, file->read_head);
+    dst += nbytes;
+
+    if (file->read_head > file->file_size) {
+        to_read = MIN(nbytes, file->unflushed_bytes);
+        dst -= to_read;
+        memcpy(dst, flog_write_unflushed(writer) + (file->unflushed_bytes - to_read), to_read);
+        file->read_head -= to_read;
+        file->unflushed_bytes -= to_read;
+        count += to_read;
+        nbytes -= to_read;
+    }
+
     while (nbytes) {
-        if (nbytes >= file->sector_remaining_bytes) {
-            bytes_written = file->sector_remaining_bytes;
-            if (flog_commit_file_sector(file, src, file->sector_remaining_bytes) == FLOG_FAILURE) {
+        to_read = file->offset - flog_sector_data_offset(file->sector);
+        if (to_read == 0) {
+            if (!flogfs_read_previous_sector(file)) {
                 break;
             }
-
-            src += bytes_written;
-            nbytes -= bytes_written;
-            count += bytes_written;
-        } else {
-            memcpy(file->sector_buffer + file->offset, src, nbytes);
-            count += nbytes;
-            file->sector_remaining_bytes -= nbytes;
-            file->offset += nbytes;
-            file->bytes_in_block += nbytes;
-            file->file_size += nbytes;
-            nbytes = 0;
+            continue;
         }
+
+        to_read = MIN(nbytes, to_read);
+        dst -= to_read;
+        file->offset -= to_read;
+        file->sector_remaining_bytes += to_read;
+        file->read_head -= to_read;
+
+        flog_open_sector(file->block, file->sector);
+        flog_read_sector(dst, file->sector, file->offset, to_read);
+        count += to_read;
+        nbytes -= to_read;
+    }
+
+    // Only possible if the chain is broken
+    if (nbytes) {
+        memmove(dst - nbytes, dst, count);
     }
 
+done:
     flash_unlock();
-    flog_unlock_fs();
 
     return count;
 }
 
-uint32_t flogfs_read_file_size(flog_read_file_t *file) {
-    return file->file_size;
-}
-
-uint32_t flogfs_write_file_size(flog_write_file_t *file) {
-    return file->file_size;
-}
-
-typedef struct flogfs_walk_file_state_t {
-    flog_block_idx_t block;
-    flog_sector_idx_t sector;
-    uint_fast8_t last_block;
-    flog_file_tail_sector_header_t *tail_header;
-    flog_file_sector_spare_t *sector_spare;
-} flogfs_walk_file_state_t;
-
-typedef enum {
-    FLOG_WALK_FAILURE,
-    FLOG_WALK_CONTINUE,
-    FLOG_WALK_STOP,
-    FLOG_WALK_SKIP_BLOCK,
-} flog_read_walk_file_result_t;
-
-typedef flog_read_walk_file_result_t (*file_walk_file_fn_t)(flogfs_walk_file_state_t *state, void *arg);
+static uint32_t flogfs_read_bulk(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
+    flog_file_sector_spare_t spares[FLOG_BULK_READ_SECTORS];
+    flog_sector_idx_t last_sector = (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - 1;
+    flog_sector_idx_t first;
+    uint16_t n;
+    uint16_t full;
 
-static flog_read_walk_file_result_t flogfs_read_walk_sectors(flog_read_file_t *file, flogfs_walk_file_state_t *state, file_walk_file_fn_t walk, void *arg) {
-    flog_file_sector_spare_t file_sector_spare;
+    if (file->sector == FLOG_TAIL_SECTOR) {
+        return 0;
+    }
 
-    state->sector = FLOG_INIT_SECTOR;
-    state->sector_spare = &file_sector_spare;
+    // Only the sectors after the first page follow each other on flash
+    first = flog_increment_sector(file->sector);
+    if (first < FS_SECTORS_PER_PAGE) {
+        return 0;
+    }
 
-    while (true) {
-        flog_open_sector(state->block, state->sector);
-        flash_read_spare((uint8_t *)&file_sector_spare, state->sector);
-        if (invalid_sector_spare(&file_sector_spare)) {
-            break;
-        }
+    n = MIN(nbytes / FS_SECTOR_SIZE, (uint32_t)MIN(last_sector - first + 1, FLOG_BULK_READ_SECTORS));
+    if (n < 2) {
+        return 0;
+    }
 
-        switch (walk(state, arg)) {
-        case FLOG_WALK_FAILURE: {
-            return FLOG_WALK_FAILURE;
-        }
-        case FLOG_WALK_STOP: {
-            return FLOG_WALK_STOP;
-        }
-        case FLOG_WALK_SKIP_BLOCK: {
-            return FLOG_WALK_CONTINUE;
-        }
-        case FLOG_WALK_CONTINUE: {
-            break;
-        }
-        default: {
-            assert(false);
+#if FS_FLASH_READ_SECTORS
+    flogfs.read_cache.stats.misses++;
+    if (!flash_read_sectors(file->block, first, n, dst, (uint8_t *)spares)) {
+        flogfs.cache_status.flash_open = 0;
+        return 0;
+    }
+    // The backend opened pages of its own
+    flogfs.cache_status.flash_open = 0;
+#else
+    for (uint16_t i = 0; i < n; ++i) {
+        flog_open_sector(file->block, first + i);
+        flog_read_spare((uint8_t *)&spares[i], first + i);
+        if (invalid_sector_spare(&spares[i]) || spares[i].nbytes != FS_SECTOR_SIZE) {
+            n = i;
             break;
         }
-        }
+        flog_read_sector(dst + i * FS_SECTOR_SIZE, first + i, 0, FS_SECTOR_SIZE);
+    }
+#endif
 
-        if (state->sector == FLOG_TAIL_SECTOR) {
+    for (full = 0; full < n; ++full) {
+        if (invalid_sector_spare(&spares[full]) || spares[full].nbytes != FS_SECTOR_SIZE) {
             break;
         }
-
-        state->sector = flog_increment_sector(state->sector);
+    }
+    if (!full) {
+        return 0;
     }
 
-    return FLOG_WALK_CONTINUE;
-}
+    file->sector = first + full - 1;
+    file->offset = FS_SECTOR_SIZE;
+    file->sector_remaining_bytes = 0;
+    file->read_head += full * FS_SECTOR_SIZE;
 
-static flog_result_t flogfs_read_walk_file(flog_read_file_t *file, file_walk_file_fn_t walk, void *arg) {
-    flog_file_tail_sector_header_t tail_header;
-    flogfs_walk_file_state_t state;
-    state.block = file->first_block;
-    state.tail_header = &tail_header;
+    return full * FS_SECTOR_SIZE;
+}
 
-    while (1) {
-        state.sector_spare = nullptr;
+static flog_result_t flogfs_read_next_sector(flog_read_file_t *file) {
+    flog_file_sector_spare_t file_sector_spare;
+    flog_block_idx_t block;
+    flog_block_nbytes_t block_bytes;
+    flog_sector_idx_t sector;
+    uint16_t skip;
 
-        flog_open_sector(state.block, FLOG_TAIL_SECTOR);
-        flash_read_sector((uint8_t *)&tail_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
-        state.last_block = invalid_file_tail_sector_header(&tail_header);
+    union {
+        flog_file_tail_sector_header_t file_tail_sector_header;
+        flog_file_init_sector_header_t file_init_sector_header;
+    } buffer_union;
 
-        switch (walk(&state, arg)) {
-        case FLOG_WALK_FAILURE: {
+    if (file->sector == FLOG_TAIL_SECTOR) {
+        // This was the last sector in the block, check the next
+        flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+        flog_read_sector((uint8_t *)&buffer_union.file_tail_sector_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+        block = buffer_union.file_tail_sector_header.universal.next_block;
+        block_bytes = buffer_union.file_tail_sector_header.bytes_in_block;
+        // Now check out that new block and make sure it's legit
+        flog_open_sector(block, FLOG_INIT_SECTOR);
+        flog_read_sector((uint8_t *)&buffer_union.file_init_sector_header, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+        if (buffer_union.file_init_sector_header.file_id != file->id) {
+            // This next block hasn't been written. EOF for now
             return FLOG_FAILURE;
         }
-        case FLOG_WALK_STOP: {
-            return FLOG_SUCCESS;
+
+        file->block = block;
+        file->block_position += block_bytes;
+        flog_read_skip_add(file, file->block, file->block_position);
+        if (file->block_position > file->last.position) {
+            file->last.block = file->block;
+            file->last.position = file->block_position;
         }
-        case FLOG_WALK_CONTINUE: {
-            switch (flogfs_read_walk_sectors(file, &state, walk, arg)) {
-            case FLOG_WALK_FAILURE: {
-                return FLOG_FAILURE;
-            }
-            case FLOG_WALK_STOP: {
-                return FLOG_SUCCESS;
-            }
-            case FLOG_WALK_CONTINUE: {
-                break;
-            }
-            default: {
-                assert(false);
-                break;
-            }
+
+        // The first sector may hold no data, in which case the caller just
+        // comes back for the next one
+        flog_read_spare((uint8_t *)&file_sector_spare, FLOG_INIT_SECTOR);
+        file->sector = FLOG_INIT_SECTOR;
+    } else {
+        // Increment to next sector but don't necessarily update file state
+        sector = flog_increment_sector(file->sector);
+
+        // Nothing has been read from the init sector, it may have been
+        // written since the file was opened
+        if (file->sector == FLOG_INIT_SECTOR && file->offset == sizeof(flog_file_init_sector_header_t)) {
+            flog_open_sector(file->block, FLOG_INIT_SECTOR);
+            flog_read_spare((uint8_t *)&file_sector_spare, FLOG_INIT_SECTOR);
+            if (!invalid_sector_spare(&file_sector_spare) && file_sector_spare.nbytes) {
+                sector = FLOG_INIT_SECTOR;
             }
-            break;
-        }
-        case FLOG_WALK_SKIP_BLOCK: {
-            break;
-        }
         }
 
-        if (state.last_block) {
-            break;
+        if (sector != FLOG_INIT_SECTOR) {
+            flog_open_sector(file->block, sector);
+            flog_read_spare((uint8_t *)&file_sector_spare, sector);
         }
 
-        if (state.block == tail_header.universal.next_block) {
+        if (invalid_sector_spare(&file_sector_spare)) {
+            // We're looking at an empty sector, GTFO
             return FLOG_FAILURE;
         }
-        state.block = tail_header.universal.next_block;
+        else {
+            file->sector = sector;
+        }
     }
 
+    file->sector_remaining_bytes = file_sector_spare.nbytes;
+    file->offset = flog_sector_data_offset(file->sector);
+
+    // Skip whatever was already read out of the writer's buffer
+    skip = MIN(file->unflushed_bytes, file->sector_remaining_bytes);
+    file->offset += skip;
+    file->sector_remaining_bytes -= skip;
+    file->unflushed_bytes -= skip;
+
     return FLOG_SUCCESS;
 }
 
-flog_read_walk_file_result_t file_size_calculator_walk(flogfs_walk_file_state_t *state, void *arg) {
-    if (state->sector_spare != nullptr) {
-        *((uint32_t *)arg) += state->sector_spare->nbytes;
-    }
-    else {
-        if (!state->last_block) {
-            *((uint32_t *)arg) += state->tail_header->bytes_in_block;
-            return FLOG_WALK_SKIP_BLOCK;
-        }
+static uint32_t flogfs_read_unflushed(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes) {
+    flog_write_file_t const *writer = flog_find_writer(file->id);
+    uint32_t buffered;
+
+    if (!writer) {
+        return 0;
     }
 
-    return FLOG_WALK_CONTINUE;
+    // The writer's buffer holds everything after the last committed byte
+    buffered = file->read_head - file->file_size;
+    nbytes = MIN(nbytes, writer->file_size - file->read_head);
+    memcpy(dst, flog_write_unflushed(writer) + buffered, nbytes);
+
+    file->read_head += nbytes;
+    file->unflushed_bytes += nbytes;
+
+    return nbytes;
 }
 
-static flog_result_t flogfs_read_calc_file_size(flog_read_file_t *file) {
-    file->file_size = 0;
-    return flogfs_read_walk_file(file, file_size_calculator_walk, &file->file_size);
+uint32_t flogfs_write(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes) {
+    flog_iovec_t iov;
+
+    iov.data = (void *)src;
+    iov.length = nbytes;
+    return flogfs_writev(file, &iov, 1);
 }
 
-typedef struct file_seek_t {
-    flog_result_t status;
-    uint32_t position;
-    uint32_t desired;
-    flog_block_idx_t block;
-    flog_sector_idx_t sector;
-    uint16_t offset;
-    uint16_t bytes_remaining;
-} file_seek_t;
+uint32_t flogfs_writev(flog_write_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt) {
+    uint_fast8_t budget = FS_BOUNDED_WRITE_SECTORS;
+    uint_fast8_t *bound;
+    uint_fast8_t queued = 0;
+    uint32_t count;
+    uint32_t n;
+
+    // Most small writes only fill the file's buffer, which doesn't need the
+    // file system lock
+    count = flog_write_buffered(file, iov, iovcnt);
+    if (count) {
+        return count;
+    }
 
-flog_read_walk_file_result_t file_seek_walk(flogfs_walk_file_state_t *state, void *arg) {
-    file_seek_t *seek = (file_seek_t *)arg;
+    flog_lock_fs();
+    flash_lock();
+    flog_lock_write_file(file);
 
-    seek->block = state->block;
-    seek->sector = state->sector;
+    bound = file->bounded ? &budget : NULL;
 
-    if (state->sector_spare == nullptr) {
-        if (state->last_block) {
-            return FLOG_WALK_CONTINUE;
-        }
-        uint32_t end_of_block = seek->position + state->tail_header->bytes_in_block;
-        if (seek->desired > end_of_block) {
-            seek->position = end_of_block;
-            return FLOG_WALK_SKIP_BLOCK;
+#if FS_WRITE_BEHIND
+    flog_write_behind_drain(file, 1, bound);
+    // A bounded write can leave some of the queue for the next call, and the
+    // new data has to go after it
+    queued = file->queue_n != 0;
+#endif
+    for (uint_fast8_t i = 0; i < iovcnt && !queued; ++i) {
+        n = flogfs_write_data(file, (uint8_t const *)iov[i].data, iov[i].length, bound);
+        count += n;
+        if (n < iov[i].length) {
+            break;
         }
     }
-    else {
-        uint32_t end_of_sector = seek->position + state->sector_spare->nbytes;
-        if (seek->desired > end_of_sector) {
-            seek->position = end_of_sector;
-            return FLOG_WALK_CONTINUE;
-        }
-        else {
-            seek->status = FLOG_SUCCESS;
-            seek->offset = (seek->desired - seek->position);
-            seek->bytes_remaining = state->sector_spare->nbytes - seek->offset;
-            return FLOG_WALK_STOP;
-        }
-    }
-
-    return FLOG_WALK_CONTINUE;
-}
-
-flog_result_t flogfs_read_seek(flog_read_file_t *file, uint32_t position) {
-    file_seek_t seek;
-    flog_result_t fr = FLOG_SUCCESS;
-
-    flog_lock_fs();
-
-    if (flogfs.state != FLOG_STATE_MOUNTED) {
-        flog_unlock_fs();
-        return FLOG_FAILURE;
-    }
-
-    flash_lock();
-
-    seek.position = 0;
-    seek.desired = position;
-    seek.block = file->first_block;
-    seek.sector = FLOG_INIT_SECTOR;
-    seek.status = FLOG_FAILURE;
-
-    if (!flogfs_read_walk_file(file, file_seek_walk, &seek)) {
-        fr = FLOG_FAILURE;
-    }
-    else {
-        fr = seek.status;
-        file->block = seek.block;
-        file->sector = seek.sector;
-        file->offset = seek.offset;
-        file->sector_remaining_bytes = seek.bytes_remaining;
+    if (count) {
+        flog_notify_readers(file);
     }
+#if FS_WRITE_BEHIND
+    // Anything still queued, or queued meanwhile, comes after what was written
+    flog_lock_write_behind();
+    file->queue_end += count;
+    flog_unlock_write_behind();
+#endif
 
+    flog_unlock_write_file(file);
     flash_unlock();
     flog_unlock_fs();
-    return fr;
 
+    return count;
 }
 
-uint32_t flogfs_read_tell(flog_read_file_t *file) {
-  return file->read_head;
-}
+static uint32_t flog_write_buffered(flog_write_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt) {
+    uint32_t count = 0;
+    uint_fast8_t fits;
 
-flog_result_t flogfs_open_write(flog_write_file_t *file, char const *filename) {
-    flog_inode_iterator_t inode_iter;
-    flog_block_alloc_t alloc_block;
-    flog_file_find_result_t find_result;
-    flog_file_sector_spare_t file_sector_spare;
-    union {
-        flog_inode_file_allocation_t allocation;
-        flog_file_init_sector_header_t file_init_sector_header;
-        flog_file_tail_sector_header_t file_tail_sector_header;
-    } buffer_union;
+    for (uint_fast8_t i = 0; i < iovcnt; ++i) {
+        count += iov[i].length;
+    }
 
-    flog_lock_fs();
+    flog_lock_write_file(file);
+#if FS_WRITE_BEHIND
+    flog_lock_write_behind();
+#endif
 
-    if (flogfs.state != FLOG_STATE_MOUNTED) {
-        flog_unlock_fs();
-        return FLOG_FAILURE;
+    // Filling the buffer up commits it, and readers look at what's in it
+    fits = count && count < file->sector_remaining_bytes && !file->readers;
+#if FS_WRITE_BEHIND
+    fits = fits && !file->queue_n;
+#endif
+    if (fits) {
+        for (uint_fast8_t i = 0; i < iovcnt; ++i) {
+            memcpy(flog_write_buffer(file) + file->offset, iov[i].data, iov[i].length);
+            file->offset += iov[i].length;
+        }
+        file->sector_remaining_bytes -= count;
+        file->bytes_in_block += count;
+        file->file_size += count;
+#if FS_WRITE_BEHIND
+        file->queue_end += count;
+#endif
     }
 
-    flash_lock();
+#if FS_WRITE_BEHIND
+    flog_unlock_write_behind();
+#endif
+    flog_unlock_write_file(file);
 
-    find_result = flog_find_file(filename, &inode_iter);
+    return fits ? count : 0;
+}
 
-    file->base_threshold = 0;
+void flogfs_write_bounded(flog_write_file_t *file, uint_fast8_t bounded) {
+    flog_lock_fs();
+    file->bounded = bounded ? 1 : 0;
+    flog_unlock_fs();
+}
 
-    if (find_result.first_block != FLOG_BLOCK_IDX_INVALID) {
-        // TODO: Make sure file isn't already open for writing
+static uint32_t flogfs_write_data(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes, uint_fast8_t *budget) {
+    uint32_t count = 0;
+    flog_sector_nbytes_t bytes_written;
 
-        // File already exists
-        file->block = find_result.first_block;
-        file->id = find_result.file_id;
-        file->sector = FLOG_INIT_SECTOR;
-        // Count bytes from 0
-        file->file_size = 0;
-        // Iterate to the end of the file
-        // First check each terminated block
-        while (1) {
-            flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-            flash_read_sector((uint8_t *)&buffer_union.file_tail_sector_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
-            if (invalid_file_tail_sector_header(&buffer_union.file_tail_sector_header)) {
-                // This block is incomplete
-                break;
+    while (nbytes) {
+#if FS_WRITE_PAGES
+        if (nbytes >= FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE && (!budget || *budget >= FS_SECTORS_PER_PAGE) &&
+            flog_commit_file_page(file, src)) {
+            if (budget) {
+                *budget -= FS_SECTORS_PER_PAGE;
             }
-            file->block = buffer_union.file_tail_sector_header.universal.next_block;
-            file->file_size += buffer_union.file_tail_sector_header.bytes_in_block;
+            src += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+            nbytes -= FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+            count += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+            continue;
         }
-        // Now file->block is the first incomplete block
-        // Scan it sector-by-sector
-        while (1) {
-            // For each block in the file
-            flog_open_sector(file->block, file->sector);
-            flash_read_spare((uint8_t *)&file_sector_spare, file->sector);
-            if (invalid_sector_spare(&file_sector_spare)) {
-                // No data
-                // We will write here!
-                if (file->sector == FLOG_TAIL_SECTOR) {
-                    file->offset = sizeof(flog_file_tail_sector_header_t);
-                } else {
-                    file->offset = 0;
-                }
-                file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+#endif
+        if (nbytes >= file->sector_remaining_bytes) {
+            if (budget && *budget == 0) {
                 break;
             }
-            file->file_size += file_sector_spare.nbytes;
-            file->sector = flog_increment_sector(file->sector);
-        }
-    } else {
-        if (flog_inode_prepare_new(&inode_iter) != FLOG_SUCCESS) {
-            goto failure;
+            bytes_written = file->sector_remaining_bytes;
+            if (flog_commit_file_sector(file, src, file->sector_remaining_bytes) == FLOG_FAILURE) {
+                break;
+            }
+            if (budget) {
+                *budget -= 1;
+            }
+
+            src += bytes_written;
+            nbytes -= bytes_written;
+            count += bytes_written;
+        } else {
+            memcpy(flog_write_buffer(file) + file->offset, src, nbytes);
+            count += nbytes;
+            file->sector_remaining_bytes -= nbytes;
+            file->offset += nbytes;
+            file->bytes_in_block += nbytes;
+            file->file_size += nbytes;
+            nbytes = 0;
         }
+    }
 
-        strcpy(buffer_union.allocation.filename, filename);
-        buffer_union.allocation.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+    return count;
+}
 
-        flog_lock_allocate();
+#if FS_WRITE_BEHIND
+uint32_t flogfs_write_async(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes) {
+    uint32_t count = 0;
+    uint16_t n;
+    uint_fast8_t ready = 0;
 
-        flog_flush_dirty_block();
+    flog_lock_write_behind();
 
-        alloc_block = flog_allocate_block(file->base_threshold);
-        if (alloc_block.block == FLOG_BLOCK_IDX_INVALID) {
-            flog_unlock_allocate();
-            goto failure;
+    while (nbytes) {
+        if (file->queue_fill == FS_SECTOR_SIZE) {
+            if (file->queue_n == FS_WRITE_BEHIND) {
+                break;
+            }
+            file->queue_n++;
+            file->queue_fill = 0;
         }
 
-        flogfs.dirty_block.block = alloc_block.block;
-        flogfs.dirty_block.file = file;
-
-        flog_unlock_allocate();
-
-        buffer_union.allocation.header.file_id = ++flogfs.max_file_id;
-        buffer_union.allocation.header.first_block = alloc_block.block;
-        buffer_union.allocation.header.first_block_age = ++alloc_block.age;
-        buffer_union.allocation.header.timestamp = ++flogfs.t;
-
-        // Write the new inode entry
-        flog_open_sector(inode_iter.block, inode_iter.sector);
-        flash_write_sector((uint8_t *)&buffer_union.allocation, inode_iter.sector, 0, sizeof(flog_inode_file_allocation_t));
-        flash_commit();
+        n = nbytes < (uint32_t)(FS_SECTOR_SIZE - file->queue_fill) ? nbytes : FS_SECTOR_SIZE - file->queue_fill;
+        memcpy(file->queue[(file->queue_head + file->queue_n - 1) % FS_WRITE_BEHIND] + file->queue_fill, src, n);
+        file->queue_fill += n;
+        src += n;
+        nbytes -= n;
+        count += n;
 
-        file->block = alloc_block.block;
-        file->block_age = alloc_block.age;
-        file->id = flogfs.max_file_id;
-        file->bytes_in_block = 0;
-        file->file_size = 0;
-        file->sector = FLOG_INIT_SECTOR;
-        file->offset = sizeof(flog_file_init_sector_header_t);
-        file->sector_remaining_bytes = FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
+        if (file->queue_fill == FS_SECTOR_SIZE) {
+            ready = 1;
+        }
     }
+    file->queue_end += count;
 
-    file->next = NULL;
-    if (flogfs.write_head == NULL) {
-        flogfs.write_head = file;
-    } else {
-        flog_write_file_t *file_iter;
-        for (file_iter = flogfs.write_head; file_iter->next; file_iter = file_iter->next) {
-        }
-        file_iter->next = file;
+    flog_unlock_write_behind();
+
+#if FS_FLASH_WRITE_BEHIND_READY
+    if (ready) {
+        flash_write_behind_ready();
     }
+#else
+    (void)ready;
+#endif
 
-    flash_unlock();
-    flog_unlock_fs();
+    return count;
+}
 
-    return FLOG_SUCCESS;
+uint32_t flogfs_write_queued_size(flog_write_file_t *file) {
+    uint32_t size;
 
-failure:
-    flash_unlock();
-    flog_unlock_fs();
+    flog_lock_write_behind();
+    size = file->queue_end;
+    flog_unlock_write_behind();
 
-    return FLOG_FAILURE;
+    return size;
 }
 
-/*!
- @details
- ### Internals
- To close a write, all outstanding data must simply be flushed to flash. If any
- blocks are newly-allocated, they must be committed.
+void flogfs_write_behind(flog_write_file_t *file, flog_write_done_fn_t done, void *arg) {
+    flog_lock_fs();
+    file->done = done;
+    file->done_arg = arg;
+    flog_unlock_fs();
+}
 
- TODO: Deal with files that can't be flushed due to no space for allocation
- */
-flog_result_t flogfs_close_write(flog_write_file_t *file) {
-    flog_write_file_t *iter;
-    flog_result_t result;
+uint_fast8_t flogfs_write_behind_flush() {
+    uint_fast8_t wrote = 0;
 
     flog_lock_fs();
     flash_lock();
 
-    if (flogfs.write_head == file) {
-        flogfs.write_head = file->next;
-    } else {
-        iter = flogfs.write_head;
-        while (iter->next) {
-            if (iter->next == file) {
-                iter->next = file->next;
-                break;
-            }
-            iter = iter->next;
+    for (flog_write_file_t *file = flogfs.write_head; file; file = file->next) {
+        flog_lock_write_file(file);
+        if (flog_write_behind_drain(file, 0, NULL)) {
+            flog_notify_readers(file);
+            wrote = 1;
         }
-        goto failure;
-    }
-    if((file->offset != 0) && (file->offset != 16 && file->sector != FLOG_TAIL_SECTOR)){
-        result = flog_flush_write(file);
+        flog_unlock_write_file(file);
     }
 
     flash_unlock();
     flog_unlock_fs();
 
-    return result;
-
-failure:
-    flash_unlock();
-    flog_unlock_fs();
-    return FLOG_FAILURE;
+    return wrote;
 }
 
-flog_result_t flogfs_rm(char const *filename) {
-    flog_file_find_result_t find_result;
-    flog_inode_iterator_t inode_iter;
-    flog_block_idx_t block, next_block;
-    flog_inode_file_invalidation_t invalidation;
+static uint_fast8_t flog_write_behind_drain(flog_write_file_t *file, uint_fast8_t partial, uint_fast8_t *budget) {
+    uint8_t const *data;
+    uint16_t n;
+    uint32_t written;
+    uint_fast8_t wrote = 0;
 
-    flog_lock_fs();
-    flash_lock();
+    while (true) {
+        flog_lock_write_behind();
+        if (file->queue_n == 0 || (file->queue_n == 1 && file->queue_fill < FS_SECTOR_SIZE && !partial)) {
+            flog_unlock_write_behind();
+            break;
+        }
+        // Full sectors are never touched again by flogfs_write_async()
+        n = (file->queue_n == 1 ? file->queue_fill : FS_SECTOR_SIZE) - file->queue_skip;
+        data = file->queue[file->queue_head] + file->queue_skip;
+        flog_unlock_write_behind();
+
+        written = flogfs_write_data(file, data, n, budget);
+        if (written) {
+            wrote = 1;
+        }
 
-    find_result = flog_find_file(filename, &inode_iter);
-    if (find_result.first_block == FLOG_BLOCK_IDX_INVALID) {
-        goto failure;
-    }
+        flog_lock_write_behind();
+        // A partly filled sector may have grown since, in which case the rest
+        // of it stays queued
+        file->queue_skip += written;
+        if (file->queue_skip == (file->queue_n == 1 ? file->queue_fill : FS_SECTOR_SIZE)) {
+            file->queue_head = (file->queue_head + 1) % FS_WRITE_BEHIND;
+            file->queue_skip = 0;
+            if (--file->queue_n == 0) {
+                file->queue_fill = FS_SECTOR_SIZE;
+            }
+        }
+        flog_unlock_write_behind();
 
-    // Navigate to the end to find the last block
-    block = find_result.first_block;
-    while (1) {
-        next_block = flog_universal_get_next_block(block);
-        if (next_block == FLOG_BLOCK_IDX_INVALID) {
+        if (written < n) {
+            // Out of space, so leave the rest queued
             break;
         }
-        block = next_block;
     }
 
-    invalidation.header.last_block = block;
-    invalidation.header.timestamp = ++flogfs.t;
-    flog_open_sector(inode_iter.block, inode_iter.sector + 1);
-    flash_write_sector((uint8_t *)&invalidation, inode_iter.sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
-    flash_commit();
-
-    flog_invalidate_chain(find_result.first_block, find_result.file_id);
+    if (wrote && file->done) {
+        file->done(file, flog_write_committed(file), file->done_arg);
+    }
 
-    flash_unlock();
-    flog_unlock_fs();
-    return FLOG_SUCCESS;
+    return wrote;
+}
+#endif
 
-failure:
-    flash_unlock();
-    flog_unlock_fs();
-    return FLOG_FAILURE;
+uint32_t flogfs_read_file_size(flog_read_file_t *file) {
+    return file->file_size;
 }
 
-void flogfs_start_ls(flogfs_ls_iterator_t *iter) {
-    flog_inode_iterator_initialize(iter, flogfs.inode0);
+uint32_t flogfs_write_file_size(flog_write_file_t *file) {
+    uint32_t size;
+
+    flog_lock_write_file(file);
+    size = file->file_size;
+    flog_unlock_write_file(file);
+
+    return size;
 }
 
-uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t *iter, char *fname_dst) {
-    union {
-        flog_inode_file_allocation_header_t allocation;
-        flog_inode_file_invalidation_t invalidation;
-    } buffer_union;
+typedef struct flogfs_walk_file_state_t {
+    flog_block_idx_t block;
+    flog_sector_idx_t sector;
+    uint_fast8_t last_block;
+    flog_file_tail_sector_header_t *tail_header;
+    flog_file_sector_spare_t *sector_spare;
+} flogfs_walk_file_state_t;
 
-    while (1) {
-        flog_open_sector(iter->block, iter->sector);
-        flash_read_sector((uint8_t *)&buffer_union.allocation, iter->sector, 0, sizeof(flog_inode_file_allocation_header_t));
-        if (invalid_file_id(buffer_union.allocation.file_id)) {
-            // Nothing here. Done.
-            return 0;
-        }
-        // Now check to see if it's valid
-        flog_open_sector(iter->block, iter->sector + 1);
-        flash_read_sector((uint8_t *)&buffer_union.invalidation, iter->sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
-        if (invalid_timestamp(buffer_union.invalidation.header.timestamp)) {
-            // This file's good
-            // Now check to see if it's valid
-            // Go read the filename
-            flog_open_sector(iter->block, iter->sector);
-            flash_read_sector((uint8_t *)fname_dst, iter->sector, sizeof(flog_inode_file_allocation_header_t), FLOG_MAX_FNAME_LEN);
-            fname_dst[FLOG_MAX_FNAME_LEN - 1] = '\0';
-            flog_inode_iterator_next(iter);
-            return 1;
-        } else {
-            flog_inode_iterator_next(iter);
+typedef enum {
+    FLOG_WALK_FAILURE,
+    FLOG_WALK_CONTINUE,
+    FLOG_WALK_STOP,
+    FLOG_WALK_SKIP_BLOCK,
+} flog_read_walk_file_result_t;
+
+typedef flog_read_walk_file_result_t (*file_walk_file_fn_t)(flogfs_walk_file_state_t *state, void *arg);
+
+static flog_read_walk_file_result_t flogfs_read_walk_sectors(flog_read_file_t *file, flogfs_walk_file_state_t *state, file_walk_file_fn_t walk, void *arg) {
+    flog_file_sector_spare_t file_sector_spare;
+
+    state->sector = FLOG_INIT_SECTOR;
+    state->sector_spare = &file_sector_spare;
+
+    while (true) {
+        flog_open_sector(state->block, state->sector);
+        flog_read_spare((uint8_t *)&file_sector_spare, state->sector);
+        if (invalid_sector_spare(&file_sector_spare)) {
+            break;
+        }
+
+        switch (walk(state, arg)) {
+        case FLOG_WALK_FAILURE: {
+            return FLOG_WALK_FAILURE;
+        }
+        case FLOG_WALK_STOP: {
+            return FLOG_WALK_STOP;
+        }
+        case FLOG_WALK_SKIP_BLOCK: {
+            return FLOG_WALK_CONTINUE;
+        }
+        case FLOG_WALK_CONTINUE: {
+            break;
+        }
+        default: {
+            assert(false);
+            break;
+        }
+        }
+
+        if (state->sector == FLOG_TAIL_SECTOR) {
+            break;
         }
+
+        state->sector = flog_increment_sector(state->sector);
     }
-}
 
-void flogfs_stop_ls(flogfs_ls_iterator_t *iter) {
+    return FLOG_WALK_CONTINUE;
 }
 
-flog_result_t flog_commit_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n) {
-    flog_file_sector_spare_t file_sector_spare;
+static flog_result_t flogfs_read_walk_file(flog_read_file_t *file, flog_block_idx_t block, file_walk_file_fn_t walk, void *arg) {
+    flog_file_tail_sector_header_t tail_header;
+    flogfs_walk_file_state_t state;
+    state.block = block;
+    state.tail_header = &tail_header;
 
-    if (file->sector == FLOG_TAIL_SECTOR) {
-        printk("flog_commit_file_sector: FLOG_TAIL_SECTOR n: %d\n", n);
-        flog_file_tail_sector_header_t *const file_tail_sector_header = (flog_file_tail_sector_header_t *)file->sector_buffer;
-        flog_block_alloc_t next_block;
+    while (1) {
+        state.sector_spare = nullptr;
 
-        flog_lock_allocate();
+        flog_open_sector(state.block, FLOG_TAIL_SECTOR);
+        flog_read_sector((uint8_t *)&tail_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+        state.last_block = invalid_file_tail_sector_header(&tail_header);
 
-        flog_flush_dirty_block();
+        // A tail sector can name a block that lost power before its init
+        // sector was written, which ends the chain just like a read would
+        if (state.last_block && block != state.block && !flog_file_owns(state.block, file->id)) {
+            break;
+        }
 
-        next_block = flog_allocate_block(file->base_threshold);
-        if (next_block.block == FLOG_BLOCK_IDX_INVALID) {
-            flog_unlock_allocate();
+        switch (walk(&state, arg)) {
+        case FLOG_WALK_FAILURE: {
             return FLOG_FAILURE;
         }
+        case FLOG_WALK_STOP: {
+            return FLOG_SUCCESS;
+        }
+        case FLOG_WALK_CONTINUE: {
+            switch (flogfs_read_walk_sectors(file, &state, walk, arg)) {
+            case FLOG_WALK_FAILURE: {
+                return FLOG_FAILURE;
+            }
+            case FLOG_WALK_STOP: {
+                return FLOG_SUCCESS;
+            }
+            case FLOG_WALK_CONTINUE: {
+                break;
+            }
+            default: {
+                assert(false);
+                break;
+            }
+            }
+            break;
+        }
+        case FLOG_WALK_SKIP_BLOCK: {
+            break;
+        }
+        }
 
-        flogfs.dirty_block.block = next_block.block;
-        flogfs.dirty_block.file = file;
+        if (state.last_block) {
+            break;
+        }
 
-        flog_unlock_allocate();
+        if (state.block == tail_header.universal.next_block) {
+            return FLOG_FAILURE;
+        }
+        state.block = tail_header.universal.next_block;
+    }
 
-        uint16_t bytes_in_sector = FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
-        bytes_in_sector = file->offset + n - sizeof(flog_file_tail_sector_header_t);
+    return FLOG_SUCCESS;
+}
 
-        // Prepare the header
-        // memzero(file_tail_sector_header, sizeof(flog_file_tail_sector_header_t)); // Optional
-        file->bytes_in_block += n; // Not bytes_in_sector, this is updated on in memory/non-flushed writes.
-        file_sector_spare.nbytes = bytes_in_sector;
-        file_tail_sector_header->universal.next_age = next_block.age + 1;
-        file_tail_sector_header->universal.next_block = next_block.block;
-        file_tail_sector_header->universal.timestamp = ++flogfs.t;
-        file_tail_sector_header->bytes_in_block = file->bytes_in_block;
+flog_read_walk_file_result_t file_size_calculator_walk(flogfs_walk_file_state_t *state, void *arg) {
+    flog_read_file_t *file = (flog_read_file_t *)arg;
 
-        flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-        flash_write_sector((uint8_t const *)file_tail_sector_header, FLOG_TAIL_SECTOR, 0, file->offset);
-        if (n) {
-            flash_write_sector(data, FLOG_TAIL_SECTOR, file->offset, n);
+    if (state->sector_spare != nullptr) {
+        file->file_size += state->sector_spare->nbytes;
+    }
+    else {
+        flog_read_skip_add(file, state->block, file->file_size);
+        file->last.block = state->block;
+        file->last.position = file->file_size;
+        if (!state->last_block) {
+            file->file_size += state->tail_header->bytes_in_block;
+            return FLOG_WALK_SKIP_BLOCK;
         }
-        flash_write_spare((uint8_t const *)&file_sector_spare, FLOG_TAIL_SECTOR);
-        flash_commit();
+    }
 
-        // Ready the file structure for the next block/sector
-        file->block = next_block.block;
-        file->block_age = next_block.age;
-        file->sector = FLOG_INIT_SECTOR;
-        file->sector_remaining_bytes = FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
-        file->offset = sizeof(flog_file_init_sector_header_t);
-        file->bytes_in_block = 0;
-        file->file_size += n;
+    return FLOG_WALK_CONTINUE;
+}
 
-        return FLOG_SUCCESS;
-    } else {
-        flog_file_init_sector_header_t *const file_init_sector_header = (flog_file_init_sector_header_t *)file->sector_buffer;
+static flog_result_t flogfs_read_calc_file_size(flog_read_file_t *file, flog_file_hint_t const *hint) {
+    // Files only ever grow, so a recorded block stays valid as long as the file
+    if (hint->block != FLOG_BLOCK_IDX_INVALID && flog_file_owns(hint->block, file->id)) {
+        file->file_size = hint->position;
+        return flogfs_read_walk_file(file, hint->block, file_size_calculator_walk, file);
+    }
 
-        uint16_t bytes_in_sector = file->offset + n;
+    file->file_size = 0;
+    return flogfs_read_walk_file(file, file->first_block, file_size_calculator_walk, file);
+}
 
-        flog_lock_allocate();
-        // So if this block is the dirty block...
-        if (flogfs.dirty_block.file == file) {
-            flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-            flogfs.dirty_block.file = nullptr;
-        }
-        flog_unlock_allocate();
-        file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
-        file_sector_spare.nbytes = bytes_in_sector;
+static flog_read_skip_t const *flog_read_skip_find(flog_read_file_t const *file, uint32_t position) {
+    uint_fast8_t low = 0;
+    uint_fast8_t high = file->skip_n;
 
-        // We need to just write the data and advance
-        if (file->sector == FLOG_INIT_SECTOR) {
-            // memzero(file_init_sector_header, sizeof(flog_file_init_sector_header_t)); // Optional
-            file_init_sector_header->file_id = file->id;
-            file_init_sector_header->age = file->block_age;
-            file_sector_spare.nbytes -= sizeof(flog_file_init_sector_header_t); // file->offset had accounted for this.
+    while (high - low > 1) {
+        uint_fast8_t middle = (low + high) / 2;
+        if (file->skip[middle].position <= position) {
+            low = middle;
+        } else {
+            high = middle;
         }
+    }
 
-        flog_open_sector(file->block, file->sector);
-        if (file->offset) {
-            // This is either sector 0 or there was data already
-            // First write prior data/header
-            flash_write_sector(file->sector_buffer, file->sector, 0, file->offset);
+    return &file->skip[low];
+}
+
+static void flog_read_skip_add(flog_read_file_t *file, flog_block_idx_t block, uint32_t position) {
+    uint32_t span = MAX(file->skip_span, 1);
+    uint_fast8_t i = 0;
+
+    if (file->skip_n) {
+        i = flog_read_skip_find(file, position) - file->skip;
+        if (position - file->skip[i].position < span) {
+            return;
         }
-        if (n) {
-            flash_write_sector(data, file->sector, file->offset, n);
+        i++;
+        if (i < file->skip_n && file->skip[i].position - position < span) {
+            return;
         }
+    }
 
-        flash_write_spare((uint8_t const *)&file_sector_spare, file->sector);
-        flash_commit();
+    if (file->skip_n == FS_READ_SKIP_SIZE) {
+        for (uint_fast8_t j = 1; 2 * j < file->skip_n; ++j) {
+            file->skip[j] = file->skip[2 * j];
+        }
+        file->skip_n = (file->skip_n + 1) / 2;
+        file->skip_span = file->skip_span ? file->skip_span * 2 : file->skip[1].position - file->skip[0].position;
+        flog_read_skip_add(file, block, position);
+        return;
+    }
 
-        // Now update stuff for the new sector
-        file->sector = flog_increment_sector(file->sector);
-        if (file->sector == FLOG_TAIL_SECTOR) {
-            file->offset = sizeof(flog_file_tail_sector_header_t);
-        } else {
-            file->offset = 0;
+    memmove(&file->skip[i + 1], &file->skip[i], (file->skip_n - i) * sizeof(flog_read_skip_t));
+    file->skip[i].block = block;
+    file->skip[i].position = position;
+    file->skip_n++;
+}
+
+typedef struct file_seek_t {
+    flog_read_file_t *file;
+    flog_result_t status;
+    uint32_t position;
+    uint32_t block_position;
+    uint32_t desired;
+    flog_block_idx_t block;
+    flog_sector_idx_t sector;
+    uint16_t offset;
+    uint16_t bytes_remaining;
+} file_seek_t;
+
+flog_read_walk_file_result_t file_seek_walk(flogfs_walk_file_state_t *state, void *arg) {
+    file_seek_t *seek = (file_seek_t *)arg;
+
+    seek->block = state->block;
+    seek->sector = state->sector;
+
+    if (state->sector_spare == nullptr) {
+        seek->block_position = seek->position;
+        flog_read_skip_add(seek->file, state->block, seek->position);
+        if (state->last_block) {
+            return FLOG_WALK_CONTINUE;
+        }
+        uint32_t end_of_block = seek->position + state->tail_header->bytes_in_block;
+        if (seek->desired > end_of_block) {
+            seek->position = end_of_block;
+            return FLOG_WALK_SKIP_BLOCK;
+        }
+    }
+    else {
+        uint32_t end_of_sector = seek->position + state->sector_spare->nbytes;
+        if (seek->desired > end_of_sector) {
+            seek->position = end_of_sector;
+            return FLOG_WALK_CONTINUE;
+        }
+        else {
+            seek->status = FLOG_SUCCESS;
+            seek->offset = (seek->desired - seek->position);
+            seek->bytes_remaining = state->sector_spare->nbytes - seek->offset;
+            // Data in the first and last sectors comes after the block headers
+            if (state->sector == FLOG_INIT_SECTOR) {
+                seek->offset += sizeof(flog_file_init_sector_header_t);
+            } else if (state->sector == FLOG_TAIL_SECTOR) {
+                seek->offset += sizeof(flog_file_tail_sector_header_t);
+            }
+            return FLOG_WALK_STOP;
         }
-        file->bytes_in_block += n;
-        file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
-        file->file_size += n;
-        return FLOG_SUCCESS;
     }
+
+    return FLOG_WALK_CONTINUE;
 }
 
-flog_result_t flog_walk(file_walk_fn_t walk_fn, void *arg) {
-    flog_block_statistics_sector_with_key_t block_sector;
-    flog_inode_init_sector_spare_t inode_spare;
+flog_result_t flogfs_read_seek(flog_read_file_t *file, uint32_t position) {
+    flog_result_t fr;
 
-    union {
-        flog_file_init_sector_header_t file;
-    } init_sector;
+    flash_lock();
 
-    union {
-        flog_universal_tail_sector_t universal;
-        flog_file_tail_sector_header_t file;
-    } tail_sector;
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flash_unlock();
+        return FLOG_FAILURE;
+    }
 
-    flogfs_walk_state_t state;
+    fr = flogfs_read_seek_to(file, position);
+
+    flash_unlock();
+    return fr;
+
+}
+
+flog_result_t flogfs_read_seek_end(flog_read_file_t *file, uint32_t offset) {
+    flog_write_file_t const *writer;
+    uint32_t end;
+    flog_result_t fr;
 
-    flog_lock_fs();
     flash_lock();
 
-    for (state.block = 0; state.block < flogfs.params.number_of_blocks; ++state.block) {
-        flash_open_page(state.block, 0);
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flash_unlock();
+        return FLOG_FAILURE;
+    }
 
-        flog_block_statistics_read(state.block, &block_sector);
+    writer = flog_find_writer(file->id);
+    end = writer ? writer->file_size : file->file_size;
+    fr = flogfs_read_seek_to(file, end - MIN(offset, end));
 
-        flash_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+    flash_unlock();
+    return fr;
+}
 
-        state.valid_block = !invalid_block_or_older_version(&block_sector);
+static flog_result_t flogfs_read_seek_to(flog_read_file_t *file, uint32_t position) {
+    file_seek_t seek;
+    flog_write_file_t const *writer;
+    flog_read_skip_t start = *flog_read_skip_find(file, position);
+    flog_read_skip_t known[2] = { { file->block, file->block_position }, file->last };
+    flog_read_skip_t const *after = NULL;
 
-        if (state.valid_block) {
-            flog_open_sector(state.block, FLOG_INIT_SECTOR);
-            flash_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(init_sector));
-            flog_close_sector();
+    if (position == 0) {
+        flogfs_read_rewind(file);
+        return FLOG_SUCCESS;
+    }
 
-            flog_open_sector(state.block, FLOG_TAIL_SECTOR);
-            flash_read_sector((uint8_t *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(tail_sector));
-            flog_close_sector();
+    // Past the end of flash the reader picks up from the writer's buffer
+    if (position > file->file_size) {
+        writer = flog_find_writer(file->id);
+        if (!writer || position > writer->file_size || !flogfs_read_seek_to(file, file->file_size)) {
+            return FLOG_FAILURE;
+        }
+        file->read_head = position;
+        file->unflushed_bytes = position - file->file_size;
+        return FLOG_SUCCESS;
+    }
 
-            state.next_block = tail_sector.universal.next_block;
+    for (uint_fast8_t i = 0; i < 2; ++i) {
+        if (known[i].position <= position) {
+            if (known[i].position > start.position) {
+                start = known[i];
+            }
+        } else if (!after || known[i].position < after->position) {
+            after = &known[i];
+        }
+    }
+
+    // Going back a block reads two sectors, going forward only one
+    if (after && 2 * (after->position - position) < position - start.position) {
+        flog_read_skip_t back = *after;
+        while (back.position > position && flogfs_read_previous_block(file, &back)) {
+        }
+        if (back.position <= position) {
+            start = back;
+        }
+    }
+
+    seek.file = file;
+    seek.position = start.position;
+    seek.block = start.block;
+    seek.desired = position;
+    seek.sector = FLOG_INIT_SECTOR;
+    seek.status = FLOG_FAILURE;
+
+    if (!flogfs_read_walk_file(file, seek.block, file_seek_walk, &seek) || seek.status != FLOG_SUCCESS) {
+        return FLOG_FAILURE;
+    }
+
+    file->block = seek.block;
+    file->block_position = seek.block_position;
+    file->sector = seek.sector;
+    file->offset = seek.offset;
+    file->sector_remaining_bytes = seek.bytes_remaining;
+    file->read_head = position;
+    file->unflushed_bytes = 0;
+
+    return FLOG_SUCCESS;
+}
+
+static void flogfs_read_rewind(flog_read_file_t *file) {
+    file->block = file->first_block;
+    file->block_position = 0;
+    // flogfs_read_next_sector() picks up the init sector when it's needed
+    file->sector = FLOG_INIT_SECTOR;
+    file->offset = sizeof(flog_file_init_sector_header_t);
+    file->sector_remaining_bytes = 0;
+    file->read_head = 0;
+    file->unflushed_bytes = 0;
+}
+
+static flog_result_t flogfs_read_previous_block(flog_read_file_t *file, flog_read_skip_t *block) {
+    flog_file_init_sector_header_t init_header;
+    flog_file_tail_sector_header_t tail_header;
+
+    if (block->block == file->first_block) {
+        return FLOG_FAILURE;
+    }
+
+    flog_open_sector(block->block, FLOG_INIT_SECTOR);
+    flog_read_sector((uint8_t *)&init_header, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+    if (init_header.previous_block == FLOG_BLOCK_IDX_INVALID) {
+        return FLOG_FAILURE;
+    }
+
+    flog_open_sector(init_header.previous_block, FLOG_TAIL_SECTOR);
+    flog_read_sector((uint8_t *)&tail_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+    if (tail_header.universal.next_block != block->block || tail_header.bytes_in_block > block->position) {
+        return FLOG_FAILURE;
+    }
+
+    block->block = init_header.previous_block;
+    block->position -= tail_header.bytes_in_block;
+    flog_read_skip_add(file, block->block, block->position);
+
+    return FLOG_SUCCESS;
+}
+
+static flog_result_t flogfs_read_previous_sector(flog_read_file_t *file) {
+    flog_file_sector_spare_t file_sector_spare;
+    flog_read_skip_t previous = { file->block, file->block_position };
+    flog_sector_idx_t sector;
+
+    if (file->sector == FLOG_INIT_SECTOR) {
+        if (!flogfs_read_previous_block(file, &previous)) {
+            return FLOG_FAILURE;
+        }
+        sector = FLOG_TAIL_SECTOR;
+    } else {
+        sector = flog_decrement_sector(file->sector);
+    }
+
+    flog_open_sector(previous.block, sector);
+    flog_read_spare((uint8_t *)&file_sector_spare, sector);
+    if (invalid_sector_spare(&file_sector_spare)) {
+        return FLOG_FAILURE;
+    }
+
+    file->block = previous.block;
+    file->block_position = previous.position;
+    file->sector = sector;
+    file->offset = flog_sector_data_offset(sector) + file_sector_spare.nbytes;
+    file->sector_remaining_bytes = 0;
+
+    return FLOG_SUCCESS;
+}
+
+uint32_t flogfs_read_tell(flog_read_file_t *file) {
+  return file->read_head;
+}
+
+void flogfs_read_follow(flog_read_file_t *file, flog_read_notify_fn_t notify, void *arg) {
+    flog_lock_fs();
+    file->notify = notify;
+    file->notify_arg = arg;
+    flog_unlock_fs();
+}
+
+uint_fast8_t flogfs_read_has_data(flog_read_file_t *file) {
+    flog_write_file_t const *writer;
+    uint_fast8_t has_data;
+
+    flash_lock();
+    writer = flog_find_writer(file->id);
+    has_data = file->read_head < (writer ? writer->file_size : file->file_size);
+    flash_unlock();
+
+    return has_data;
+}
+
+flog_result_t flogfs_open_write(flog_write_file_t *file, char const *filename) {
+    flog_inode_iterator_t inode_iter;
+    flog_block_alloc_t alloc_block;
+    flog_file_find_result_t find_result;
+    flog_file_hint_t hint;
+    flog_file_sector_spare_t file_sector_spare;
+    union {
+        flog_inode_file_allocation_t allocation;
+        flog_file_init_sector_header_t file_init_sector_header;
+        flog_file_tail_sector_header_t file_tail_sector_header;
+    } buffer_union;
+
+    // Close records are the only inode entries without a name
+    if (filename[0] == '\0' || strlen(filename) >= FLOG_MAX_FNAME_LEN) {
+        return FLOG_FAILURE;
+    }
+
+    flog_lock_fs();
+
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flog_unlock_fs();
+        return FLOG_FAILURE;
+    }
+
+    flash_lock();
+
+    find_result = flog_find_file(filename, &inode_iter, &hint);
+
+    file->base_threshold = 0;
+    file->blocks_since_record = 0;
+    file->bounded = 0;
+    file->previous_block = FLOG_BLOCK_IDX_INVALID;
+#if FS_WRITE_PAGES
+    file->held_sectors = 0;
+#endif
+
+    if (find_result.first_block != FLOG_BLOCK_IDX_INVALID) {
+        // TODO: Make sure file isn't already open for writing
+
+        // File already exists
+        file->block = find_result.first_block;
+        file->id = find_result.file_id;
+        file->sector = FLOG_INIT_SECTOR;
+        // Count bytes from 0
+        file->file_size = 0;
+        file->bytes_in_block = 0;
+        // Or from the newest close record
+        if (hint.block != FLOG_BLOCK_IDX_INVALID && flog_file_owns(hint.block, file->id)) {
+            file->block = hint.block;
+            file->file_size = hint.position;
+        }
+        // Iterate to the end of the file
+        // First check each terminated block
+        while (1) {
+            flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+            flog_read_sector((uint8_t *)&buffer_union.file_tail_sector_header, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+            if (invalid_file_tail_sector_header(&buffer_union.file_tail_sector_header)) {
+                // This block is incomplete
+                break;
+            }
+            file->previous_block = file->block;
+            file->block = buffer_union.file_tail_sector_header.universal.next_block;
+            file->block_age = buffer_union.file_tail_sector_header.universal.next_age;
+            file->file_size += buffer_union.file_tail_sector_header.bytes_in_block;
+            file->blocks_since_record++;
+        }
+        // Now file->block is the first incomplete block
+        // Scan it sector-by-sector
+        while (1) {
+            // For each block in the file
+            flog_open_sector(file->block, file->sector);
+            flog_read_spare((uint8_t *)&file_sector_spare, file->sector);
+            if (invalid_sector_spare(&file_sector_spare)) {
+                // No data
+                // We will write here!
+                file->offset = flog_sector_data_offset(file->sector);
+                file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+                break;
+            }
+            file->file_size += file_sector_spare.nbytes;
+            file->bytes_in_block += file_sector_spare.nbytes;
+            file->sector = flog_increment_sector(file->sector);
+        }
+    } else {
+        if (flog_inode_prepare_new(&inode_iter) != FLOG_SUCCESS) {
+            goto failure;
+        }
+
+        strcpy(buffer_union.allocation.filename, filename);
+        buffer_union.allocation.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+
+        flog_lock_allocate();
+        alloc_block = flog_allocate_block(file->base_threshold);
+        flog_unlock_allocate();
+        if (alloc_block.block == FLOG_BLOCK_IDX_INVALID) {
+            goto failure;
+        }
+
+        file->block = alloc_block.block;
+        file->block_age = ++alloc_block.age;
+        file->id = ++flogfs.max_file_id;
+        file->bytes_in_block = 0;
+        file->file_size = 0;
+        file->sector = FLOG_INIT_SECTOR;
+        file->offset = sizeof(flog_file_init_sector_header_t);
+        file->sector_remaining_bytes = FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
+
+        // The first block gets its init sector before the inode entry names
+        // it, so it can't be mistaken for a free block after a power loss. If
+        // power is lost before the entry is written, the block's file ID is
+        // newer than any in the inode table and it's freed on the next mount.
+        flog_commit_file_sector(file, NULL, 0);
+
+        buffer_union.allocation.header.file_id = file->id;
+        buffer_union.allocation.header.first_block = alloc_block.block;
+        buffer_union.allocation.header.first_block_age = alloc_block.age;
+        buffer_union.allocation.header.timestamp = ++flogfs.t;
+
+        // Write the new inode entry
+        flog_open_sector(inode_iter.block, inode_iter.sector);
+        flog_write_sector((uint8_t *)&buffer_union.allocation, inode_iter.sector, 0, sizeof(flog_inode_file_allocation_t));
+        flash_commit();
+
+#if FS_FILE_INDEX_SIZE
+        flog_file_index_insert(filename, &inode_iter, buffer_union.allocation.header.file_id, alloc_block.block);
+#endif
+
+        // The following entry is the new end of the inode table
+        flog_inode_iterator_next(&inode_iter);
+        flogfs.inode_tail_block = inode_iter.block;
+        flogfs.inode_tail_sector = inode_iter.sector;
+    }
+
+#if FS_WRITE_BEHIND
+    file->queue_head = 0;
+    file->queue_n = 0;
+    file->queue_fill = FS_SECTOR_SIZE;
+    file->queue_skip = 0;
+    file->queue_end = file->file_size;
+    file->done = NULL;
+#endif
+
+    // Readers which got here first
+    file->readers = 0;
+    for (flog_read_file_t *reader = flogfs.read_head; reader; reader = reader->next) {
+        if (reader->id == file->id) {
+            file->readers++;
+        }
+    }
+
+    file->next = NULL;
+    if (flogfs.write_head == NULL) {
+        flogfs.write_head = file;
+    } else {
+        flog_write_file_t *file_iter;
+        for (file_iter = flogfs.write_head; file_iter->next; file_iter = file_iter->next) {
+        }
+        file_iter->next = file;
+    }
+
+    flash_unlock();
+    flog_unlock_fs();
+
+    return FLOG_SUCCESS;
+
+failure:
+    flash_unlock();
+    flog_unlock_fs();
+
+    return FLOG_FAILURE;
+}
+
+/*!
+ @details
+ ### Internals
+ To close a write, all outstanding data must simply be flushed to flash. If any
+ blocks are newly-allocated, they must be committed.
+
+ TODO: Deal with files that can't be flushed due to no space for allocation
+ */
+flog_result_t flogfs_close_write(flog_write_file_t *file) {
+    flog_write_file_t *iter;
+    flog_result_t result = FLOG_SUCCESS;
+
+    flog_lock_fs();
+    flash_lock();
+    flog_lock_write_file(file);
+
+    if (flogfs.write_head == file) {
+        flogfs.write_head = file->next;
+    } else {
+        for (iter = flogfs.write_head; iter && iter->next != file; iter = iter->next) {
+        }
+        if (!iter) {
+            goto failure;
+        }
+        iter->next = file->next;
+    }
+#if FS_WRITE_BEHIND
+    flog_write_behind_drain(file, 1, NULL);
+    if (file->queue_n) {
+        result = FLOG_FAILURE;
+    }
+#endif
+    // Readers may already have seen what's buffered, so it all has to go out.
+    // A new block always needs its init sector.
+    if (file->file_size != flog_write_committed(file) || file->sector == FLOG_INIT_SECTOR) {
+        // A tail sector can't be committed without a block to follow it, so on
+        // a full file system this fails and what's buffered is lost
+        result = flog_flush_write(file);
+    }
+
+    // Save the next open from walking most of the chain again
+    if (result && file->blocks_since_record >= FLOG_CLOSE_RECORD_BLOCKS && file->sector != FLOG_INIT_SECTOR) {
+        result = flog_close_record_write(file);
+    }
+
+#if FS_WRITE_BEHIND
+    if (file->done) {
+        file->done(file, flog_write_committed(file), file->done_arg);
+    }
+#endif
+
+    flog_unlock_write_file(file);
+    flash_unlock();
+    flog_unlock_fs();
+
+    return result;
+
+failure:
+    flog_unlock_write_file(file);
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_FAILURE;
+}
+
+flog_result_t flogfs_sync(flog_write_file_t *file, flog_sync_level_t level) {
+    flog_result_t result;
+
+    flog_lock_fs();
+    flash_lock();
+    flog_lock_write_file(file);
+
+    result = flog_sync_write(file, level);
+
+    flog_unlock_write_file(file);
+    flash_unlock();
+    flog_unlock_fs();
+
+    return result;
+}
+
+flog_result_t flogfs_sync_all(flog_sync_level_t level) {
+    flog_result_t result = FLOG_SUCCESS;
+
+    flog_lock_fs();
+    flash_lock();
+
+    for (flog_write_file_t *file = flogfs.write_head; file; file = file->next) {
+        flog_lock_write_file(file);
+        if (!flog_sync_write(file, level)) {
+            result = FLOG_FAILURE;
+        }
+        flog_unlock_write_file(file);
+    }
+
+    flash_unlock();
+    flog_unlock_fs();
+
+    return result;
+}
+
+static flog_result_t flog_sync_write(flog_write_file_t *file, flog_sync_level_t level) {
+    flog_result_t result = FLOG_SUCCESS;
+
+#if FS_WRITE_BEHIND
+    flog_write_behind_drain(file, 1, NULL);
+    if (file->queue_n) {
+        result = FLOG_FAILURE;
+    }
+#endif
+
+    // A record can only point at a block with its init sector written
+    if (file->file_size != flog_write_committed(file) ||
+        (level == FLOG_SYNC_RECORD && file->sector == FLOG_INIT_SECTOR)) {
+        if (!flog_flush_write(file)) {
+            result = FLOG_FAILURE;
+        }
+    }
+
+    if (result && level == FLOG_SYNC_RECORD && file->blocks_since_record && file->sector != FLOG_INIT_SECTOR) {
+        result = flog_close_record_write(file);
+    }
+
+#if FS_WRITE_BEHIND
+    if (file->done) {
+        file->done(file, flog_write_committed(file), file->done_arg);
+    }
+#endif
+
+    return result;
+}
+
+flog_result_t flogfs_rm(char const *filename) {
+    flog_file_find_result_t find_result;
+    flog_inode_iterator_t inode_iter;
+    flog_inode_file_invalidation_t invalidation;
+
+    flog_lock_fs();
+    flash_lock();
+
+    find_result = flog_find_file(filename, &inode_iter, NULL);
+    if (find_result.first_block == FLOG_BLOCK_IDX_INVALID) {
+        goto failure;
+    }
+
+    // The chain is erased later, so the last block isn't worth looking for
+    invalidation.header.last_block = FLOG_BLOCK_IDX_INVALID;
+    invalidation.header.timestamp = ++flogfs.t;
+    flog_open_sector(inode_iter.block, inode_iter.sector + 1);
+    flog_write_sector((uint8_t *)&invalidation, inode_iter.sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+    flash_commit();
+
+#if FS_FILE_INDEX_SIZE
+    flog_file_index_remove(filename, &inode_iter);
+#endif
+
+    flog_lock_delete();
+    flog_reclaim_enqueue(find_result.first_block, find_result.file_id);
+    flog_unlock_delete();
+
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_SUCCESS;
+
+failure:
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_FAILURE;
+}
+
+flog_result_t flogfs_compact() {
+    flog_inode_iterator_t source;
+    flog_inode_iterator_t destination;
+    flog_block_alloc_t inode0;
+    flog_file_hint_t hint;
+    uint_fast8_t deleted;
+
+    union {
+        flog_inode_file_allocation_t allocation;
+        flog_inode_init_sector_t inode_init_sector;
+        flog_inode_init_sector_spare_t inode_init_sector_spare;
+    } buffer_union;
+    flog_inode_file_invalidation_t invalidation;
+
+    flog_lock_fs();
+
+    if (flogfs.state != FLOG_STATE_MOUNTED) {
+        flog_unlock_fs();
+        return FLOG_FAILURE;
+    }
+
+    flash_lock();
+
+    flog_lock_allocate();
+    inode0 = flog_allocate_inode0();
+    // Deleted files may be holding the only blocks low enough for the table
+    while (inode0.block == FLOG_BLOCK_IDX_INVALID && flog_reclaim_step()) {
+        inode0 = flog_allocate_inode0();
+    }
+    flog_unlock_allocate();
+
+    if (inode0.block == FLOG_BLOCK_IDX_INVALID) {
+        goto failure;
+    }
+
+    flog_file_index_reset();
+
+    // Until its init sector is written below the new table is invisible to
+    // mount. The free block scan erases its first block, which has entries
+    // but no init sector, and the inode blocks after it aren't in any table.
+    destination.block = inode0.block;
+    destination.next_block = FLOG_BLOCK_IDX_INVALID;
+    destination.inode_block_idx = 0;
+    destination.inode_idx = 0;
+    destination.sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+
+    for (flog_inode_iterator_initialize(&source, flogfs.inode0); ; flog_inode_iterator_next(&source)) {
+        flog_open_sector(source.block, source.sector);
+        flog_read_sector((uint8_t *)&buffer_union.allocation, source.sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (invalid_inode_file_allocation_header(&buffer_union.allocation.header)) {
+            break;
+        }
+
+        flog_open_sector(source.block, source.sector + 1);
+        flog_read_sector((uint8_t *)&invalidation, source.sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+        deleted = !invalid_inode_file_invalidation(&invalidation);
+
+        // Deleted files stay until reclaimed so a remount can finish the job,
+        // close records for as long as their file does
+        if (deleted && !flog_file_owns(buffer_union.allocation.header.first_block, buffer_union.allocation.header.file_id)) {
+            continue;
+        }
+
+        if (flog_inode_prepare_new(&destination) != FLOG_SUCCESS) {
+            flog_lock_allocate();
+            flog_inode_chain_release(inode0.block);
+            flog_unlock_allocate();
+            flog_file_index_reset();
+            goto failure;
+        }
+
+        flog_open_sector(destination.block, destination.sector);
+        flog_write_sector((uint8_t *)&buffer_union.allocation, destination.sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (deleted) {
+            flog_write_sector((uint8_t *)&invalidation, destination.sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+        }
+        flash_commit();
+
+#if FS_FILE_INDEX_SIZE
+        if (!deleted) {
+            buffer_union.allocation.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+            flog_file_index_insert(buffer_union.allocation.filename, &destination, buffer_union.allocation.header.file_id,
+                                   buffer_union.allocation.header.first_block);
+        }
+#endif
+        if (flog_inode_is_close_record(&buffer_union.allocation)) {
+            hint.block = buffer_union.allocation.header.first_block;
+            hint.position = ((flog_inode_close_record_t *)&buffer_union.allocation)->position;
+            flog_file_index_hint(buffer_union.allocation.header.file_id, &hint);
+        }
+
+        flog_inode_iterator_next(&destination);
+    }
+
+    // This is the commit point, a newer first inode block wins at mount
+    flog_open_sector(inode0.block, FLOG_INIT_SECTOR);
+    buffer_union.inode_init_sector.universal.timestamp = ++flogfs.t;
+    buffer_union.inode_init_sector.previous = FLOG_BLOCK_IDX_INVALID;
+    buffer_union.inode_init_sector.max_file_id = flogfs.max_file_id;
+    flog_write_sector((uint8_t *)&buffer_union.inode_init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_inode_init_sector_t));
+
+    buffer_union.inode_init_sector_spare.type_id = FLOG_BLOCK_TYPE_INODE;
+    buffer_union.inode_init_sector_spare.nothing = 0;
+    buffer_union.inode_init_sector_spare.inode_index = 0;
+    flog_write_spare((uint8_t *)&buffer_union.inode_init_sector_spare, FLOG_INIT_SECTOR);
+    flash_commit();
+
+    flog_lock_allocate();
+    flog_inode_chain_release(flogfs.inode0);
+    flog_unlock_allocate();
+
+    flogfs.inode0 = inode0.block;
+    flogfs.inode_tail_block = destination.block;
+    flogfs.inode_tail_sector = destination.sector;
+#if FS_FILE_INDEX_SIZE
+    flogfs.file_index.built = 1;
+#endif
+
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_SUCCESS;
+
+failure:
+    flash_unlock();
+    flog_unlock_fs();
+    return FLOG_FAILURE;
+}
+
+void flogfs_start_ls(flogfs_ls_iterator_t *iter) {
+    flog_inode_iterator_initialize(iter, flogfs.inode0);
+}
+
+uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t *iter, char *fname_dst) {
+    union {
+        flog_inode_file_allocation_header_t allocation;
+        flog_inode_file_invalidation_t invalidation;
+    } buffer_union;
+
+    while (1) {
+        flog_open_sector(iter->block, iter->sector);
+        flog_read_sector((uint8_t *)&buffer_union.allocation, iter->sector, 0, sizeof(flog_inode_file_allocation_header_t));
+        if (invalid_file_id(buffer_union.allocation.file_id)) {
+            // Nothing here. Done.
+            return 0;
+        }
+        // Now check to see if it's valid
+        flog_open_sector(iter->block, iter->sector + 1);
+        flog_read_sector((uint8_t *)&buffer_union.invalidation, iter->sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+        if (invalid_timestamp(buffer_union.invalidation.header.timestamp)) {
+            // This file's good
+            // Now check to see if it's valid
+            // Go read the filename
+            flog_open_sector(iter->block, iter->sector);
+            flog_read_sector((uint8_t *)fname_dst, iter->sector, sizeof(flog_inode_file_allocation_header_t), FLOG_MAX_FNAME_LEN);
+            fname_dst[FLOG_MAX_FNAME_LEN - 1] = '\0';
+            flog_inode_iterator_next(iter);
+            return 1;
+        } else {
+            flog_inode_iterator_next(iter);
+        }
+    }
+}
+
+void flogfs_stop_ls(flogfs_ls_iterator_t *iter) {
+}
+
+flog_result_t flog_commit_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n) {
+    flog_file_sector_spare_t file_sector_spare;
+
+    if (file->sector == FLOG_TAIL_SECTOR) {
+        printk("flog_commit_file_sector: FLOG_TAIL_SECTOR n: %d\n", n);
+        flog_file_tail_sector_header_t *const file_tail_sector_header = (flog_file_tail_sector_header_t *)flog_write_buffer(file);
+        flog_block_alloc_t next_block;
+
+        // The new block stays unwritten until the file's next commit. Until
+        // then it's only known to this file, and to the tail sector below if
+        // power is lost, which flog_free_blocks_scan() takes into account.
+        flog_lock_allocate();
+        if (file->bounded) {
+            next_block = flog_allocate_preallocated();
+        } else {
+            next_block = flog_allocate_block(file->base_threshold);
+        }
+        flog_unlock_allocate();
+        if (next_block.block == FLOG_BLOCK_IDX_INVALID) {
+            return FLOG_FAILURE;
+        }
+
+        uint16_t bytes_in_sector = FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
+        bytes_in_sector = file->offset + n - sizeof(flog_file_tail_sector_header_t);
+
+        // Prepare the header
+        // memzero(file_tail_sector_header, sizeof(flog_file_tail_sector_header_t)); // Optional
+        file->bytes_in_block += n; // Not bytes_in_sector, this is updated on in memory/non-flushed writes.
+        file_sector_spare.nbytes = bytes_in_sector;
+        file_tail_sector_header->universal.next_age = next_block.age + 1;
+        file_tail_sector_header->universal.next_block = next_block.block;
+        file_tail_sector_header->universal.timestamp = ++flogfs.t;
+        file_tail_sector_header->bytes_in_block = file->bytes_in_block;
+
+        flog_open_sector(file->block, FLOG_TAIL_SECTOR);
+        flog_write_sector_gather((uint8_t const *)file_tail_sector_header, file->offset, data, FLOG_TAIL_SECTOR, n);
+        flog_write_spare((uint8_t const *)&file_sector_spare, FLOG_TAIL_SECTOR);
+        flash_commit();
+
+        // Ready the file structure for the next block/sector
+        file->previous_block = file->block;
+        file->block = next_block.block;
+        file->block_age = next_block.age + 1;
+        file->blocks_since_record++;
+        file->sector = FLOG_INIT_SECTOR;
+        file->sector_remaining_bytes = FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
+        file->offset = sizeof(flog_file_init_sector_header_t);
+        file->bytes_in_block = 0;
+        file->file_size += n;
+
+        flog_update_readers(file);
+
+        return FLOG_SUCCESS;
+    } else {
+#if FS_WRITE_PAGES
+        if (!flog_hold_file_sector(file, data, n)) {
+            flog_program_held_sectors(file);
+            flog_program_file_sector(file, data, n);
+        }
+#else
+        flog_program_file_sector(file, data, n);
+#endif
+
+        // Now update stuff for the new sector
+        file->sector = flog_increment_sector(file->sector);
+        if (file->sector == FLOG_TAIL_SECTOR) {
+            file->offset = sizeof(flog_file_tail_sector_header_t);
+        } else {
+            file->offset = 0;
+        }
+        file->bytes_in_block += n;
+        file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+        file->file_size += n;
+
+        flog_update_readers(file);
+
+        return FLOG_SUCCESS;
+    }
+}
+
+static void flog_program_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n) {
+    flog_file_sector_spare_t file_sector_spare;
+    uint8_t *buffer = flog_write_buffer(file);
+    flog_file_init_sector_header_t *const file_init_sector_header = (flog_file_init_sector_header_t *)buffer;
+
+    file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+    file_sector_spare.nbytes = file->offset + n;
+
+    // We need to just write the data and advance
+    if (file->sector == FLOG_INIT_SECTOR) {
+        // memzero(file_init_sector_header, sizeof(flog_file_init_sector_header_t)); // Optional
+        file_init_sector_header->file_id = file->id;
+        file_init_sector_header->age = file->block_age;
+        file_init_sector_header->previous_block = file->previous_block;
+        file_sector_spare.nbytes -= sizeof(flog_file_init_sector_header_t); // file->offset had accounted for this.
+    }
+
+    flog_open_sector(file->block, file->sector);
+    // Any header or prior data goes out in front of the new data
+    flog_write_sector_gather(buffer, file->offset, data, file->sector, n);
+
+    flog_write_spare((uint8_t const *)&file_sector_spare, file->sector);
+    flash_commit();
+}
+
+#if FS_WRITE_PAGES
+static uint_fast8_t flog_hold_file_sector(flog_write_file_t *file, uint8_t const *data, flog_sector_nbytes_t n) {
+    // Only the data pages are written in order, and only if nothing in the
+    // page has been programmed already
+    if (file->sector < FS_SECTORS_PER_PAGE || file->offset + n != FS_SECTOR_SIZE ||
+        file->held_sectors != file->sector % FS_SECTORS_PER_PAGE) {
+        return 0;
+    }
+
+    if (n) {
+        memcpy(flog_write_buffer(file) + file->offset, data, n);
+    }
+    if (++file->held_sectors == FS_SECTORS_PER_PAGE) {
+        flog_program_held_sectors(file);
+    }
+    return 1;
+}
+
+static void flog_program_held_sectors(flog_write_file_t *file) {
+    flog_file_sector_spare_t file_sector_spare;
+    // Held sectors always start the page the write head is in
+    flog_sector_idx_t first = file->sector - file->sector % FS_SECTORS_PER_PAGE;
+
+    if (file->held_sectors == FS_SECTORS_PER_PAGE) {
+        flog_program_file_page(file, first, file->page_buffer[0]);
+    } else if (file->held_sectors) {
+        // Cut short by a flush, so these go out as they would have anyway
+        file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+        file_sector_spare.nbytes = FS_SECTOR_SIZE;
+        flog_open_sector(file->block, first);
+        for (uint_fast8_t i = 0; i < file->held_sectors; ++i) {
+            flog_write_sector(file->page_buffer[i], first + i, 0, FS_SECTOR_SIZE);
+            flog_write_spare((uint8_t const *)&file_sector_spare, first + i);
+            flash_commit();
+        }
+    }
+
+    file->held_sectors = 0;
+}
+
+static void flog_program_file_page(flog_write_file_t *file, flog_sector_idx_t first, uint8_t const *data) {
+    flog_file_sector_spare_t spares[FS_SECTORS_PER_PAGE];
+
+    memset(spares, 0, sizeof(spares));
+    for (uint_fast8_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        spares[i].type_id = FLOG_BLOCK_TYPE_FILE;
+        spares[i].nbytes = FS_SECTOR_SIZE;
+    }
+
+#if FS_FLASH_WRITE_PAGE
+    flog_read_cache_invalidate(file->block, first / FS_SECTORS_PER_PAGE);
+    flash_write_page(file->block, first / FS_SECTORS_PER_PAGE, data, (uint8_t const *)spares);
+    // The backend opened the page itself
+    flogfs.cache_status.flash_open = 0;
+#else
+    flog_open_sector(file->block, first);
+    for (uint_fast8_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        flog_write_sector(data + i * FS_SECTOR_SIZE, first + i, 0, FS_SECTOR_SIZE);
+        flog_write_spare((uint8_t const *)&spares[i], first + i);
+    }
+    flash_commit();
+#endif
+}
+
+static uint_fast8_t flog_commit_file_page(flog_write_file_t *file, uint8_t const *data) {
+    if (file->sector < FS_SECTORS_PER_PAGE || file->sector % FS_SECTORS_PER_PAGE || file->offset || file->held_sectors) {
+        return 0;
+    }
+
+    flog_program_file_page(file, file->sector, data);
+
+    for (uint_fast8_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        file->sector = flog_increment_sector(file->sector);
+    }
+    file->offset = file->sector == FLOG_TAIL_SECTOR ? sizeof(flog_file_tail_sector_header_t) : 0;
+    file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+    file->bytes_in_block += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+    file->file_size += FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+
+    flog_update_readers(file);
+
+    return 1;
+}
+#endif
+
+static uint8_t *flog_write_buffer(flog_write_file_t *file) {
+#if FS_WRITE_PAGES
+    return file->page_buffer[file->sector % FS_SECTORS_PER_PAGE];
+#else
+    return file->sector_buffer;
+#endif
+}
+
+static uint8_t const *flog_write_unflushed(flog_write_file_t const *file) {
+#if FS_WRITE_PAGES
+    // Held sectors come straight before the write head's in the page buffer
+    uint8_t const *buffer = file->page_buffer[file->sector % FS_SECTORS_PER_PAGE] - file->held_sectors * FS_SECTOR_SIZE;
+#else
+    uint8_t const *buffer = file->sector_buffer;
+#endif
+    return buffer + flog_sector_data_offset(file->sector);
+}
+
+static uint32_t flog_write_committed(flog_write_file_t const *file) {
+    uint32_t buffered = file->offset - flog_sector_data_offset(file->sector);
+#if FS_WRITE_PAGES
+    buffered += file->held_sectors * FS_SECTOR_SIZE;
+#endif
+    return file->file_size - buffered;
+}
+
+static void flog_update_readers(flog_write_file_t const *file) {
+    for (flog_read_file_t *reader = flogfs.read_head; reader; reader = reader->next) {
+        if (reader->id == file->id) {
+            reader->file_size = flog_write_committed(file);
+        }
+    }
+}
+
+static void flog_notify_readers(flog_write_file_t const *file) {
+    for (flog_read_file_t *reader = flogfs.read_head; reader; reader = reader->next) {
+        if (reader->id == file->id && reader->notify) {
+            reader->notify(reader, reader->notify_arg);
+        }
+    }
+}
+
+static void flog_count_reader(flog_read_file_t const *file, int_fast8_t change) {
+    flog_write_file_t *writer = flog_find_writer(file->id);
+
+    if (writer) {
+        flog_lock_write_file(writer);
+        writer->readers += change;
+        flog_unlock_write_file(writer);
+    }
+}
+
+static flog_write_file_t *flog_find_writer(uint32_t id) {
+    for (flog_write_file_t *writer = flogfs.write_head; writer; writer = writer->next) {
+        if (writer->id == id) {
+            return writer;
+        }
+    }
+    return NULL;
+}
+
+static uint16_t flog_sector_data_offset(flog_sector_idx_t sector) {
+    switch (sector) {
+    case FLOG_TAIL_SECTOR:
+        return sizeof(flog_file_tail_sector_header_t);
+    case FLOG_INIT_SECTOR:
+        return sizeof(flog_file_init_sector_header_t);
+    default:
+        return 0;
+    }
+}
+
+flog_result_t flog_walk(file_walk_fn_t walk_fn, void *arg) {
+    flog_block_statistics_sector_with_key_t block_sector;
+    flog_inode_init_sector_spare_t inode_spare;
+
+    union {
+        flog_file_init_sector_header_t file;
+    } init_sector;
+
+    union {
+        flog_universal_tail_sector_t universal;
+        flog_file_tail_sector_header_t file;
+    } tail_sector;
+
+    flogfs_walk_state_t state;
+
+    flog_lock_fs();
+    flash_lock();
+
+    for (state.block = 0; state.block < flogfs.params.number_of_blocks; ++state.block) {
+        flog_open_page(state.block, 0);
+
+        flog_block_statistics_read(state.block, &block_sector);
+
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+
+        state.valid_block = !invalid_block_or_older_version(&block_sector);
+
+        if (state.valid_block) {
+            flog_open_sector(state.block, FLOG_INIT_SECTOR);
+            flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(init_sector));
+            flog_close_sector();
+
+            flog_open_sector(state.block, FLOG_TAIL_SECTOR);
+            flog_read_sector((uint8_t *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(tail_sector));
+            flog_close_sector();
+
+            state.next_block = tail_sector.universal.next_block;
             state.age = block_sector.header.age;
             state.type_id = inode_spare.type_id;
             state.file_id = init_sector.file.file_id;
             state.bytes_in_block = tail_sector.file.bytes_in_block;
 
-            walk_fn(&state, arg);
+            walk_fn(&state, arg);
+
+            switch (state.type_id) {
+            case FLOG_BLOCK_TYPE_INODE: {
+                flogfs_walk_inode_block_state_t *inode = &state.types.inode;
+                flog_inode_file_allocation_t allocation;
+                flog_inode_file_invalidation_t invalidation;
+
+                inode->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+
+                while (inode->sector < flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) {
+                    inode->valid = false;
+                    inode->file_name[0] = 0;
+                    inode->file_id = FLOG_FILE_ID_INVALID;
+                    inode->first_block = FLOG_BLOCK_IDX_INVALID;
+                    inode->last_block = FLOG_BLOCK_IDX_INVALID;
+                    inode->created_at = FLOG_TIMESTAMP_INVALID;
+                    inode->deleted_at = FLOG_TIMESTAMP_INVALID;
+
+                    flog_open_sector(state.block, inode->sector);
+                    flog_read_sector((uint8_t *)&allocation, inode->sector, 0, sizeof(flog_inode_file_allocation_t));
+                    flog_close_sector();
+
+                    state.types.inode.valid = !invalid_inode_file_allocation_header(&allocation.header);
+                    if (inode->valid) {
+                        flog_open_sector(state.block, inode->sector + 1);
+                        flog_read_sector((uint8_t *)&invalidation, inode->sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+                        flog_close_sector();
+
+                        strcpy(inode->file_name, allocation.filename);
+                        inode->file_id = allocation.header.file_id;
+                        inode->first_block = allocation.header.first_block;
+                        inode->created_at = allocation.header.timestamp;
+
+                        inode->deleted = !invalid_inode_file_invalidation(&invalidation);
+                        inode->last_block = invalidation.header.last_block;
+                        inode->deleted_at = invalidation.header.timestamp;
+                    }
+
+                    walk_fn(&state, arg);
+
+                    inode->sector += 2;
+                }
+                break;
+            }
+            case FLOG_BLOCK_TYPE_FILE: {
+                flogfs_walk_file_block_state_t *fb = &state.types.file;
+                flog_file_sector_spare_t file_sector_spare;
+
+                fb->sector = FLOG_INIT_SECTOR;
+
+                while (true) {
+                    flog_open_sector(state.block, fb->sector);
+                    flog_read_spare((uint8_t *)&file_sector_spare, fb->sector);
+                    flog_close_sector();
+
+                    fb->valid = !invalid_sector_spare(&file_sector_spare);
+                    fb->file_id = init_sector.file.file_id;
+                    fb->size = file_sector_spare.nbytes;
+
+                    walk_fn(&state, arg);
+
+                    if (fb->sector == FLOG_TAIL_SECTOR) {
+                        break;
+                    }
+
+                    fb->sector = flog_increment_sector(fb->sector);
+                }
+                break;
+            }
+            }
+        }
+        else {
+            walk_fn(&state, arg);
+        }
+    }
+
+    flog_unlock_fs();
+    flash_unlock();
+
+    return FLOG_SUCCESS;
+}
+
+static flog_result_t flog_flush_write(flog_write_file_t *file) {
+#if FS_WRITE_PAGES
+    // Held sectors can go out on their own if the write head's sector is empty
+    if (file->held_sectors && file->offset == 0) {
+        flog_program_held_sectors(file);
+        flog_update_readers(file);
+        return FLOG_SUCCESS;
+    }
+#endif
+
+    flog_result_t fr = flog_commit_file_sector(file, 0, 0);
+    if (!fr) {
+        return FLOG_FAILURE;
+    }
+
+    // The above commit may have moved on to a new block, which gets its init
+    // sector so that it's never left unwritten once flushed
+    if (file->sector == FLOG_INIT_SECTOR) {
+        fr = flog_commit_file_sector(file, 0, 0);
+    }
+
+    return fr;
+}
+
+static uint_fast8_t flog_prealloc_contains(flog_block_idx_t block) {
+    return flog_bitset_test(flogfs.prealloc.contains, block) || flog_bitset_test(flogfs.prealloc.pending, block);
+}
+
+static void flog_prealloc_block_remove_pending(flog_block_idx_t block_number) {
+    if (!flog_bitset_test(flogfs.prealloc.pending, block_number)) {
+        return;
+    }
+
+    flash_debug_warn("Pending->Free: block=%d", block_number);
+
+    flog_bitset_clear(flogfs.prealloc.pending, block_number);
+    flogfs.prealloc.npending -= 1;
+}
+
+static void flog_prealloc_heap_swap(uint16_t a, uint16_t b) {
+    flog_block_alloc_t temp = flogfs.prealloc.available[a];
+    flogfs.prealloc.available[a] = flogfs.prealloc.available[b];
+    flogfs.prealloc.available[b] = temp;
+}
+
+static void flog_prealloc_heap_sift_up(uint16_t i) {
+    flog_block_alloc_t *heap = flogfs.prealloc.available;
+
+    while (i > 0 && heap[(i - 1) / 2].age > heap[i].age) {
+        flog_prealloc_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void flog_prealloc_heap_sift_down(uint16_t i) {
+    flog_block_alloc_t *heap = flogfs.prealloc.available;
+
+    for (;;) {
+        uint16_t smallest = i;
+        uint16_t left = 2 * i + 1;
+        uint16_t right = 2 * i + 2;
+
+        if (left < flogfs.prealloc.n && heap[left].age < heap[smallest].age) {
+            smallest = left;
+        }
+        if (right < flogfs.prealloc.n && heap[right].age < heap[smallest].age) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+
+        flog_prealloc_heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static flog_block_alloc_t flog_prealloc_heap_remove(uint16_t i) {
+    flog_block_alloc_t entry = flogfs.prealloc.available[i];
+
+    flogfs.prealloc.n -= 1;
+    if (i != flogfs.prealloc.n) {
+        flogfs.prealloc.available[i] = flogfs.prealloc.available[flogfs.prealloc.n];
+        flog_prealloc_heap_sift_down(i);
+        flog_prealloc_heap_sift_up(i);
+    }
+
+    flog_bitset_clear(flogfs.prealloc.contains, entry.block);
+
+    return entry;
+}
+
+static void flog_prealloc_push(flog_block_idx_t block, flog_block_age_t age) {
+    flog_block_alloc_t *entry;
+
+    assert(!flog_prealloc_contains(block));
+    assert(!flog_prealloc_is_full());
+
+    entry = &flogfs.prealloc.available[flogfs.prealloc.n];
+    entry->block = block;
+    entry->age = age;
+
+    flog_bitset_set(flogfs.prealloc.contains, block);
+    flog_prealloc_heap_sift_up(flogfs.prealloc.n);
+    flogfs.prealloc.n++;
+
+    flash_debug_warn("Free->Available: block=%d size=%d", block, flogfs.prealloc.n);
+}
+
+static flog_block_alloc_t flog_prealloc_pop(int32_t threshold) {
+    flog_block_alloc_t entry;
+
+    flash_debug_warn("Pop");
+
+    if (threshold > 0) {
+        flog_prealloc_refine(threshold);
+    }
+
+    assert(flogfs.prealloc.n > 0);
+
+    entry = flog_prealloc_heap_remove(0);
+
+    flog_bitset_set(flogfs.prealloc.pending, entry.block);
+    flogfs.prealloc.npending += 1;
+    flash_debug_warn("Available->Pending: block=%d", entry.block);
+
+    return entry;
+}
+
+static flog_result_t flog_prealloc_refine(int32_t budget) {
+    flog_block_alloc_t candidate;
+    flog_block_alloc_t oldest;
+    uint16_t oldest_index;
+
+    flash_lock();
+
+    for ( ; budget > 0; budget--) {
+        if (FLOG_FAILURE == flog_prealloc_claim(&candidate)) {
+            flash_unlock();
+            return FLOG_FAILURE;
+        }
+        if (candidate.block == FLOG_BLOCK_IDX_INVALID) {
+            break;
+        }
+
+        if (!flog_prealloc_is_full()) {
+            flog_prealloc_push(candidate.block, candidate.age);
+            continue;
+        }
+
+        // The oldest entry is always one of the leaves
+        oldest_index = flogfs.prealloc.n / 2;
+        for (uint16_t i = oldest_index + 1; i < flogfs.prealloc.n; ++i) {
+            if (flogfs.prealloc.available[i].age > flogfs.prealloc.available[oldest_index].age) {
+                oldest_index = i;
+            }
+        }
+
+        if (flogfs.prealloc.n > 0 && candidate.age < flogfs.prealloc.available[oldest_index].age) {
+            oldest = flog_prealloc_heap_remove(oldest_index);
+            flog_free_blocks_set(oldest.block);
+
+            flog_prealloc_push(candidate.block, candidate.age);
+        }
+        else {
+            // Already erased, so it's a cheap pick for the next prime
+            flog_free_blocks_set(candidate.block);
+        }
+    }
+
+    flash_unlock();
+    return FLOG_SUCCESS;
+}
+
+static flog_result_t flog_open_page(flog_block_idx_t block, flog_page_index_t page) {
+    if (flogfs.cache_status.page_open && (flogfs.cache_status.current_open_block == block) &&
+        (flogfs.cache_status.current_open_page == page)) {
+        return flogfs.cache_status.page_open_result;
+    }
+    flogfs.cache_status.page_open = 1;
+    flogfs.cache_status.current_open_block = block;
+    flogfs.cache_status.current_open_page = page;
+
+    flog_prealloc_block_remove_pending(block);
+
+#if FS_READ_CACHE_PAGES
+    // It opened fine to get cached, and flog_flash_select opens it for real
+    if (flog_read_cache_find(block, page)) {
+        flogfs.cache_status.page_open_result = FLOG_SUCCESS;
+        return FLOG_SUCCESS;
+    }
+#endif
+
+    flogfs.cache_status.page_open_result = flog_flash_select();
+    return flogfs.cache_status.page_open_result;
+}
+
+static flog_result_t flog_flash_open_page(flog_block_idx_t block, flog_page_index_t page) {
+    flogfs.cache_status.flash_open_result = flash_open_page(block, page);
+    flogfs.cache_status.flash_open = 1;
+    flogfs.cache_status.flash_block = block;
+    flogfs.cache_status.flash_page = page;
+    return flogfs.cache_status.flash_open_result;
+}
+
+static flog_result_t flog_flash_select() {
+    if (flogfs.cache_status.flash_open && (flogfs.cache_status.flash_block == flogfs.cache_status.current_open_block) &&
+        (flogfs.cache_status.flash_page == flogfs.cache_status.current_open_page)) {
+        return flogfs.cache_status.flash_open_result;
+    }
+    return flog_flash_open_page(flogfs.cache_status.current_open_block, flogfs.cache_status.current_open_page);
+}
+
+static flog_result_t flog_read_sector(uint8_t *dst, flog_sector_idx_t sector, uint16_t offset, uint16_t n) {
+#if FS_READ_CACHE_PAGES
+    flog_read_cache_page_t *cached = flog_read_cache_get();
+    if (cached) {
+        memcpy(dst, &cached->data[sector % FS_SECTORS_PER_PAGE][offset], n);
+        return FLOG_SUCCESS;
+    }
+#else
+    flogfs.read_cache.stats.misses++;
+#endif
+    flog_flash_select();
+    return flash_read_sector(dst, sector, offset, n);
+}
+
+static flog_result_t flog_read_spare(uint8_t *dst, flog_sector_idx_t sector) {
+#if FS_READ_CACHE_PAGES
+    flog_read_cache_page_t *cached = flog_read_cache_get();
+    if (cached) {
+        memcpy(dst, &cached->spare[sector % FS_SECTORS_PER_PAGE], sizeof(flog_file_sector_spare_t));
+        return FLOG_SUCCESS;
+    }
+#else
+    flogfs.read_cache.stats.misses++;
+#endif
+    flog_flash_select();
+    return flash_read_spare(dst, sector);
+}
+
+static uint8_t const *flog_map_sector(flog_sector_idx_t sector, uint16_t offset) {
+#if FS_READ_CACHE_PAGES
+    flog_read_cache_page_t *cached = flog_read_cache_find(flogfs.cache_status.current_open_block, flogfs.cache_status.current_open_page);
+    if (cached) {
+        flogfs.read_cache.stats.hits++;
+        cached->last_used = ++flogfs.read_cache.clock;
+        return &cached->data[sector % FS_SECTORS_PER_PAGE][offset];
+    }
+#endif
+#if FS_FLASH_MAP_SECTOR
+    flogfs.read_cache.stats.misses++;
+    flog_flash_select();
+    return flash_map_sector(sector, offset);
+#else
+    return NULL;
+#endif
+}
+
+static void flog_write_sector(uint8_t const *src, flog_sector_idx_t sector, uint16_t offset, uint16_t n) {
+    flog_flash_select();
+    flog_read_cache_invalidate(flogfs.cache_status.current_open_block, flogfs.cache_status.current_open_page);
+    flash_write_sector(src, sector, offset, n);
+}
+
+static void flog_write_sector_gather(uint8_t const *head, uint16_t head_n, uint8_t const *src, flog_sector_idx_t sector, uint16_t n) {
+#if FS_FLASH_WRITE_SECTOR_GATHER
+    if (head_n && n) {
+        flog_flash_select();
+        flog_read_cache_invalidate(flogfs.cache_status.current_open_block, flogfs.cache_status.current_open_page);
+        flash_write_sector_gather(head, head_n, src, sector, n);
+        return;
+    }
+#endif
+    if (head_n) {
+        flog_write_sector(head, sector, 0, head_n);
+    }
+    if (n) {
+        flog_write_sector(src, sector, head_n, n);
+    }
+}
+
+static void flog_write_spare(uint8_t const *src, flog_sector_idx_t sector) {
+    flog_flash_select();
+    flog_read_cache_invalidate(flogfs.cache_status.current_open_block, flogfs.cache_status.current_open_page);
+    flash_write_spare(src, sector);
+}
+
+static flog_result_t flog_erase_block(flog_block_idx_t block) {
+    flog_read_cache_invalidate(block, FLOG_PAGE_IDX_INVALID);
+    return flash_erase_block(block);
+}
+
+static flog_result_t flog_block_is_bad() {
+    flog_flash_select();
+    return flash_block_is_bad();
+}
+
+static void flog_read_cache_reset() {
+#if FS_READ_CACHE_PAGES
+    for (uint16_t i = 0; i < FS_READ_CACHE_PAGES; ++i) {
+        flogfs.read_cache.pages[i].block = FLOG_BLOCK_IDX_INVALID;
+    }
+    flogfs.read_cache.clock = 0;
+#endif
+    flogfs.read_cache.stats.hits = 0;
+    flogfs.read_cache.stats.misses = 0;
+}
+
+static void flog_read_cache_invalidate(flog_block_idx_t block, flog_page_index_t page) {
+#if FS_READ_CACHE_PAGES
+    for (uint16_t i = 0; i < FS_READ_CACHE_PAGES; ++i) {
+        flog_read_cache_page_t *cached = &flogfs.read_cache.pages[i];
+        if (cached->block == block && (page == FLOG_PAGE_IDX_INVALID || cached->page == page)) {
+            cached->block = FLOG_BLOCK_IDX_INVALID;
+        }
+    }
+#endif
+}
+
+#if FS_READ_CACHE_PAGES
+static flog_read_cache_page_t *flog_read_cache_find(flog_block_idx_t block, flog_page_index_t page) {
+    for (uint16_t i = 0; i < FS_READ_CACHE_PAGES; ++i) {
+        if (flogfs.read_cache.pages[i].block == block && flogfs.read_cache.pages[i].page == page) {
+            return &flogfs.read_cache.pages[i];
+        }
+    }
+    return NULL;
+}
+
+static flog_read_cache_page_t *flog_read_cache_get() {
+    flog_block_idx_t block = flogfs.cache_status.current_open_block;
+    flog_page_index_t page = flogfs.cache_status.current_open_page;
+    flog_read_cache_page_t *cached = flog_read_cache_find(block, page);
+
+    if (cached) {
+        flogfs.read_cache.stats.hits++;
+        cached->last_used = ++flogfs.read_cache.clock;
+        return cached;
+    }
+
+    flogfs.read_cache.stats.misses++;
+
+    cached = &flogfs.read_cache.pages[0];
+    for (uint16_t i = 1; i < FS_READ_CACHE_PAGES && cached->block != FLOG_BLOCK_IDX_INVALID; ++i) {
+        if (flogfs.read_cache.pages[i].block == FLOG_BLOCK_IDX_INVALID ||
+            flogfs.read_cache.pages[i].last_used < cached->last_used) {
+            cached = &flogfs.read_cache.pages[i];
+        }
+    }
+
+    cached->block = FLOG_BLOCK_IDX_INVALID;
+    if (!flog_flash_select()) {
+        return NULL;
+    }
+    for (flog_sector_idx_t i = 0; i < FS_SECTORS_PER_PAGE; ++i) {
+        flog_sector_idx_t sector = page * FS_SECTORS_PER_PAGE + i;
+        if (!flash_read_sector(cached->data[i], sector, 0, FS_SECTOR_SIZE) ||
+            !flash_read_spare((uint8_t *)&cached->spare[i], sector)) {
+            return NULL;
+        }
+    }
+
+    cached->block = block;
+    cached->page = page;
+    cached->last_used = ++flogfs.read_cache.clock;
+    return cached;
+}
+#endif
+
+static flog_result_t flog_open_sector(flog_block_idx_t block, flog_sector_idx_t sector) {
+    return flog_open_page(block, sector / FS_SECTORS_PER_PAGE);
+}
+
+static void flog_close_sector() {
+    flogfs.cache_status.page_open = 0;
+}
+
+static flog_block_idx_t flog_universal_get_next_block(flog_block_idx_t block) {
+    if (block == FLOG_BLOCK_IDX_INVALID) {
+        return block;
+    }
+    flog_open_sector(block, FLOG_TAIL_SECTOR);
+    flog_read_sector((uint8_t *)&block, FLOG_TAIL_SECTOR, 0, sizeof(block));
+    if (invalid_block_index(block)) {
+        return FLOG_BLOCK_IDX_INVALID;
+    }
+    return block;
+}
+
+static void flog_inode_iterator_initialize(flog_inode_iterator_t *iter, flog_block_idx_t inode0) {
+    flog_inode_init_sector_spare_t inode_init_sector_spare;
+    flog_universal_tail_sector_t tail_sector;
+
+    iter->block = inode0;
+    flog_open_sector(inode0, FLOG_TAIL_SECTOR);
+    flog_read_sector((uint8_t *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_universal_tail_sector_t));
+    iter->next_block = tail_sector.next_block;
+
+    // Get the current inode block index
+    flog_open_sector(inode0, FLOG_INIT_SECTOR);
+    flog_read_spare((uint8_t *)&inode_init_sector_spare, FLOG_INIT_SECTOR);
+    iter->inode_block_idx = inode_init_sector_spare.inode_index;
+
+    // This is zero anyways
+    iter->inode_idx = 0;
+    iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+    // TODO: Coerce iter->next_block?
+}
+
+/*!
+ @details
+ ### Internals
+ Inode entries are organized sequentially in pairs of sectors following the
+ first page. The first page contains simple header information. To iterate to
+ the next entry, we simply advance by two sectors. If this goes past the end of
+ the block, the next block is checked. If the next block hasn't yet been
+ allocated, the sector is set to invalid to indicate that the next block has to
+ be allocated using flog_inode_prepare_new().
+ */
+static void flog_inode_iterator_next(flog_inode_iterator_t *iter) {
+    iter->sector += 2;
+    iter->inode_idx += 1;
+    if (iter->sector >= flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) {
+        // The next sector is in ANOTHER BLOCK!!!
+        if (iter->next_block != FLOG_BLOCK_IDX_INVALID) {
+            // The next block actually already exists
+            iter->block = iter->next_block;
+            // Check the next block
+            iter->next_block = flog_universal_get_next_block(iter->block);
+
+            // Point to the first inode sector of the next block
+            iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+        }
+        else {
+            // Don't do anything; this is dumb
+            // flash_debug_warn("FLogFS:" LINESTR);
+            // iter->sector -= 2;
+            // iter->inode_idx -= 1;
+            assert(false);
+        }
+    }
+}
+
+static void flog_inode_iterator_seek(flog_inode_iterator_t *iter, flog_block_idx_t block, flog_sector_idx_t sector) {
+    flog_inode_init_sector_spare_t inode_init_sector_spare;
+
+    iter->block = block;
+    iter->sector = sector;
+    iter->inode_idx = 0;
+    iter->next_block = FLOG_BLOCK_IDX_INVALID;
+    iter->inode_block_idx = 0;
+
+    if (sector == (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - 2) {
+        iter->next_block = flog_universal_get_next_block(block);
+
+        flog_open_sector(block, FLOG_INIT_SECTOR);
+        flog_read_spare((uint8_t *)&inode_init_sector_spare, FLOG_INIT_SECTOR);
+        iter->inode_block_idx = inode_init_sector_spare.inode_index;
+    }
+}
+
+static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t *iter) {
+    flog_block_alloc_t block_alloc;
+
+    union {
+        flog_universal_tail_sector_t inode_tail_sector;
+        flog_inode_init_sector_t inode_init_sector;
+        flog_inode_init_sector_spare_t inode_init_sector_spare;
+    } buffer_union;
+
+    if (iter->sector == (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - 2) {
+        // assert(iter->next_block != FLOG_BLOCK_IDX_INVALID);
+
+        flog_lock_allocate();
+
+        block_alloc = flog_allocate_block(0);
+        if (block_alloc.block == FLOG_BLOCK_IDX_INVALID) {
+            flog_unlock_allocate();
+            return FLOG_FAILURE;
+        }
+
+        flog_unlock_allocate();
+
+        flog_open_sector(iter->block, FLOG_TAIL_SECTOR);
+        buffer_union.inode_tail_sector.next_age = block_alloc.age + 1;
+        buffer_union.inode_tail_sector.next_block = block_alloc.block;
+        buffer_union.inode_tail_sector.timestamp = ++flogfs.t;
+        flog_write_sector((uint8_t *)&buffer_union.inode_tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_universal_tail_sector_t));
+        flash_commit();
+
+        flog_open_sector(block_alloc.block, FLOG_INIT_SECTOR);
+        buffer_union.inode_init_sector.universal.timestamp = flogfs.t;
+        buffer_union.inode_init_sector.previous = iter->block;
+        buffer_union.inode_init_sector.max_file_id = flogfs.max_file_id;
+        flog_write_sector((uint8_t *)&buffer_union.inode_init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_inode_init_sector_t));
+
+        buffer_union.inode_init_sector_spare.type_id = FLOG_BLOCK_TYPE_INODE;
+        buffer_union.inode_init_sector_spare.nothing = 0;
+        buffer_union.inode_init_sector_spare.inode_index = ++iter->inode_block_idx;
+        flog_write_spare((uint8_t *)&buffer_union.inode_init_sector_spare, FLOG_INIT_SECTOR);
+        flash_commit();
+
+        iter->next_block = block_alloc.block;
+    }
+
+    return FLOG_SUCCESS;
+}
+
+static void flog_block_statistics_write(flog_block_idx_t block, flog_block_statistics_sector_with_key_t const *sector) {
+    assert(sector->header.version != 0);
+
+    flog_open_sector(block, FLOG_BLOCK_STATISTICS_SECTOR);
+    flog_write_sector((uint8_t const *)sector, FLOG_BLOCK_STATISTICS_SECTOR, 0, sizeof(flog_block_statistics_sector_with_key_t));
+    flash_commit();
+}
+
+static void flog_block_statistics_read(flog_block_idx_t block, flog_block_statistics_sector_with_key_t *sector) {
+    flog_open_sector(block, FLOG_BLOCK_STATISTICS_SECTOR);
+    flog_read_sector((uint8_t *)sector, FLOG_BLOCK_STATISTICS_SECTOR, 0, sizeof(flog_block_statistics_sector_with_key_t));
+}
+
+static uint16_t flog_checkpoint_slots() {
+    return ((flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - FLOG_CHECKPOINT_FIRST_SECTOR) / 2;
+}
+
+static flog_sector_idx_t flog_checkpoint_slot_sector(uint16_t slot) {
+    return FLOG_CHECKPOINT_FIRST_SECTOR + slot * 2;
+}
+
+static flog_result_t flog_checkpoint_restore() {
+    flog_checkpoint_sector_t checkpoint;
+    flog_checkpoint_release_t release;
+    flog_inode_init_sector_spare_t inode_spare;
+    flog_inode_file_allocation_header_t allocation;
+    flog_sector_idx_t sector;
+    uint16_t low = 0;
+    uint16_t high = flog_checkpoint_slots();
+
+    if (flogfs.checkpoint_block == FLOG_BLOCK_IDX_INVALID) {
+        return FLOG_FAILURE;
+    }
+
+    // Entries are written in order, so find the first one that never was
+    while (low < high) {
+        uint16_t middle = (low + high) / 2;
+        sector = flog_checkpoint_slot_sector(middle);
+        flog_open_sector(flogfs.checkpoint_block, sector);
+        flog_read_sector((uint8_t *)&checkpoint, sector, 0, sizeof(flog_checkpoint_sector_t));
+        if (memcmp(checkpoint.key, flog_checkpoint_key, sizeof(flog_checkpoint_key)) != 0) {
+            high = middle;
+        }
+        else {
+            low = middle + 1;
+        }
+    }
+
+    flogfs.checkpoint_slot = low;
+
+    if (low == 0) {
+        return FLOG_FAILURE;
+    }
+
+    sector = flog_checkpoint_slot_sector(low - 1);
+    flog_open_sector(flogfs.checkpoint_block, sector);
+    flog_read_sector((uint8_t *)&checkpoint, sector, 0, sizeof(flog_checkpoint_sector_t));
+    flog_open_sector(flogfs.checkpoint_block, sector + 1);
+    flog_read_sector((uint8_t *)&release, sector + 1, 0, sizeof(flog_checkpoint_release_t));
+
+    if (invalid_checkpoint(&checkpoint) || !invalid_timestamp(release.timestamp)) {
+        // Consumed by an earlier mount, anything may have happened since
+        return FLOG_FAILURE;
+    }
+
+    if (checkpoint.header.inode_tail_block >= flogfs.params.number_of_blocks ||
+        checkpoint.header.inode_tail_sector < FLOG_INODE_FIRST_ENTRY_SECTOR ||
+        checkpoint.header.inode_tail_sector >= flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) {
+        return FLOG_FAILURE;
+    }
+
+    // The recorded end of the inode table must still be the end
+    flog_open_sector(checkpoint.header.inode_tail_block, FLOG_INIT_SECTOR);
+    flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+    if (inode_spare.type_id != FLOG_BLOCK_TYPE_INODE) {
+        return FLOG_FAILURE;
+    }
 
-            switch (state.type_id) {
-            case FLOG_BLOCK_TYPE_INODE: {
-                flogfs_walk_inode_block_state_t *inode = &state.types.inode;
-                flog_inode_file_allocation_t allocation;
-                flog_inode_file_invalidation_t invalidation;
+    flog_open_sector(checkpoint.header.inode_tail_block, checkpoint.header.inode_tail_sector);
+    flog_read_sector((uint8_t *)&allocation, checkpoint.header.inode_tail_sector, 0, sizeof(flog_inode_file_allocation_header_t));
+    if (!invalid_inode_file_allocation_header(&allocation)) {
+        return FLOG_FAILURE;
+    }
 
-                inode->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+    flogfs.t = checkpoint.header.timestamp;
+    flogfs.max_file_id = checkpoint.header.max_file_id;
+    flogfs.inode_tail_block = checkpoint.header.inode_tail_block;
+    flogfs.inode_tail_sector = checkpoint.header.inode_tail_sector;
+    flogfs.allocate_head = checkpoint.header.allocate_head;
+    if (checkpoint.header.age_table < flogfs.params.number_of_blocks) {
+        flogfs.age_table = checkpoint.header.age_table;
+    }
+    for (uint8_t i = 0; i < FLOG_RECLAIM_QUEUE_SIZE; ++i) {
+        if (checkpoint.header.reclaim[i].first_block < flogfs.params.number_of_blocks) {
+            flogfs.reclaim.queue[flogfs.reclaim.n++] = checkpoint.header.reclaim[i];
+        }
+    }
+    // The checkpoint only has room for what was queued
+    flogfs.reclaim.overflow = flogfs.reclaim.n == FLOG_RECLAIM_QUEUE_SIZE;
 
-                while (inode->sector < flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) {
-                    inode->valid = false;
-                    inode->file_name[0] = 0;
-                    inode->file_id = FLOG_FILE_ID_INVALID;
-                    inode->first_block = FLOG_BLOCK_IDX_INVALID;
-                    inode->last_block = FLOG_BLOCK_IDX_INVALID;
-                    inode->created_at = FLOG_TIMESTAMP_INVALID;
-                    inode->deleted_at = FLOG_TIMESTAMP_INVALID;
+    release.timestamp = ++flogfs.t;
+    flog_open_sector(flogfs.checkpoint_block, sector + 1);
+    flog_write_sector((uint8_t const *)&release, sector + 1, 0, sizeof(flog_checkpoint_release_t));
+    flash_commit();
 
-                    flog_open_sector(state.block, inode->sector);
-                    flash_read_sector((uint8_t *)&allocation, inode->sector, 0, sizeof(flog_inode_file_allocation_t));
-                    flog_close_sector();
+    return FLOG_SUCCESS;
+}
 
-                    state.types.inode.valid = !invalid_inode_file_allocation_header(&allocation.header);
-                    if (inode->valid) {
-                        flog_open_sector(state.block, inode->sector + 1);
-                        flash_read_sector((uint8_t *)&invalidation, inode->sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
-                        flog_close_sector();
+/*!
+ @brief Erase a full checkpoint block and prepare it for new entries
+ */
+static flog_result_t flog_checkpoint_recycle() {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_block_idx_t block = flogfs.checkpoint_block;
 
-                        strcpy(inode->file_name, allocation.filename);
-                        inode->file_id = allocation.header.file_id;
-                        inode->first_block = allocation.header.first_block;
-                        inode->created_at = allocation.header.timestamp;
+    union {
+        flog_universal_init_sector_t init_sector;
+        flog_checkpoint_init_sector_spare_t init_sector_spare;
+    } buffer_union;
 
-                        inode->deleted = !invalid_inode_file_invalidation(&invalidation);
-                        inode->last_block = invalidation.header.last_block;
-                        inode->deleted_at = invalidation.header.timestamp;
-                    }
+    flog_block_statistics_read(block, &statistics_sector);
+    flog_close_sector();
 
-                    walk_fn(&state, arg);
+    if (!flog_erase_block_and_age(block, &statistics_sector)) {
+        return FLOG_FAILURE;
+    }
 
-                    inode->sector += 2;
-                }
-                break;
-            }
-            case FLOG_BLOCK_TYPE_FILE: {
-                flogfs_walk_file_block_state_t *fb = &state.types.file;
-                flog_file_sector_spare_t file_sector_spare;
+    flog_open_sector(block, FLOG_INIT_SECTOR);
+    buffer_union.init_sector.timestamp = flogfs.t;
+    flog_write_sector((uint8_t const *)&buffer_union.init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_universal_init_sector_t));
 
-                fb->sector = FLOG_INIT_SECTOR;
+    buffer_union.init_sector_spare.type_id = FLOG_BLOCK_TYPE_CHECKPOINT;
+    buffer_union.init_sector_spare.nothing = 0;
+    buffer_union.init_sector_spare.reserved = 0;
+    flog_write_spare((uint8_t const *)&buffer_union.init_sector_spare, FLOG_INIT_SECTOR);
+    flash_commit();
 
-                while (true) {
-                    flog_open_sector(state.block, fb->sector);
-                    flash_read_spare((uint8_t *)&file_sector_spare, fb->sector);
-                    flog_close_sector();
+    flogfs.checkpoint_slot = 0;
 
-                    fb->valid = !invalid_sector_spare(&file_sector_spare);
-                    fb->file_id = init_sector.file.file_id;
-                    fb->size = file_sector_spare.nbytes;
+    return FLOG_SUCCESS;
+}
 
-                    walk_fn(&state, arg);
+static flog_result_t flog_checkpoint_write() {
+    flog_checkpoint_sector_t checkpoint;
+    flog_sector_idx_t sector;
 
-                    if (fb->sector == FLOG_TAIL_SECTOR) {
-                        break;
-                    }
+    if (flogfs.checkpoint_block == FLOG_BLOCK_IDX_INVALID) {
+        // Nowhere to put it, the next mount will have to inspect
+        return FLOG_SUCCESS;
+    }
 
-                    fb->sector = flog_increment_sector(fb->sector);
-                }
-                break;
-            }
-            }
+    if (flogfs.checkpoint_slot >= flog_checkpoint_slots()) {
+        if (!flog_checkpoint_recycle()) {
+            return FLOG_FAILURE;
+        }
+    }
+
+    checkpoint.header.timestamp = flogfs.t;
+    checkpoint.header.max_file_id = flogfs.max_file_id;
+    checkpoint.header.inode_tail_block = flogfs.inode_tail_block;
+    checkpoint.header.inode_tail_sector = flogfs.inode_tail_sector;
+    checkpoint.header.allocate_head = flogfs.allocate_head;
+    checkpoint.header.age_table = flogfs.age_table;
+    for (uint8_t i = 0; i < FLOG_RECLAIM_QUEUE_SIZE; ++i) {
+        if (i < flogfs.reclaim.n) {
+            checkpoint.header.reclaim[i] = flogfs.reclaim.queue[(flogfs.reclaim.head + i) % FLOG_RECLAIM_QUEUE_SIZE];
         }
         else {
-            walk_fn(&state, arg);
+            checkpoint.header.reclaim[i].first_block = FLOG_BLOCK_IDX_INVALID;
+            checkpoint.header.reclaim[i].file_id = FLOG_FILE_ID_INVALID;
         }
     }
+    checkpoint.header.version = flogfs.version;
+    memcpy(checkpoint.key, flog_checkpoint_key, sizeof(flog_checkpoint_key));
 
-    flog_unlock_fs();
-    flash_unlock();
+    sector = flog_checkpoint_slot_sector(flogfs.checkpoint_slot);
+    flog_open_sector(flogfs.checkpoint_block, sector);
+    flog_write_sector((uint8_t const *)&checkpoint, sector, 0, sizeof(flog_checkpoint_sector_t));
+    flash_commit();
+
+    flogfs.checkpoint_slot++;
 
     return FLOG_SUCCESS;
 }
 
-static flog_result_t flog_flush_write(flog_write_file_t *file) {
-    flog_result_t fr = flog_commit_file_sector(file, 0, 0);
-    if (!fr) {
-        return FLOG_FAILURE;
+static flog_result_t flog_erase_block_and_age(flog_block_idx_t block, flog_block_statistics_sector_with_key_t *stat) {
+    if (invalid_block(stat)) {
+        stat->header.age = 0;
+        memcpy(stat->key, flog_block_statistics_key, sizeof(flog_block_statistics_key));
+    }
+    else {
+        stat->header.age++;
     }
+    stat->header.next_block = FLOG_BLOCK_IDX_INVALID;
+    stat->header.next_age = FLOG_BLOCK_AGE_INVALID;
+    stat->header.timestamp = ++flogfs.t;
+    stat->header.version = flogfs.version;
 
-    // The above commit may have allocated a new block, leaving that block dirty
-    // so we flush again in that situation.
-    if (file == flogfs.dirty_block.file) {
-        printk("Flush Dirty Block!\n");
-        fr = flog_commit_file_sector(file, 0, 0);
-        assert(flogfs.dirty_block.file == nullptr);
-        assert(flogfs.dirty_block.block == FLOG_BLOCK_IDX_INVALID);
+    if (FLOG_FAILURE == flog_erase_block(block)) {
+        return FLOG_FAILURE;
     }
 
-    return fr;
+    flog_block_statistics_write(block, stat);
+
+    return FLOG_SUCCESS;
 }
 
-static uint_fast8_t flog_prealloc_has_block(flog_block_alloc_t *list, flog_block_idx_t block_number) {
-    for (flog_block_alloc_t *iter = list; iter != NULL; iter = iter->next) {
-        if (iter->block == block_number) {
-            return true;
-        }
-    }
-    return false;
+static void flog_age_table_entry_pack(flog_age_table_entry_t *entry, flog_block_idx_t block, flog_block_age_t age, flog_age_table_state_t state) {
+    uint32_t packed = (age & FLOG_AGE_TABLE_AGE_MASK) | ((uint32_t)state << FLOG_AGE_TABLE_STATE_SHIFT);
+
+    entry->block[0] = block & 0xff;
+    entry->block[1] = block >> 8;
+    entry->age[0] = packed & 0xff;
+    entry->age[1] = (packed >> 8) & 0xff;
+    entry->age[2] = (packed >> 16) & 0xff;
 }
 
-static uint_fast8_t flog_prealloc_contains(flog_block_idx_t block) {
-    return flog_prealloc_has_block(flogfs.prealloc.free, block) ||
-           flog_prealloc_has_block(flogfs.prealloc.pending, block) ||
-           flog_prealloc_has_block(flogfs.prealloc.available, block);
+static flog_block_idx_t flog_age_table_entry_block(flog_age_table_entry_t const *entry) {
+    return entry->block[0] | (entry->block[1] << 8);
 }
 
-static flog_block_alloc_t *flog_prealloc_block_prepend(flog_block_alloc_t *list, flog_block_alloc_t *entry) {
-    entry->next = list;
-    return entry;
+static flog_block_age_t flog_age_table_entry_age(flog_age_table_entry_t const *entry) {
+    uint32_t packed = entry->age[0] | (entry->age[1] << 8) | ((uint32_t)entry->age[2] << 16);
+    return packed & FLOG_AGE_TABLE_AGE_MASK;
+}
+
+static flog_age_table_state_t flog_age_table_entry_state(flog_age_table_entry_t const *entry) {
+    return (flog_age_table_state_t)(entry->age[2] >> (FLOG_AGE_TABLE_STATE_SHIFT - 16));
 }
 
-static flog_block_alloc_t *flog_prealloc_block_append(flog_block_alloc_t *list, flog_block_alloc_t *entry) {
-    entry->next = NULL;
+static flog_block_idx_t flog_age_table_write() {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_age_table_entry_t entries[FS_SECTOR_SIZE / sizeof(flog_age_table_entry_t)];
+    flog_block_alloc_t chain[FLOG_AGE_TABLE_MAX_BLOCKS];
+    uint8_t linked[(FS_MAXIMUM_BLOCKS + 7) / 8];
+    flog_age_table_state_t state;
+    flog_age_table_sector_spare_t table_spare;
+    flog_block_idx_t block;
+    flog_sector_idx_t sector = FLOG_AGE_TABLE_FIRST_SECTOR;
+    flog_timestamp_t timestamp;
+    uint16_t nentries = 0;
+    uint16_t link = 0;
+
+    union {
+        flog_age_table_init_sector_t init_sector;
+        flog_inode_init_sector_spare_t init_sector_spare;
+    } buffer_union;
 
-    assert(list != entry);
+    uint16_t const entries_per_sector = FS_SECTOR_SIZE / sizeof(flog_age_table_entry_t);
+    uint32_t const entries_per_block = entries_per_sector * (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE - 3);
+    uint16_t const nchain = (flogfs.params.number_of_blocks + entries_per_block - 1) / entries_per_block;
 
-    if (list == NULL) {
-        return entry;
+    if (nchain > FLOG_AGE_TABLE_MAX_BLOCKS) {
+        return FLOG_BLOCK_IDX_INVALID;
     }
-    else {
-        for (flog_block_alloc_t *iter = list; iter != NULL; ) {
-            if (iter->next == NULL) {
-                iter->next = entry;
-                break;
-            }
-            else {
-                iter = iter->next;
-            }
 
+    // The whole chain is claimed up front so that it's recorded as in use
+    flog_lock_allocate();
+    for (uint16_t i = 0; i < nchain; ++i) {
+        chain[i] = flog_allocate_block(0);
+        if (chain[i].block == FLOG_BLOCK_IDX_INVALID) {
+            flog_unlock_allocate();
+            return FLOG_BLOCK_IDX_INVALID;
         }
     }
-    return list;
-}
+    flog_unlock_allocate();
 
-static void flog_prealloc_block_remove_pending(flog_block_idx_t block_number) {
-    flog_block_alloc_t *last = NULL;
+    timestamp = ++flogfs.t;
+
+    // These look free but the next mount has to keep them for their files
+    flog_linked_blocks_find(linked);
 
-    for (flog_block_alloc_t *iter = flogfs.prealloc.pending; iter != NULL; iter = iter->next) {
-        if (iter->block == block_number) {
-            flash_debug_warn("Pending->Free: block=%d", block_number);
+    for (uint16_t i = 0; i < nchain; ++i) {
+        flog_open_sector(chain[i].block, FLOG_INIT_SECTOR);
+        buffer_union.init_sector.universal.timestamp = timestamp;
+        buffer_union.init_sector.sequence = i;
+        flog_write_sector((uint8_t const *)&buffer_union.init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_age_table_init_sector_t));
+
+        table_spare.type_id = FLOG_BLOCK_TYPE_AGE_TABLE;
+        table_spare.nothing = 0;
+        table_spare.nentries = 0;
+        flog_write_spare((uint8_t const *)&table_spare, FLOG_INIT_SECTOR);
+        flash_commit();
+    }
 
-            iter->block = FLOG_BLOCK_IDX_INVALID;
-            iter->age = FLOG_BLOCK_AGE_INVALID;
+    // Every block gets an entry, bad ones too, so the whole table can be
+    // told apart from one cut short
+    for (block = 0; block < flogfs.params.number_of_blocks; ++block) {
+        if (FLOG_FAILURE == flog_open_page(block, 0) || FLOG_SUCCESS == flog_block_is_bad()) {
+            flog_age_table_entry_pack(&entries[nentries++], block, 0, FLOG_AGE_TABLE_USED);
+        }
+        else {
+            flog_block_statistics_read(block, &statistics_sector);
+            flog_read_spare((uint8_t *)&buffer_union.init_sector_spare, FLOG_INIT_SECTOR);
 
-            if (last == NULL) {
-                flogfs.prealloc.pending = iter->next;
+            if (invalid_block_or_older_version(&statistics_sector)) {
+                state = FLOG_AGE_TABLE_STALE;
+                if (invalid_block(&statistics_sector)) {
+                    statistics_sector.header.age = 0;
+                }
             }
             else {
-                last->next = iter->next;
+                switch (buffer_union.init_sector_spare.type_id) {
+                case FLOG_BLOCK_TYPE_UNALLOCATED: {
+                    if (flog_bitset_test(linked, block)) {
+                        state = FLOG_AGE_TABLE_USED;
+                    }
+                    else if (flog_unallocated_block_is_written(block)) {
+                        state = FLOG_AGE_TABLE_STALE;
+                    }
+                    else {
+                        state = FLOG_AGE_TABLE_FREE;
+                    }
+                    break;
+                }
+                case FLOG_BLOCK_TYPE_AGE_TABLE: {
+                    // Left over from an earlier unmount unless it's one of ours
+                    flog_open_sector(block, FLOG_INIT_SECTOR);
+                    flog_read_sector((uint8_t *)&buffer_union.init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_age_table_init_sector_t));
+                    state = (buffer_union.init_sector.universal.timestamp == timestamp) ? FLOG_AGE_TABLE_USED : FLOG_AGE_TABLE_STALE;
+                    break;
+                }
+                default: {
+                    state = FLOG_AGE_TABLE_USED;
+                    break;
+                }
+                }
             }
 
-            flogfs.prealloc.free = flog_prealloc_block_prepend(flogfs.prealloc.free, iter);
-            break;
+            flog_age_table_entry_pack(&entries[nentries++], block, statistics_sector.header.age, state);
         }
 
-        last = iter;
+        if (nentries == entries_per_sector) {
+            flog_age_table_write_sector(chain, nchain, &link, &sector, timestamp, entries, nentries);
+            nentries = 0;
+        }
     }
-}
-
-static void flog_prealloc_push(flog_block_idx_t block, flog_block_age_t age) {
-    flog_block_alloc_t *entry;
-
-    assert(!flog_prealloc_contains(block));
-    assert(flogfs.prealloc.free != NULL);
-
-    entry = flogfs.prealloc.free;
-    flogfs.prealloc.free = flogfs.prealloc.free->next;
 
-    entry->next = NULL;
-    entry->block = block;
-    entry->age = age;
-
-    flogfs.prealloc.age_sum += age;
-    flogfs.prealloc.n++;
-
-    flogfs.prealloc.available = flog_prealloc_block_append(flogfs.prealloc.available, entry);
+    if (nentries) {
+        flog_age_table_write_sector(chain, nchain, &link, &sector, timestamp, entries, nentries);
+    }
 
-    flash_debug_warn("Free->Available: block=%d size=%d", entry->block, flogfs.prealloc.n);
+    return chain[0].block;
 }
 
-static flog_block_alloc_t flog_prealloc_pop(int32_t threshold) {
-    flog_block_alloc_t *entry;
-
-    flash_debug_warn("Pop");
-
-    assert(flogfs.prealloc.available != NULL);
+static void flog_age_table_write_sector(flog_block_alloc_t const *chain, uint16_t nchain, uint16_t *link, flog_sector_idx_t *sector,
+                                        flog_timestamp_t timestamp, flog_age_table_entry_t const *entries, uint16_t nentries) {
+    flog_age_table_sector_spare_t table_spare;
+    flog_universal_tail_sector_t tail_sector;
 
-    entry = flogfs.prealloc.available;
-    flogfs.prealloc.available = entry->next;
+    flog_open_sector(chain[*link].block, *sector);
+    flog_write_sector((uint8_t const *)entries, *sector, 0, nentries * sizeof(flog_age_table_entry_t));
+    table_spare.type_id = FLOG_BLOCK_TYPE_AGE_TABLE;
+    table_spare.nothing = 0;
+    table_spare.nentries = nentries;
+    flog_write_spare((uint8_t const *)&table_spare, *sector);
+    flash_commit();
 
-    flogfs.prealloc.n -= 1;
-    flogfs.prealloc.pending = flog_prealloc_block_append(flogfs.prealloc.pending, entry);
-    flash_debug_warn("Available->Pending: block=%d", entry->block);
+    *sector = flog_increment_sector(*sector);
+    if (*sector == FLOG_TAIL_SECTOR && *link + 1 < nchain) {
+        flog_open_sector(chain[*link].block, FLOG_TAIL_SECTOR);
+        tail_sector.next_block = chain[*link + 1].block;
+        tail_sector.next_age = chain[*link + 1].age;
+        tail_sector.timestamp = timestamp;
+        flog_write_sector((uint8_t const *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_universal_tail_sector_t));
+        flash_commit();
 
-    return *entry;
+        (*link)++;
+        *sector = FLOG_AGE_TABLE_FIRST_SECTOR;
+    }
 }
 
-static flog_result_t flog_open_page(flog_block_idx_t block, flog_page_index_t page) {
-    if (flogfs.cache_status.page_open && (flogfs.cache_status.current_open_block == block) &&
-        (flogfs.cache_status.current_open_page == page)) {
-        return flogfs.cache_status.page_open_result;
-    }
-    flogfs.cache_status.page_open_result = flash_open_page(block, page);
-    flogfs.cache_status.page_open = 1;
-    flogfs.cache_status.current_open_block = block;
-    flogfs.cache_status.current_open_page = page;
+static flog_result_t flog_age_table_load() {
+    flog_age_table_entry_t entries[FS_SECTOR_SIZE / sizeof(flog_age_table_entry_t)];
+    flog_age_table_sector_spare_t table_spare;
+    flog_age_table_init_sector_t init_sector;
+    flog_block_idx_t table_block = flogfs.age_table;
+    flog_sector_idx_t sector;
+    uint32_t sequence = 0;
+    flog_block_idx_t nentries = 0;
+
+    while (table_block != FLOG_BLOCK_IDX_INVALID && sequence < FLOG_AGE_TABLE_MAX_BLOCKS) {
+        flog_open_sector(table_block, FLOG_INIT_SECTOR);
+        flog_read_spare((uint8_t *)&table_spare, FLOG_INIT_SECTOR);
+        flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_age_table_init_sector_t));
+        if (table_spare.type_id != FLOG_BLOCK_TYPE_AGE_TABLE || init_sector.sequence != sequence) {
+            return FLOG_FAILURE;
+        }
 
-    flog_prealloc_block_remove_pending(block);
+        for (sector = FLOG_AGE_TABLE_FIRST_SECTOR; sector != FLOG_TAIL_SECTOR; sector = flog_increment_sector(sector)) {
+            flog_open_sector(table_block, sector);
+            flog_read_spare((uint8_t *)&table_spare, sector);
+            if (table_spare.type_id != FLOG_BLOCK_TYPE_AGE_TABLE) {
+                // That's the end of the table
+                break;
+            }
 
-    return flogfs.cache_status.page_open_result;
-}
+            flog_read_sector((uint8_t *)entries, sector, 0, table_spare.nentries * sizeof(flog_age_table_entry_t));
 
-static flog_result_t flog_open_sector(flog_block_idx_t block, flog_sector_idx_t sector) {
-    return flog_open_page(block, sector / FS_SECTORS_PER_PAGE);
-}
+            for (uint16_t i = 0; i < table_spare.nentries; ++i) {
+                flog_block_idx_t block = flog_age_table_entry_block(&entries[i]);
+                nentries++;
+                if (flog_age_table_entry_state(&entries[i]) == FLOG_AGE_TABLE_USED || block == 0) {
+                    continue;
+                }
+                if (block >= flogfs.params.number_of_blocks) {
+                    return FLOG_FAILURE;
+                }
+                // Free blocks can skip the trip through flog_prealloc_prime
+                if (flog_age_table_entry_state(&entries[i]) != FLOG_AGE_TABLE_FREE) {
+                    flog_free_blocks_set_stale(block);
+                }
+                else if (!flog_prealloc_is_full()) {
+                    flog_prealloc_push(block, flog_age_table_entry_age(&entries[i]));
+                }
+                else {
+                    flog_free_blocks_set(block);
+                }
+            }
+        }
 
-static void flog_close_sector() {
-    flogfs.cache_status.page_open = 0;
-}
+        // The table itself is consumed by this mount
+        flog_free_blocks_set_stale(table_block);
 
-static flog_block_idx_t flog_universal_get_next_block(flog_block_idx_t block) {
-    if (block == FLOG_BLOCK_IDX_INVALID) {
-        return block;
-    }
-    flog_open_sector(block, FLOG_TAIL_SECTOR);
-    flash_read_sector((uint8_t *)&block, FLOG_TAIL_SECTOR, 0, sizeof(block));
-    if (invalid_block_index(block)) {
-        return FLOG_BLOCK_IDX_INVALID;
+        table_block = flog_universal_get_next_block(table_block);
+        sequence++;
     }
-    return block;
-}
 
-static void flog_inode_iterator_initialize(flog_inode_iterator_t *iter, flog_block_idx_t inode0) {
-    flog_inode_init_sector_spare_t inode_init_sector_spare;
-    flog_universal_tail_sector_t tail_sector;
+    return FLOG_RESULT(nentries == flogfs.params.number_of_blocks);
+}
 
-    iter->block = inode0;
-    flog_open_sector(inode0, FLOG_TAIL_SECTOR);
-    flash_read_sector((uint8_t *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_universal_tail_sector_t));
-    iter->next_block = tail_sector.next_block;
+static void flog_free_blocks_scan() {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_inode_init_sector_spare_t inode_spare;
+    flog_file_init_sector_header_t init_sector;
+    uint8_t linked[(FS_MAXIMUM_BLOCKS + 7) / 8];
+    flog_block_idx_t block;
 
-    // Get the current inode block index
-    flog_open_sector(inode0, FLOG_INIT_SECTOR);
-    flash_read_spare((uint8_t *)&inode_init_sector_spare, FLOG_INIT_SECTOR);
-    iter->inode_block_idx = inode_init_sector_spare.inode_index;
+    for (block = FS_FIRST_BLOCK; block < flogfs.params.number_of_blocks; ++block) {
+        if (FLOG_FAILURE == flog_open_page(block, 0)) {
+            continue;
+        }
+        if (FLOG_SUCCESS == flog_block_is_bad()) {
+            continue;
+        }
 
-    // This is zero anyways
-    iter->inode_idx = 0;
-    iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
-    // TODO: Coerce iter->next_block?
-}
+        flog_block_statistics_read(block, &statistics_sector);
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
 
-/*!
- @details
- ### Internals
- Inode entries are organized sequentially in pairs of sectors following the
- first page. The first page contains simple header information. To iterate to
- the next entry, we simply advance by two sectors. If this goes past the end of
- the block, the next block is checked. If the next block hasn't yet been
- allocated, the sector is set to invalid to indicate that the next block has to
- be allocated using flog_inode_prepare_new().
- */
-static void flog_inode_iterator_next(flog_inode_iterator_t *iter) {
-    iter->sector += 2;
-    iter->inode_idx += 1;
-    if (iter->sector >= flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) {
-        // The next sector is in ANOTHER BLOCK!!!
-        if (iter->next_block != FLOG_BLOCK_IDX_INVALID) {
-            // The next block actually already exists
-            iter->block = iter->next_block;
-            // Check the next block
-            iter->next_block = flog_universal_get_next_block(iter->block);
+        if (invalid_block_or_older_version(&statistics_sector)) {
+            flog_free_blocks_set_stale(block);
+            continue;
+        }
 
-            // Point to the first inode sector of the next block
-            iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+        switch (inode_spare.type_id) {
+        case FLOG_BLOCK_TYPE_UNALLOCATED: {
+            if (flog_unallocated_block_is_written(block)) {
+                flog_free_blocks_set_stale(block);
+            }
+            else {
+                flog_free_blocks_set(block);
+            }
+            break;
+        }
+        case FLOG_BLOCK_TYPE_INODE:
+        case FLOG_BLOCK_TYPE_AGE_TABLE: {
+            // Inode blocks get claimed back below if they're in the table
+            flog_free_blocks_set_stale(block);
+            break;
+        }
+        case FLOG_BLOCK_TYPE_FILE: {
+            flog_open_sector(block, FLOG_INIT_SECTOR);
+            flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+            if (init_sector.file_id > flogfs.max_file_id) {
+                flog_free_blocks_set_stale(block);
+            }
+            break;
+        }
+        default: {
+            break;
         }
-        else {
-            // Don't do anything; this is dumb
-            // flash_debug_warn("FLogFS:" LINESTR);
-            // iter->sector -= 2;
-            // iter->inode_idx -= 1;
-            assert(false);
         }
     }
+
+    // Of these only the unwritten ones could have been marked free above
+    flog_linked_blocks_find(linked);
+    for (block = FS_FIRST_BLOCK; block < flogfs.params.number_of_blocks; ++block) {
+        if (flog_bitset_test(linked, block)) {
+            flog_free_blocks_clear(block);
+            flog_bitset_clear(flogfs.erase_blocks, block);
+        }
+    }
+
+    // Anything else was left behind by flogfs_compact()
+    block = flogfs.inode0;
+    for (flog_block_idx_t i = flogfs.params.number_of_blocks; i && block != FLOG_BLOCK_IDX_INVALID; i--) {
+        flog_free_blocks_clear(block);
+        flog_bitset_clear(flogfs.erase_blocks, block);
+        block = flog_universal_get_next_block(block);
+    }
+
+    flog_close_sector();
 }
 
-static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t *iter) {
-    flog_block_alloc_t block_alloc;
+static uint_fast8_t flog_unallocated_block_is_written(flog_block_idx_t block) {
+    // Not every init sector is stamped, so look at the whole header
+    uint8_t init_sector[sizeof(flog_file_init_sector_header_t)];
+    flog_inode_file_allocation_header_t allocation;
 
-    union {
-        flog_universal_tail_sector_t inode_tail_sector;
-        flog_inode_init_sector_t inode_init_sector;
-        flog_inode_init_sector_spare_t inode_init_sector_spare;
-    } buffer_union;
+    flog_open_sector(block, FLOG_INIT_SECTOR);
+    flog_read_sector(init_sector, FLOG_INIT_SECTOR, 0, sizeof(init_sector));
+    for (uint16_t i = 0; i < sizeof(init_sector); ++i) {
+        if (init_sector[i] != FS_ERASE_CHAR) {
+            return true;
+        }
+    }
 
-    if (iter->sector == (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - 2) {
-        // assert(iter->next_block != FLOG_BLOCK_IDX_INVALID);
+    // Only the first block of a table can have entries without an init sector
+    if (block >= FS_INODE0_MAX_BLOCK) {
+        return false;
+    }
 
-        flog_lock_allocate();
+    flog_open_sector(block, FLOG_INODE_FIRST_ENTRY_SECTOR);
+    flog_read_sector((uint8_t *)&allocation, FLOG_INODE_FIRST_ENTRY_SECTOR, 0, sizeof(flog_inode_file_allocation_header_t));
+    return !invalid_inode_file_allocation_header(&allocation);
+}
 
-        flog_flush_dirty_block();
+static void flog_linked_blocks_find(uint8_t *linked) {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_inode_init_sector_spare_t inode_spare;
+    flog_file_init_sector_header_t init_sector;
+    flog_file_tail_sector_header_t tail_sector;
 
-        block_alloc = flog_allocate_block(0);
-        if (block_alloc.block == FLOG_BLOCK_IDX_INVALID) {
-            flog_unlock_allocate();
-            return FLOG_FAILURE;
+    memset(linked, 0, (FS_MAXIMUM_BLOCKS + 7) / 8);
+
+    for (flog_block_idx_t block = FS_FIRST_BLOCK; block < flogfs.params.number_of_blocks; ++block) {
+        if (FLOG_FAILURE == flog_open_page(block, 0)) {
+            continue;
+        }
+        if (FLOG_SUCCESS == flog_block_is_bad()) {
+            continue;
         }
 
-        flog_unlock_allocate();
+        flog_block_statistics_read(block, &statistics_sector);
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+        if (invalid_block_or_older_version(&statistics_sector) || inode_spare.type_id != FLOG_BLOCK_TYPE_FILE) {
+            continue;
+        }
 
-        flog_open_sector(iter->block, FLOG_TAIL_SECTOR);
-        buffer_union.inode_tail_sector.next_age = block_alloc.age + 1;
-        buffer_union.inode_tail_sector.next_block = block_alloc.block;
-        buffer_union.inode_tail_sector.timestamp = ++flogfs.t;
-        flash_write_sector((uint8_t *)&buffer_union.inode_tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_universal_tail_sector_t));
-        flash_commit();
+        flog_open_sector(block, FLOG_INIT_SECTOR);
+        flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+        // Deleted files may have lost blocks off the end already
+        if (init_sector.file_id > flogfs.max_file_id || flog_reclaim_is_queued(init_sector.file_id)) {
+            continue;
+        }
 
-        flog_open_sector(block_alloc.block, FLOG_INIT_SECTOR);
-        buffer_union.inode_init_sector.universal.timestamp = flogfs.t;
-        flash_write_sector((uint8_t *)&buffer_union.inode_init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_inode_init_sector_t));
+        flog_open_sector(block, FLOG_TAIL_SECTOR);
+        flog_read_sector((uint8_t *)&tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+        if (!invalid_file_tail_sector_header(&tail_sector) && tail_sector.universal.next_block < flogfs.params.number_of_blocks) {
+            flog_bitset_set(linked, tail_sector.universal.next_block);
+        }
+    }
+}
 
-        buffer_union.inode_init_sector_spare.type_id = FLOG_BLOCK_TYPE_INODE;
-        buffer_union.inode_init_sector_spare.nothing = 0;
-        buffer_union.inode_init_sector_spare.inode_index = ++iter->inode_block_idx;
-        flash_write_spare((uint8_t *)&buffer_union.inode_init_sector_spare, FLOG_INIT_SECTOR);
-        flash_commit();
+static uint_fast8_t flog_file_owns(flog_block_idx_t block, flog_file_id_t file_id) {
+    flog_file_init_sector_header_t init_sector;
 
-        iter->next_block = block_alloc.block;
+    if (block == FLOG_BLOCK_IDX_INVALID || block >= flogfs.params.number_of_blocks) {
+        return false;
+    }
+    if (flog_get_block_type(block) != FLOG_BLOCK_TYPE_FILE) {
+        return false;
     }
 
-    return FLOG_SUCCESS;
+    flog_open_sector(block, FLOG_INIT_SECTOR);
+    flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+    return is_file_init_sector_header_for_file(&init_sector, file_id);
 }
 
-static void flog_block_statistics_write(flog_block_idx_t block, flog_block_statistics_sector_with_key_t const *sector) {
-    assert(sector->header.version != 0);
-
-    flog_open_sector(block, FLOG_BLOCK_STATISTICS_SECTOR);
-    flash_write_sector((uint8_t const *)sector, FLOG_BLOCK_STATISTICS_SECTOR, 0, sizeof(flog_block_statistics_sector_with_key_t));
-    flash_commit();
+static uint_fast8_t flog_reclaim_is_queued(flog_file_id_t file_id) {
+    for (uint8_t i = 0; i < flogfs.reclaim.n; ++i) {
+        if (flogfs.reclaim.queue[(flogfs.reclaim.head + i) % FLOG_RECLAIM_QUEUE_SIZE].file_id == file_id) {
+            return true;
+        }
+    }
+    return false;
 }
 
-static void flog_block_statistics_read(flog_block_idx_t block, flog_block_statistics_sector_with_key_t *sector) {
-    flog_open_sector(block, FLOG_BLOCK_STATISTICS_SECTOR);
-    flash_read_sector((uint8_t *)sector, FLOG_BLOCK_STATISTICS_SECTOR, 0, sizeof(flog_block_statistics_sector_with_key_t));
+static void flog_reclaim_enqueue(flog_block_idx_t first_block, flog_file_id_t file_id) {
+    flog_reclaim_entry_t *entry;
+
+    if (flogfs.reclaim.n == FLOG_RECLAIM_QUEUE_SIZE) {
+        flogfs.reclaim.overflow = 1;
+        return;
+    }
+
+    entry = &flogfs.reclaim.queue[(flogfs.reclaim.head + flogfs.reclaim.n) % FLOG_RECLAIM_QUEUE_SIZE];
+    entry->first_block = first_block;
+    entry->file_id = file_id;
+    flogfs.reclaim.n++;
 }
 
-static void flog_invalidate_chain(flog_block_idx_t block, flog_file_id_t file_id) {
+static uint_fast8_t flog_reclaim_step() {
     flog_file_tail_sector_header_t file_tail_sector;
+    flog_file_init_sector_header_t init_sector;
     flog_block_statistics_sector_with_key_t block_statistics;
-    flog_block_idx_t num_freed = 0;
+    flog_reclaim_entry_t *entry;
+    flog_block_idx_t block;
+    flog_block_idx_t remaining = flogfs.params.number_of_blocks;
 
-    union {
-        flog_file_init_sector_header_t init_sector;
-    } init_buffer_union;
+    if (flogfs.reclaim.n == 0 && flogfs.reclaim.overflow) {
+        flog_reclaim_refill();
+    }
+    if (flogfs.reclaim.n == 0) {
+        return false;
+    }
 
-    flog_lock_delete();
+    entry = &flogfs.reclaim.queue[flogfs.reclaim.head];
 
-    while (block != FLOG_BLOCK_IDX_INVALID) {
-        switch (flog_get_block_type(block)) {
-        case FLOG_BLOCK_TYPE_UNALLOCATED: {
-            flog_block_statistics_read(block, &block_statistics);
-            block = FLOG_BLOCK_IDX_INVALID;
-            break;
+    if (flogfs.reclaim.depth == 0) {
+        // Gather the last blocks still belonging to the file. Everything after
+        // them has been erased already.
+        for (block = entry->first_block; remaining-- && flog_file_owns(block, entry->file_id); ) {
+            if (flogfs.reclaim.depth == FLOG_RECLAIM_STACK_SIZE) {
+                memmove(&flogfs.reclaim.stack[0], &flogfs.reclaim.stack[1], sizeof(flog_block_idx_t) * (FLOG_RECLAIM_STACK_SIZE - 1));
+                flogfs.reclaim.depth--;
+            }
+            flogfs.reclaim.stack[flogfs.reclaim.depth++] = block;
+
+            flog_open_sector(block, FLOG_TAIL_SECTOR);
+            flog_read_sector((uint8_t *)&file_tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
+            if (invalid_file_tail_sector_header(&file_tail_sector)) {
+                break;
+            }
+            block = file_tail_sector.universal.next_block;
         }
-        case FLOG_BLOCK_TYPE_FILE: {
-            flog_open_sector(block, FLOG_INIT_SECTOR);
-            flash_read_sector((uint8_t *)&init_buffer_union.init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
-            if (is_file_init_sector_header_for_file(&init_buffer_union.init_sector, file_id)) {
-                flog_open_sector(block, FLOG_TAIL_SECTOR);
-                flash_read_sector((uint8_t *)&file_tail_sector, FLOG_TAIL_SECTOR, 0, sizeof(flog_file_tail_sector_header_t));
-                block_statistics.header.age = init_buffer_union.init_sector.age;
-                block_statistics.header.next_block = file_tail_sector.universal.next_block;
-                block_statistics.header.next_age = file_tail_sector.universal.next_age;
-                block_statistics.header.timestamp = ++flogfs.t;
-                block_statistics.header.version = flogfs.version;
-                flog_close_sector();
 
-                flash_erase_block(block);
+        if (flogfs.reclaim.depth == 0) {
+            // Nothing left, probably finished before a power loss
+            flogfs.reclaim.head = (flogfs.reclaim.head + 1) % FLOG_RECLAIM_QUEUE_SIZE;
+            flogfs.reclaim.n--;
+            return true;
+        }
+    }
+
+    block = flogfs.reclaim.stack[--flogfs.reclaim.depth];
 
-                // TODO: Add these to prealloc?
+    flog_open_sector(block, FLOG_INIT_SECTOR);
+    flog_read_sector((uint8_t *)&init_sector, FLOG_INIT_SECTOR, 0, sizeof(flog_file_init_sector_header_t));
+    flog_close_sector();
 
-                flog_block_statistics_write(block, &block_statistics);
+    memcpy(block_statistics.key, flog_block_statistics_key, sizeof(flog_block_statistics_key));
+    block_statistics.header.age = init_sector.age;
+    block_statistics.header.next_block = FLOG_BLOCK_IDX_INVALID;
+    block_statistics.header.next_age = FLOG_BLOCK_AGE_INVALID;
+    block_statistics.header.timestamp = ++flogfs.t;
+    block_statistics.header.version = flogfs.version;
 
-                num_freed += 1;
+    if (FLOG_FAILURE == flog_erase_block(block)) {
+        flash_debug_warn("%d: Reclaim erase failed", block);
+    }
+    else {
+        flog_block_statistics_write(block, &block_statistics);
 
-                block = block_statistics.header.next_block;
-            }
-            else {
-                assert(false);
-            }
-            break;
+        flog_lock_allocate();
+        if (!flog_prealloc_is_full() && !flog_prealloc_contains(block)) {
+            flog_prealloc_push(block, block_statistics.header.age);
         }
-        default: {
-            assert(0);
+        else {
+            flog_free_blocks_set(block);
+        }
+        flog_unlock_allocate();
+    }
+
+    if (block == entry->first_block) {
+        flogfs.reclaim.depth = 0;
+        flogfs.reclaim.head = (flogfs.reclaim.head + 1) % FLOG_RECLAIM_QUEUE_SIZE;
+        flogfs.reclaim.n--;
+    }
+
+    return true;
+}
+
+static void flog_reclaim_refill() {
+    flog_inode_iterator_t inode_iter;
+    flog_inode_file_allocation_t allocation;
+    flog_inode_file_invalidation_header_t invalidation;
+
+    flogfs.reclaim.overflow = 0;
+
+    for (flog_inode_iterator_initialize(&inode_iter, flogfs.inode0); ; flog_inode_iterator_next(&inode_iter)) {
+        flog_open_sector(inode_iter.block, inode_iter.sector);
+        flog_read_sector((uint8_t *)&allocation, inode_iter.sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (invalid_inode_file_allocation_header(&allocation.header)) {
             break;
         }
+
+        flog_open_sector(inode_iter.block, inode_iter.sector + 1);
+        flog_read_sector((uint8_t *)&invalidation, inode_iter.sector + 1, 0, sizeof(flog_inode_file_invalidation_header_t));
+        if (invalid_timestamp(invalidation.timestamp) || flog_inode_is_close_record(&allocation) ||
+            flog_reclaim_is_queued(allocation.header.file_id)) {
+            continue;
         }
-    }
 
-    flog_unlock_delete();
+        // Enqueueing sets the flag again if there's still no room
+        if (flog_file_owns(allocation.header.first_block, allocation.header.file_id)) {
+            flog_reclaim_enqueue(allocation.header.first_block, allocation.header.file_id);
+        }
+    }
 }
 
 static flog_block_type_t flog_get_block_type(flog_block_idx_t block) {
@@ -1950,7 +4936,7 @@ static flog_block_type_t flog_get_block_type(flog_block_idx_t block) {
     if (flog_open_sector(block, FLOG_INIT_SECTOR) != FLOG_SUCCESS) {
         return FLOG_BLOCK_TYPE_ERROR;
     }
-    flash_read_spare((uint8_t *)&spare, FLOG_INIT_SECTOR);
+    flog_read_spare((uint8_t *)&spare, FLOG_INIT_SECTOR);
 
     return (flog_block_type_t)spare.type_id;
 }
@@ -1960,31 +4946,101 @@ static uint_fast8_t flog_prealloc_is_empty() {
 }
 
 static uint_fast8_t flog_prealloc_is_full() {
-    return flogfs.prealloc.free == NULL;
+    return flogfs.prealloc.n + flogfs.prealloc.npending >= FS_PREALLOCATE_SIZE;
 }
 
 static flog_block_alloc_t flog_allocate_block(int32_t threshold) {
     flog_block_alloc_t block;
 
+    // Deleted files may have been queued since the last attempt
+    if (flog_prealloc_is_empty()) {
+        flog_prealloc_prime();
+    }
+
     if (flog_prealloc_is_empty()) {
         flash_debug_error("flog_allocate_block: flog_prealloc_is_empty");
         block.block = FLOG_BLOCK_IDX_INVALID;
         return block;
     }
 
-    for (flog_block_idx_t i = flogfs.params.number_of_blocks; i; i--) {
-        block = flog_prealloc_pop(threshold);
-        if (flog_prealloc_is_empty()) {
-            flog_prealloc_prime();
+    block = flog_prealloc_pop(threshold);
+    if (flog_prealloc_is_empty()) {
+        flog_prealloc_prime();
+    }
+
+    return block;
+}
+
+static flog_block_alloc_t flog_allocate_preallocated() {
+    flog_block_alloc_t block;
+
+    if (flog_prealloc_is_empty()) {
+        block.block = FLOG_BLOCK_IDX_INVALID;
+        block.age = FLOG_BLOCK_AGE_INVALID;
+        return block;
+    }
+
+    return flog_prealloc_pop(0);
+}
+
+static flog_block_alloc_t flog_allocate_inode0() {
+    flog_block_statistics_sector_with_key_t statistics_sector;
+    flog_inode_init_sector_spare_t inode_spare;
+    flog_block_alloc_t block_alloc;
+    flog_block_idx_t last_block = MIN((flog_block_idx_t)FS_INODE0_MAX_BLOCK, (flog_block_idx_t)flogfs.params.number_of_blocks);
+    uint_fast8_t stale;
+
+    for (uint16_t i = 0; i < flogfs.prealloc.n; ++i) {
+        if (flogfs.prealloc.available[i].block < last_block) {
+            return flog_prealloc_heap_remove(i);
+        }
+    }
+
+    block_alloc.block = FLOG_BLOCK_IDX_INVALID;
+    block_alloc.age = FLOG_BLOCK_AGE_INVALID;
+
+    for (flog_block_idx_t block = FS_FIRST_BLOCK; block < last_block; ++block) {
+        if (!flog_free_blocks_test(block)) {
+            continue;
         }
-        if (block.block != FLOG_BLOCK_IDX_INVALID) {
-            return block;
+
+        stale = flog_bitset_test(flogfs.erase_blocks, block);
+        flog_free_blocks_clear(block);
+        flog_bitset_clear(flogfs.erase_blocks, block);
+
+        if (FLOG_FAILURE == flog_open_page(block, 0) || FLOG_SUCCESS == flog_block_is_bad()) {
+            continue;
+        }
+
+        flog_block_statistics_read(block, &statistics_sector);
+        flog_read_spare((uint8_t *)&inode_spare, FLOG_INIT_SECTOR);
+        flog_close_sector();
+
+        if (invalid_block_or_older_version(&statistics_sector)) {
+            memset(&statistics_sector, 0, sizeof(statistics_sector));
+            stale = 1;
+        }
+        if (inode_spare.type_id != FLOG_BLOCK_TYPE_UNALLOCATED) {
+            stale = 1;
+        }
+
+        if (stale && FLOG_FAILURE == flog_erase_block_and_age(block, &statistics_sector)) {
+            continue;
         }
 
-        threshold -= 1;
+        block_alloc.block = block;
+        block_alloc.age = statistics_sector.header.age;
+        break;
     }
 
-    return block;
+    return block_alloc;
+}
+
+static void flog_inode_chain_release(flog_block_idx_t block) {
+    for (flog_block_idx_t i = flogfs.params.number_of_blocks; i && block != FLOG_BLOCK_IDX_INVALID; i--) {
+        flog_free_blocks_set_stale(block);
+        block = flog_universal_get_next_block(block);
+    }
 }
 
 static flog_sector_idx_t flog_increment_sector(flog_sector_idx_t sector) {
@@ -1998,17 +5054,70 @@ static flog_sector_idx_t flog_increment_sector(flog_sector_idx_t sector) {
     return sector + 1;
 }
 
-static flog_file_find_result_t flog_find_file(char const *filename, flog_inode_iterator_t *iter) {
+static flog_sector_idx_t flog_decrement_sector(flog_sector_idx_t sector) {
+    flog_sector_idx_t last_sector = (flogfs.params.pages_per_block * FS_SECTORS_PER_PAGE) - 1;
+    if (sector == FS_SECTORS_PER_PAGE) {
+        return FLOG_TAIL_SECTOR - 1;
+    }
+    if (sector == FLOG_TAIL_SECTOR) {
+        return last_sector;
+    }
+    return sector - 1;
+}
+
+static flog_file_find_result_t flog_find_file(char const *filename, flog_inode_iterator_t *iter, flog_file_hint_t *hint) {
     union {
         flog_inode_file_allocation_t allocation;
+        flog_inode_close_record_t close_record;
         flog_inode_file_invalidation_t invalidation;
     } buffer_union;
 
     flog_file_find_result_t found;
+    flog_inode_iterator_t records;
+
+#if FS_FILE_INDEX_SIZE
+    flog_file_index_entry_t *entry;
+    uint16_t hash;
+    uint16_t i;
+
+    if (!flogfs.file_index.built) {
+        flog_file_index_build();
+    }
+
+    // Only live files are indexed, so a matching name is all there is to check
+    hash = flog_file_index_hash(filename);
+    for (i = hash % FS_FILE_INDEX_SIZE; flogfs.file_index.entries[i].hash != FLOG_FILE_INDEX_EMPTY;
+         i = (i + 1) % FS_FILE_INDEX_SIZE) {
+        entry = &flogfs.file_index.entries[i];
+        if (entry->hash != hash) {
+            continue;
+        }
+
+        flog_open_sector(entry->block, entry->sector);
+        flog_read_sector((uint8_t *)&buffer_union.allocation, entry->sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (strncmp(filename, buffer_union.allocation.filename, FLOG_MAX_FNAME_LEN) != 0) {
+            continue;
+        }
+
+        flog_inode_iterator_seek(iter, entry->block, entry->sector);
+        found.first_block = entry->first_block;
+        found.file_id = entry->file_id;
+        if (hint) {
+            *hint = entry->hint;
+        }
+        return found;
+    }
+
+    if (!flogfs.file_index.overflowed) {
+        flog_inode_iterator_seek(iter, flogfs.inode_tail_block, flogfs.inode_tail_sector);
+        found.first_block = FLOG_BLOCK_IDX_INVALID;
+        return found;
+    }
+#endif
 
     for (flog_inode_iterator_initialize(iter, flogfs.inode0); ; flog_inode_iterator_next(iter)) {
         flog_open_sector(iter->block, iter->sector);
-        flash_read_sector((uint8_t *)&buffer_union.allocation, iter->sector, 0, sizeof(flog_inode_file_allocation_t));
+        flog_read_sector((uint8_t *)&buffer_union.allocation, iter->sector, 0, sizeof(flog_inode_file_allocation_t));
 
         if (invalid_inode_file_allocation_header(&buffer_union.allocation.header)) {
             found.first_block = FLOG_BLOCK_IDX_INVALID;
@@ -2023,23 +5132,192 @@ static flog_file_find_result_t flog_find_file(char const *filename, flog_inode_i
         found.file_id = buffer_union.allocation.header.file_id;
 
         flog_open_sector(iter->block, iter->sector + 1);
-        flash_read_sector((uint8_t *)&buffer_union.invalidation, iter->sector + 1, 0, sizeof(flog_timestamp_t));
+        flog_read_sector((uint8_t *)&buffer_union.invalidation, iter->sector + 1, 0, sizeof(flog_timestamp_t));
 
         if (!invalid_inode_file_invalidation(&buffer_union.invalidation)) {
             continue;
         }
 
-        return found;
+        if (!hint) {
+            return found;
+        }
+
+        // Close records always come after the file itself
+        hint->block = FLOG_BLOCK_IDX_INVALID;
+        records = *iter;
+        for (flog_inode_iterator_next(&records); ; flog_inode_iterator_next(&records)) {
+            flog_open_sector(records.block, records.sector);
+            flog_read_sector((uint8_t *)&buffer_union.close_record, records.sector, 0, sizeof(flog_inode_close_record_t));
+            if (invalid_inode_file_allocation_header(&buffer_union.close_record.header)) {
+                return found;
+            }
+            if (buffer_union.close_record.header.file_id == found.file_id &&
+                flog_inode_is_close_record((flog_inode_file_allocation_t *)&buffer_union.close_record)) {
+                hint->block = buffer_union.close_record.header.first_block;
+                hint->position = buffer_union.close_record.position;
+            }
+        }
+    }
+}
+
+#if FS_FILE_INDEX_SIZE
+static uint16_t flog_file_index_hash(char const *filename) {
+    uint32_t hash = 2166136261u;
+    uint_fast8_t i;
+
+    // FNV-1a, folded down to the size of an entry
+    for (i = 0; i < FLOG_MAX_FNAME_LEN && filename[i]; i++) {
+        hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+    }
+    hash = (hash >> 16) ^ (hash & 0xffff);
+
+    return (hash == FLOG_FILE_INDEX_EMPTY) ? 1 : (uint16_t)hash;
+}
+
+static void flog_file_index_reset() {
+    memset(flogfs.file_index.entries, 0, sizeof(flogfs.file_index.entries));
+    flogfs.file_index.n = 0;
+    flogfs.file_index.built = 0;
+    flogfs.file_index.overflowed = 0;
+}
+
+static void flog_file_index_build() {
+    flog_inode_iterator_t iter;
+    flog_inode_file_allocation_t allocation;
+    flog_timestamp_t invalidation_timestamp;
+    flog_file_hint_t hint;
+
+    flog_file_index_reset();
+
+    for (flog_inode_iterator_initialize(&iter, flogfs.inode0); ; flog_inode_iterator_next(&iter)) {
+        flog_open_sector(iter.block, iter.sector);
+        flog_read_sector((uint8_t *)&allocation, iter.sector, 0, sizeof(flog_inode_file_allocation_t));
+        if (invalid_inode_file_allocation_header(&allocation.header)) {
+            break;
+        }
+
+        flog_open_sector(iter.block, iter.sector + 1);
+        flog_read_sector((uint8_t *)&invalidation_timestamp, iter.sector + 1, 0, sizeof(flog_timestamp_t));
+        if (!invalid_timestamp(invalidation_timestamp)) {
+            if (flog_inode_is_close_record(&allocation)) {
+                hint.block = allocation.header.first_block;
+                hint.position = ((flog_inode_close_record_t *)&allocation)->position;
+                flog_file_index_hint(allocation.header.file_id, &hint);
+            }
+            continue;
+        }
+
+        allocation.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+        flog_file_index_insert(allocation.filename, &iter, allocation.header.file_id, allocation.header.first_block);
+    }
+
+    flogfs.file_index.built = 1;
+}
+
+static void flog_file_index_insert(char const *filename, flog_inode_iterator_t const *iter, flog_file_id_t file_id,
+                                   flog_block_idx_t first_block) {
+    flog_file_index_entry_t *entry;
+    uint16_t hash;
+    uint16_t i;
+
+    if ((flogfs.file_index.n + 1) * 4 > FS_FILE_INDEX_SIZE * 3) {
+        flogfs.file_index.overflowed = 1;
+        return;
+    }
+
+    hash = flog_file_index_hash(filename);
+    for (i = hash % FS_FILE_INDEX_SIZE; flogfs.file_index.entries[i].hash != FLOG_FILE_INDEX_EMPTY;
+         i = (i + 1) % FS_FILE_INDEX_SIZE) {
+    }
+
+    entry = &flogfs.file_index.entries[i];
+    entry->hash = hash;
+    entry->block = iter->block;
+    entry->sector = iter->sector;
+    entry->file_id = file_id;
+    entry->first_block = first_block;
+    entry->hint.block = FLOG_BLOCK_IDX_INVALID;
+    flogfs.file_index.n++;
+}
+
+static void flog_file_index_remove(char const *filename, flog_inode_iterator_t const *iter) {
+    flog_file_index_entry_t *entries = flogfs.file_index.entries;
+    uint16_t hash;
+    uint16_t home;
+    uint16_t i;
+    uint16_t j;
+
+    hash = flog_file_index_hash(filename);
+    for (i = hash % FS_FILE_INDEX_SIZE; ; i = (i + 1) % FS_FILE_INDEX_SIZE) {
+        if (entries[i].hash == FLOG_FILE_INDEX_EMPTY) {
+            // Never made it in
+            return;
+        }
+        if (entries[i].block == iter->block && entries[i].sector == iter->sector) {
+            break;
+        }
+    }
+
+    // Shift later entries of the same run back so no lookup stops short
+    for (j = (i + 1) % FS_FILE_INDEX_SIZE; entries[j].hash != FLOG_FILE_INDEX_EMPTY; j = (j + 1) % FS_FILE_INDEX_SIZE) {
+        home = entries[j].hash % FS_FILE_INDEX_SIZE;
+        if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            entries[i] = entries[j];
+            i = j;
+        }
+    }
+
+    entries[i].hash = FLOG_FILE_INDEX_EMPTY;
+    flogfs.file_index.n--;
+}
+
+static void flog_file_index_hint(flog_file_id_t file_id, flog_file_hint_t const *hint) {
+    for (uint16_t i = 0; i < FS_FILE_INDEX_SIZE; ++i) {
+        if (flogfs.file_index.entries[i].hash != FLOG_FILE_INDEX_EMPTY && flogfs.file_index.entries[i].file_id == file_id) {
+            flogfs.file_index.entries[i].hint = *hint;
+            return;
+        }
     }
 }
+#endif
 
-static void flog_flush_dirty_block() {
-    printk("flog_flush_dirty_block\n");
-    if (flogfs.dirty_block.block != FLOG_BLOCK_IDX_INVALID) {
-        printk("flog_flush_dirty_block flogfs.dirty_block.block != FLOG_BLOCK_IDX_INVALID\n");
-        flog_flush_write(flogfs.dirty_block.file);
-        flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+static flog_result_t flog_close_record_write(flog_write_file_t *file) {
+    flog_inode_iterator_t iter;
+    flog_inode_close_record_t record;
+    flog_inode_file_invalidation_t invalidation;
+    flog_file_hint_t hint;
+
+    flog_inode_iterator_seek(&iter, flogfs.inode_tail_block, flogfs.inode_tail_sector);
+    if (flog_inode_prepare_new(&iter) != FLOG_SUCCESS) {
+        return FLOG_FAILURE;
     }
+
+    memset(&record, 0, sizeof(record));
+    record.header.file_id = file->id;
+    record.header.first_block = file->block;
+    record.header.first_block_age = FLOG_BLOCK_AGE_INVALID;
+    record.header.timestamp = ++flogfs.t;
+    record.position = file->file_size - file->bytes_in_block;
+
+    invalidation.header.timestamp = flogfs.t;
+    invalidation.header.last_block = file->block;
+
+    flog_open_sector(iter.block, iter.sector);
+    flog_write_sector((uint8_t *)&record, iter.sector, 0, sizeof(flog_inode_close_record_t));
+    flog_write_sector((uint8_t *)&invalidation, iter.sector + 1, 0, sizeof(flog_inode_file_invalidation_t));
+    flash_commit();
+
+    hint.block = record.header.first_block;
+    hint.position = record.position;
+    flog_file_index_hint(file->id, &hint);
+
+    flog_inode_iterator_next(&iter);
+    flogfs.inode_tail_block = iter.block;
+    flogfs.inode_tail_sector = iter.sector;
+
+    file->blocks_since_record = 0;
+
+    return FLOG_SUCCESS;
 }
 
 #ifndef IS_DOXYGEN
@@ -62,6 +62,38 @@ either expressed or implied, of the FLogFS Project.
 
 #include "flogfs_conf.h"
 
+#ifndef FS_READ_SKIP_SIZE
+//! The number of block offsets each read file remembers for seeking, at least 2
+#define FS_READ_SKIP_SIZE (8)
+#endif
+
+#ifndef FS_WRITE_PAGES
+//! Whether writers buffer a whole page rather than a sector, so streamed data
+//! is programmed a page at a time. This costs each write file
+//! FS_SECTORS_PER_PAGE - 1 more sectors of RAM.
+#define FS_WRITE_PAGES (0)
+#endif
+
+#ifndef FS_WRITE_BEHIND
+//! The number of sectors of data each write file can queue for a flusher
+//! thread, see flogfs_write_async(). Zero leaves write-behind out.
+#define FS_WRITE_BEHIND (0)
+#endif
+
+#ifndef FS_BOUNDED_WRITE_SECTORS
+//! The number of sectors a bounded write may commit, see flogfs_write_bounded()
+#define FS_BOUNDED_WRITE_SECTORS (FS_SECTORS_PER_PAGE)
+#endif
+
+/*!
+ @name Backend locks
+ The backend provides fs_lock_t along with fs_lock_initialize(), fs_lock() and
+ fs_unlock(). These locks must be recursive: a thread takes locks it already
+ holds, such as when flog_lock_allocate() takes the delete lock inside
+ deletion or unmounting closes files under the file system lock. A backend
+ without threads can leave them empty.
+ */
+
 #if !FLOG_BUILD_CPP
 #ifdef __cplusplus
 extern "C" {
@@ -76,6 +108,15 @@ typedef enum {
     FLOG_FLASH_ERR_DETECT = -1
 } flog_flash_read_result_t;
 
+//! How much flogfs_sync() makes durable
+typedef enum {
+    //! Program everything written to the file so far
+    FLOG_SYNC_DATA,
+    //! Also record where the file ends in the inode table, as closing does,
+    //! so the next open doesn't walk the blocks written since the last record
+    FLOG_SYNC_RECORD
+} flog_sync_level_t;
+
 //! @name Type size definitions
 //! @{
 typedef uint32_t flog_timestamp_t;
@@ -112,6 +153,23 @@ typedef flog_inode_iterator_t flogfs_ls_iterator_t;
 
 #define FLOG_RESULT(x) ((x) ? FLOG_SUCCESS : FLOG_FAILURE)
 
+//! Where a block of a file starts, kept by read files to speed up seeking
+typedef struct {
+    flog_block_idx_t block;
+    //! The number of bytes in the file before @ref block
+    uint32_t position;
+} flog_read_skip_t;
+
+struct flog_read_file_t;
+
+//! Called when data is committed to a followed file, see flogfs_read_follow()
+typedef void (*flog_read_notify_fn_t)(struct flog_read_file_t *file, void *arg);
+
+struct flog_write_file_t;
+
+//! Called when queued data reaches flash, see flogfs_write_behind()
+typedef void (*flog_write_done_fn_t)(struct flog_write_file_t *file, uint32_t committed, void *arg);
+
 /*!
  @brief The state of a currently-open file
 
@@ -130,11 +188,30 @@ typedef struct flog_read_file_t {
     uint16_t offset;
     //! Number of bytes remaining in current sector
     uint16_t sector_remaining_bytes;
-    //! Size of the file when opened
+    //! Bytes of the file committed to flash, kept up to date by its writer
     uint32_t file_size;
+    //! Number of bytes in the file before the read head's block
+    uint32_t block_position;
 
     uint32_t id;
 
+    //! Known block starts, ascending by position, skip[0] the first block
+    flog_read_skip_t skip[FS_READ_SKIP_SIZE];
+    //! Entries in use in @ref skip
+    uint8_t skip_n;
+    //! Minimum distance in bytes between neighboring entries in @ref skip
+    uint32_t skip_span;
+    //! The newest block of the file seen so far, where seeks near the end start
+    flog_read_skip_t last;
+
+    //! Bytes read from the writer's sector buffer which the flash position
+    //! (block, sector and offset) hasn't caught up with yet
+    uint32_t unflushed_bytes;
+
+    //! Called when the file grows, see flogfs_read_follow()
+    flog_read_notify_fn_t notify;
+    void *notify_arg;
+
     struct flog_read_file_t *next;
 } flog_read_file_t;
 
@@ -160,14 +237,76 @@ typedef struct flog_write_file_t {
     flog_block_nbytes_t bytes_in_block;
     uint32_t block_age;
     uint32_t id;
+    //! The block before @ref block, recorded in its init sector
+    flog_block_idx_t previous_block;
 
+    //! The number of extra free blocks each allocation may examine looking
+    //! for a younger block. Zero favors latency, larger values favor wear.
     int32_t base_threshold;
 
+    //! Blocks started since the file's last close record
+    uint16_t blocks_since_record;
+
+    //! Whether writes are bounded, see flogfs_write_bounded()
+    uint8_t bounded;
+
+    //! Read files open on the same file, which look at the write buffer
+    //! @note This may only be changed under both the file system lock and
+    //! the file's write lock
+    uint16_t readers;
+
+#if FS_WRITE_PAGES
+    //! A buffer for each sector of the write head's page
+    uint8_t page_buffer[FS_SECTORS_PER_PAGE][FS_SECTOR_SIZE];
+    //! Full sectors at the start of the page waiting for the rest of it
+    uint8_t held_sectors;
+#else
     uint8_t sector_buffer[FS_SECTOR_SIZE];
+#endif
+
+#if FS_WRITE_BEHIND
+    //! Data waiting for the flusher, see flogfs_write_async()
+    //! @note The queue may only be accessed under the write-behind lock
+    uint8_t queue[FS_WRITE_BEHIND][FS_SECTOR_SIZE];
+    //! The oldest sector in @ref queue
+    uint8_t queue_head;
+    //! Sectors in @ref queue, including a partly filled one at the end
+    uint8_t queue_n;
+    //! Bytes in the newest sector in @ref queue
+    uint16_t queue_fill;
+    //! Bytes at the start of the oldest sector which have been written already
+    uint16_t queue_skip;
+    //! The file's size once everything queued is written
+    uint32_t queue_end;
+
+    //! Called when queued data is committed, see flogfs_write_behind()
+    flog_write_done_fn_t done;
+    void *done_arg;
+#endif
 
     struct flog_write_file_t *next;
 } flog_write_file_t;
 
+//! A piece of a file returned by flogfs_read_view()
+typedef struct {
+    uint8_t const *data;
+    uint16_t length;
+} flog_read_span_t;
+
+//! One buffer of several for flogfs_readv() or flogfs_writev()
+typedef struct {
+    void *data;
+    uint32_t length;
+} flog_iovec_t;
+
+//! Read cache counters, see flogfs_read_cache_stats()
+typedef struct {
+    //! Sector and spare reads served from RAM
+    uint32_t hits;
+    //! Reads that went to flash
+    uint32_t misses;
+} flog_read_cache_stats_t;
+
 typedef struct flog_initialize_params_t {
     uint32_t number_of_blocks;
     uint16_t pages_per_block;
@@ -188,6 +327,36 @@ flog_result_t flogfs_format();
  */
 flog_result_t flogfs_mount();
 
+/*!
+ @brief Flush all open files and record a checkpoint for the next mount
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE otherwise
+
+ A volume which was cleanly unmounted can be mounted without scanning the inode
+ table. Any open file handles are closed.
+ */
+flog_result_t flogfs_unmount();
+
+/*!
+ @brief Do some background maintenance so that writes don't have to
+ @param budget The maximum number of block operations to perform
+ @returns The number of operations performed. Anything less than budget means
+ there's nothing left to do for now.
+
+ Blocks of deleted files are erased first, then stale free blocks, and finally
+ erased blocks are staged in the preallocation list. This is meant to be called
+ from idle time.
+ */
+uint32_t flogfs_gc_step(uint32_t budget);
+
+/*!
+ @brief Get the read cache counters
+ @param stats Filled with the counts since mounting
+
+ Every read is a miss when the cache is disabled (FS_READ_CACHE_PAGES is 0).
+ */
+void flogfs_read_cache_stats(flog_read_cache_stats_t *stats);
+
 /*!
  @brief Open a file to read
  @param file The file structure to use
@@ -214,10 +383,69 @@ uint32_t flogfs_read_file_size(flog_read_file_t *file);
 
 uint32_t flogfs_write_file_size(flog_write_file_t *file);
 
+/*!
+ @brief Move the read head of a file
+ @param file The file
+ @param position The offset from the start of the file
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if the position is past the end of the file
+
+ Seeking starts from the closest block the file has already passed through,
+ either in @ref flog_read_file_t::skip, the read head's own block or the
+ newest block, so only the blocks in between are walked. Each block records
+ the one before it, so this works backwards as well as forwards.
+ */
 flog_result_t flogfs_read_seek(flog_read_file_t *file, uint32_t position);
 
+/*!
+ @brief Move the read head of a file relative to its end
+ @param file The file
+ @param offset The number of bytes before the end of the file
+ @retval FLOG_SUCCESS if successful
+
+ The end includes anything still buffered by the file's writer. Offsets larger
+ than the file move the read head to the start. Only the blocks covered by
+ offset are walked, whatever the size of the file.
+ */
+flog_result_t flogfs_read_seek_end(flog_read_file_t *file, uint32_t offset);
+
+/*!
+ @brief Read the data before the read head and move back over it
+ @param file The file structure to read from
+ @param dst The destination for the data, in the order it was written
+ @param nbytes The number of bytes to try to read
+ @returns The number of bytes read
+
+ Repeated calls read a file from its end towards the start, one piece at a
+ time, following each block's record of the one before it.
+ */
+uint32_t flogfs_read_reverse(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
+
 uint32_t flogfs_read_tell(flog_read_file_t *file);
 
+/*!
+ @brief Follow a file as it's written, like tail -f
+ @param file The file
+ @param notify Called whenever the file's writer writes more data, or NULL
+ @param arg Passed to notify
+
+ Readers always learn about new data from the writer rather than from flash,
+ so reading at the end of a file costs nothing until something is written.
+ notify runs on the writer's thread with the file system locked. It may only
+ signal, for example a condition variable the reader waits on, and must not
+ call back into the file system.
+ */
+void flogfs_read_follow(flog_read_file_t *file, flog_read_notify_fn_t notify, void *arg);
+
+/*!
+ @brief Check whether a read would return anything
+ @param file The file
+ @return Nonzero if data has been written past the read head
+
+ This never touches flash.
+ */
+uint_fast8_t flogfs_read_has_data(flog_read_file_t *file);
+
 /*!
  @brief Close a file which has been opened for reading
  @param file The currently-open read file
@@ -234,21 +462,89 @@ flog_result_t flogfs_close_read(flog_read_file_t *file);
  */
 flog_result_t flogfs_close_write(flog_write_file_t *file);
 
+/*!
+ @brief Make what's been written to a file durable without closing it
+ @param file The currently-open write file
+ @param level What to make durable
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE otherwise
+
+ A partly filled sector is programmed as it is, so the next write starts a
+ new sector. Nothing is programmed if there's nothing buffered.
+ */
+flog_result_t flogfs_sync(flog_write_file_t *file, flog_sync_level_t level);
+
+/*!
+ @brief flogfs_sync() every open write file, under a single lock
+ @param level What to make durable
+ @retval FLOG_SUCCESS if every file was synced
+ @retval FLOG_FAILURE otherwise
+ */
+flog_result_t flogfs_sync_all(flog_sync_level_t level);
+
 /*!
  @brief Remove a file from the filesystem
  @param filename The name of the file
+
+ Only the inode entry is written here. The file's blocks are erased later by
+ flogfs_gc_step() or when the allocator runs out of free blocks.
  */
 flog_result_t flogfs_rm(char const *filename);
 
+/*!
+ @brief Rewrite the inode table without the entries of deleted files
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if there was no room, the old table is still in use
+
+ Every file creation appends to the inode table, so lookups, listings and
+ unclean mounts slow down with the number of files ever created. This copies
+ the remaining entries to a fresh table and releases the old one. Power loss
+ at any point leaves one table or the other. Open files are unaffected but a
+ listing in progress is not.
+ */
+flog_result_t flogfs_compact();
+
 /*!
  @brief Read data from an open file
  @param file The file structure to read from
  @param dst The destination for the data
  @param nbytes The number of bytes to try to read
  @returns The number of bytes read
+
+ If the file is open for writing too, reads continue into the data the writer
+ is still holding in RAM. That data isn't on flash yet and won't survive a
+ power failure until the writer commits it.
  */
 uint32_t flogfs_read(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
 
+/*!
+ @brief Read data from an open file without copying it, if possible
+ @param file The file structure to read from
+ @param span Set to the data at the read head
+ @param buffer At least FS_SECTOR_SIZE bytes to copy into when the data can't
+ be referenced in place
+ @returns The number of bytes in span, 0 at the end of the file
+
+ This returns the rest of the sector at the read head and moves past it, so
+ calling it in a loop walks the file a sector at a time. The span points into
+ flash itself on backends with flash_map_sector, or into the read cache when
+ the page is there, and only otherwise into buffer. Either way it's only valid
+ until the next call into the file system.
+ */
+uint16_t flogfs_read_view(flog_read_file_t *file, flog_read_span_t *span, uint8_t *buffer);
+
+/*!
+ @brief Read data from an open file into several buffers
+ @param file The file structure to read from
+ @param iov The buffers, filled in order
+ @param iovcnt The number of buffers
+ @returns The number of bytes read
+
+ This is flogfs_read() for each buffer in turn, under a single lock. It stops
+ at the end of the file.
+ */
+uint32_t flogfs_readv(flog_read_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt);
+
 /*!
  @brief Write data to an open file
  @param file The file structure to write to
@@ -258,6 +554,83 @@ uint32_t flogfs_read(flog_read_file_t *file, uint8_t *dst, uint32_t nbytes);
  */
 uint32_t flogfs_write(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes);
 
+/*!
+ @brief Write data from several buffers to an open file
+ @param file The file structure to write to
+ @param iov The buffers, written in order
+ @param iovcnt The number of buffers
+ @returns The number of bytes written
+
+ This is flogfs_write() for each buffer in turn, under a single lock, so a
+ record made of a header, payload and trailer costs one call. Readers
+ following the file are notified once.
+ */
+uint32_t flogfs_writev(flog_write_file_t *file, flog_iovec_t const *iov, uint_fast8_t iovcnt);
+
+/*!
+ @brief Bound the flash work done by each write to a file
+ @param file The file
+ @param bounded Nonzero to bound writes, zero to go back to the default
+
+ A bounded flogfs_write() or flogfs_writev() commits at most
+ FS_BOUNDED_WRITE_SECTORS sectors, including any it drains from the file's
+ write-behind queue, and returns short rather than commit more. New blocks
+ only come from the preallocation list, so nothing is erased, reclaimed or
+ primed along the way, and writing stops short when the list is empty. Call
+ flogfs_gc_step() regularly, outside the time critical path, to keep it
+ topped up. The inode table only grows when files are opened, closed or
+ removed, which aren't bounded.
+ */
+void flogfs_write_bounded(flog_write_file_t *file, uint_fast8_t bounded);
+
+#if FS_WRITE_BEHIND
+/*!
+ @brief Queue data to be written to an open file by another thread
+ @param file The file structure to write to
+ @param src The data source
+ @param nbytes The number of bytes to try to queue
+ @returns The number of bytes queued, short if the queue is full
+
+ This only copies the data, under a lock of its own which is never held
+ across flash operations. Whoever drains the queue with
+ flogfs_write_behind_flush() pays for the programming. Before anything else
+ is done with the file, such as flogfs_write() or closing it, the rest of the
+ queue is written on the caller's thread.
+ */
+uint32_t flogfs_write_async(flog_write_file_t *file, uint8_t const *src, uint32_t nbytes);
+
+/*!
+ @brief Get a file's size including everything queued for it
+ @param file The file
+
+ The value after a flogfs_write_async() call identifies that data: it is
+ committed once a @ref flog_write_done_fn_t reports at least this much.
+ */
+uint32_t flogfs_write_queued_size(flog_write_file_t *file);
+
+/*!
+ @brief Set a callback for when queued data is committed to flash
+ @param file The file
+ @param done Called with the number of bytes of the file on flash, or NULL
+ @param arg Passed to done
+
+ Data still buffered in the file's partly filled sector only counts once that
+ sector is programmed, as more data arrives or the file is closed. Like
+ flogfs_read_follow(), done runs with the file system locked. It may only
+ signal and must not call back into the file system.
+ */
+void flogfs_write_behind(flog_write_file_t *file, flog_write_done_fn_t done, void *arg);
+
+/*!
+ @brief Write queued data for every open file
+ @returns Nonzero if anything was written
+
+ This is the body of a flusher thread, which calls it until it returns zero
+ and then waits for flash_write_behind_ready(). Only full sectors are taken.
+ */
+uint_fast8_t flogfs_write_behind_flush();
+#endif
+
 /*!
  @brief Check if a file exists in the filesystem
  @param filename The 0-terminated filename to check for
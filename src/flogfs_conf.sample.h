@@ -58,6 +58,36 @@ either expressed or implied, of the FLogFS Project.
 //! The number of blocks to preallocate
 #define FS_PREALLOCATE_SIZE (10)
 
+//! @name Optional features
+//! Each of these defaults to the value shown when left undefined
+//! @{
+
+//! The number of block offsets each read file remembers for seeking, at
+//! least 2. Each costs a read file 8 bytes of RAM.
+#define FS_READ_SKIP_SIZE (8)
+
+//! The number of flash pages to keep in the read cache, 0 to disable it. Each
+//! costs a full page of RAM, spares included.
+#define FS_READ_CACHE_PAGES (0)
+
+//! The number of files to keep in the in-RAM filename index, 0 to always
+//! search the inode table
+#define FS_FILE_INDEX_SIZE (0)
+
+//! Program streamed data a page at a time. This costs each write file
+//! FS_SECTORS_PER_PAGE - 1 more sectors of RAM.
+#define FS_WRITE_PAGES (0)
+
+//! The number of sectors each write file can queue for a flusher thread, see
+//! flogfs_write_async(). 0 leaves write-behind out.
+#define FS_WRITE_BEHIND (0)
+
+//! The number of sectors a bounded write may commit, see
+//! flogfs_write_bounded()
+#define FS_BOUNDED_WRITE_SECTORS (FS_SECTORS_PER_PAGE)
+
+//! @}
+
 //! @} // FLogConf
 
 #endif
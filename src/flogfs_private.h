@@ -99,7 +99,9 @@ typedef enum {
     FLOG_BLOCK_TYPE_UNALLOCATED = 0xff,
     #endif
     FLOG_BLOCK_TYPE_INODE = 1,
-    FLOG_BLOCK_TYPE_FILE = 2
+    FLOG_BLOCK_TYPE_FILE = 2,
+    FLOG_BLOCK_TYPE_AGE_TABLE = 3,
+    FLOG_BLOCK_TYPE_CHECKPOINT = 4
 } flog_block_type_t;
 
 //! @name Invalid values
@@ -137,6 +139,8 @@ typedef enum {
 
 static char const flog_block_statistics_key[] = "Bears";
 
+static char const flog_checkpoint_key[] = "Moose";
+
 typedef struct {
     //! The age of the block
     flog_block_age_t age;
@@ -169,8 +173,11 @@ typedef struct {
 //! @brief Descriptions of the data in inode blocks
 //! @{
 typedef struct {
+    //! In the first inode block, orders tables written by flogfs_compact()
     flog_universal_init_sector_t universal;
     flog_block_idx_t previous;
+    //! The highest file ID ever allocated when the block was started
+    flog_file_id_t max_file_id;
 } flog_inode_init_sector_t;
 
 typedef struct {
@@ -200,6 +207,26 @@ typedef struct {
     flog_inode_file_invalidation_header_t header;
 } flog_inode_file_invalidation_t;
 
+/*!
+ @brief Written to the inode table on close so that opens can skip most of a
+ file's chain
+
+ A close record takes an inode entry like a file but has no name and is
+ invalidated as soon as it's written, so it is skipped like a deleted file by
+ anything not looking for it.
+ */
+typedef struct {
+    //! The file's ID, the block the record points at and when it was written
+    flog_inode_file_allocation_header_t header;
+    //! Always empty, which no file name can be
+    char filename[4];
+    //! The number of bytes in the file before header.first_block
+    uint32_t position;
+} flog_inode_close_record_t;
+
+//! The number of blocks a file has to grow by before closing it writes a record
+#define FLOG_CLOSE_RECORD_BLOCKS (4)
+
 //! @} // Inode structures
 
 //! @defgroup FLogFileBlockStructs File block structures
@@ -210,6 +237,8 @@ typedef struct {
     flog_universal_init_sector_t universal;
     flog_block_age_t age;
     flog_file_id_t file_id;
+    //! The file's block before this one, so the chain can be read backwards
+    flog_block_idx_t previous_block;
 } flog_file_init_sector_header_t;
 
 typedef struct {
@@ -225,6 +254,145 @@ typedef struct {
 
 //! @}
 
+//! The number of deleted files whose blocks may await reclamation at once
+#define FLOG_RECLAIM_QUEUE_SIZE (4)
+
+//! The number of locks shared out among write files by file ID
+#define FLOG_WRITE_LOCKS (8)
+
+//! The number of blocks gathered per walk of a chain being reclaimed
+#define FLOG_RECLAIM_STACK_SIZE (16)
+
+//! A deleted file whose blocks haven't all been erased yet
+typedef struct {
+    //! The first block of the file, which is erased last
+    flog_block_idx_t first_block;
+    flog_file_id_t file_id;
+} flog_reclaim_entry_t;
+
+//! The number of files the in-RAM filename index can hold, 0 to disable it
+#ifndef FS_FILE_INDEX_SIZE
+#define FS_FILE_INDEX_SIZE (0)
+#endif
+
+//! The most sectors flogfs_read moves with one bulk read
+#define FLOG_BULK_READ_SECTORS (16)
+
+//! The number of flash pages the read cache holds, 0 to disable it
+#ifndef FS_READ_CACHE_PAGES
+#define FS_READ_CACHE_PAGES (0)
+#endif
+
+//! A page held by the read cache
+typedef struct {
+    //! FLOG_BLOCK_IDX_INVALID if the slot is unused
+    flog_block_idx_t block;
+    flog_page_index_t page;
+    //! The value of the cache clock when this page was last read
+    uint32_t last_used;
+    uint8_t data[FS_SECTORS_PER_PAGE][FS_SECTOR_SIZE];
+    flog_file_sector_spare_t spare[FS_SECTORS_PER_PAGE];
+} flog_read_cache_page_t;
+
+#if FS_READ_SKIP_SIZE < 2
+#error "FS_READ_SKIP_SIZE has to hold at least the first block and one more"
+#endif
+
+//! @defgroup FLogCheckpointBlockStructs Checkpoint block structures
+//! @brief Descriptions of the data in the mount checkpoint block
+//!
+//! Checkpoint entries are appended in pairs of sectors, just like inode
+//! entries. The first sector holds the state written by flogfs_unmount() and
+//! the second is written by the next mount to mark the entry as consumed.
+//! @{
+
+typedef struct {
+    uint8_t type_id;
+    uint8_t nothing;
+    uint16_t reserved;
+} flog_checkpoint_init_sector_spare_t;
+
+typedef struct {
+    //! The most recent timestamp at unmount
+    flog_timestamp_t timestamp;
+    //! The maximum file ID at unmount
+    flog_file_id_t max_file_id;
+    //! The last block in the inode chain
+    flog_block_idx_t inode_tail_block;
+    //! The first unallocated inode entry sector in the last inode block
+    flog_sector_idx_t inode_tail_sector;
+    //! The allocator cursor
+    flog_block_idx_t allocate_head;
+    //! The first block of the age table written alongside this checkpoint
+    flog_block_idx_t age_table;
+    //! Deleted files still being reclaimed, unused entries are invalid
+    flog_reclaim_entry_t reclaim[FLOG_RECLAIM_QUEUE_SIZE];
+    //! Version field
+    uint32_t version;
+} flog_checkpoint_sector_header_t;
+
+typedef struct {
+    flog_checkpoint_sector_header_t header;
+    char key[sizeof(flog_checkpoint_key)];
+} flog_checkpoint_sector_t;
+
+typedef struct {
+    //! The timestamp of the mount which consumed the checkpoint
+    flog_timestamp_t timestamp;
+} flog_checkpoint_release_t;
+
+//! @}
+
+//! @defgroup FLogAgeTableBlockStructs Block age table structures
+//! @brief Descriptions of the data in block age table blocks
+//!
+//! The table is a snapshot of every good block's age and state written by
+//! flogfs_unmount(). It is only meaningful to the mount which consumes the
+//! checkpoint referencing it; afterwards its blocks are simply reclaimed.
+//! @{
+
+//! The maximum number of blocks in an age table chain
+#define FLOG_AGE_TABLE_MAX_BLOCKS (4)
+
+//! The bits of a packed table age holding the age itself
+#define FLOG_AGE_TABLE_AGE_MASK (0x3fffff)
+//! The shift of the block state in a packed table age
+#define FLOG_AGE_TABLE_STATE_SHIFT (22)
+
+typedef enum {
+    //! Erased with valid statistics, ready to be allocated
+    FLOG_AGE_TABLE_FREE = 0,
+    //! Holds data of some kind
+    FLOG_AGE_TABLE_USED = 1,
+    //! Must be erased before it can be allocated
+    FLOG_AGE_TABLE_STALE = 2
+} flog_age_table_state_t;
+
+typedef struct {
+    flog_universal_init_sector_t universal;
+    //! The index of this block in the chain of age table blocks
+    uint32_t sequence;
+} flog_age_table_init_sector_t;
+
+typedef struct {
+    uint8_t type_id;
+    uint8_t nothing;
+    //! The number of entries in the sector
+    uint16_t nentries;
+} flog_age_table_sector_spare_t;
+
+/*!
+ @brief A 2-byte block index followed by a 3-byte age
+
+ The upper two bits of the age hold a @ref flog_age_table_state_t
+ */
+typedef struct {
+    uint8_t block[2];
+    uint8_t age[3];
+} flog_age_table_entry_t;
+
+//! @}
+
 //! @name Special sector indices
 //! @{
 typedef enum {
@@ -232,7 +400,9 @@ typedef enum {
     FLOG_INIT_SECTOR = (1),
     FLOG_TAIL_SECTOR = (3),
     FLOG_FILE_FIRST_DATA_SECTOR = (2),
-    FLOG_INODE_FIRST_ENTRY_SECTOR = (4)
+    FLOG_INODE_FIRST_ENTRY_SECTOR = (4),
+    FLOG_CHECKPOINT_FIRST_SECTOR = (4),
+    FLOG_AGE_TABLE_FIRST_SECTOR = (2)
 } flog_sector_special_idx_t;
 //! @}
 
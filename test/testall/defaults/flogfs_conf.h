@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_conf.h
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ *
+ * @brief Platform-specific interface details
+ */
+
+#ifndef __FLOGFS_CONF_H_
+#define __FLOGFS_CONF_H_
+
+#include "flogfs.h"
+
+//! @addtogroup FLogConf
+//! @{
+
+//! @name Flash module parameters
+//! @{
+#define FS_SECTOR_SIZE (512)
+#define FS_SECTORS_PER_PAGE (4)
+#define FS_MAXIMUM_BLOCKS (1024)
+//! @}
+
+//! The number of blocks to preallocate
+#define FS_PREALLOCATE_SIZE (8)
+
+//! The number of blocks to search for inode0 in
+#define FS_INODE0_MAX_BLOCK (32)
+
+// Optional features are left at their defaults so that this build covers the
+// paths the main test configuration turns off
+
+//! @} // FLogConf
+
+#endif
@@ -53,6 +53,18 @@ either expressed or implied, of the FLogFS Project.
 //! The number of blocks to preallocate
 #define FS_PREALLOCATE_SIZE (8)
 
+//! The number of files to keep in the in-RAM filename index
+#define FS_FILE_INDEX_SIZE (16)
+
+//! The number of flash pages to keep in the read cache
+#define FS_READ_CACHE_PAGES (4)
+
+//! Program streamed data a page at a time
+#define FS_WRITE_PAGES (1)
+
+//! The number of sectors each write file can queue for the flusher thread
+#define FS_WRITE_BEHIND (4)
+
  //! The number of blocks to search to search for inode0 for.
 #define FS_INODE0_MAX_BLOCK (32)
 
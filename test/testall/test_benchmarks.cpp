@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <flogfs.h>
+#include <flogfs_linux_mmap.h>
+
+#include "test_benchmarks.h"
+
+#include "utilities.h"
+
+BenchmarkSuite::BenchmarkSuite() {
+}
+
+BenchmarkSuite::~BenchmarkSuite() {
+};
+
+void BenchmarkSuite::SetUp() {
+};
+
+void BenchmarkSuite::TearDown() {
+    flush_and_close();
+};
+
+TEST_F(BenchmarkSuite, SequentialReadPageOpens) {
+    constexpr uint32_t FileSize = 1024 * 1024;
+    constexpr uint32_t PageSize = FS_SECTOR_SIZE * FS_SECTORS_PER_PAGE;
+    constexpr int32_t Passes = 20;
+
+    uint8_t buffer[4096] = { 0 };
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "bench.bin"));
+    for (auto i = 0; i < FileSize / sizeof(buffer); ++i) {
+        ASSERT_EQ(flogfs_write(&fwrite, buffer, sizeof(buffer)), sizeof(buffer));
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    auto started = std::chrono::steady_clock::now();
+
+    for (auto pass = 0; pass < Passes; ++pass) {
+        flog_read_file_t fread;
+        ASSERT_TRUE(flogfs_open_read(&fread, "bench.bin"));
+        while (flogfs_read(&fread, buffer, sizeof(buffer)) > 0) {
+        }
+        ASSERT_TRUE(flogfs_close_read(&fread));
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+    auto pages = (FileSize / PageSize) * Passes;
+
+    std::cout << "Sequential read: " << elapsed.count() / pages << "ns per page" << std::endl;
+    RecordProperty("ns_per_page", (int)(elapsed.count() / pages));
+}
+
+TEST_F(BenchmarkSuite, WriteAndRemoveAllocations) {
+    constexpr uint32_t FileSize = 1024 * 1024;
+    constexpr uint32_t PageSize = FS_SECTOR_SIZE * FS_SECTORS_PER_PAGE;
+    constexpr int32_t Passes = 10;
+
+    uint8_t buffer[4096] = { 0 };
+
+    initialize_and_open();
+
+    auto started = std::chrono::steady_clock::now();
+
+    for (auto pass = 0; pass < Passes; ++pass) {
+        flog_write_file_t fwrite;
+        ASSERT_TRUE(flogfs_open_write(&fwrite, "bench.bin"));
+        for (auto i = 0; i < FileSize / sizeof(buffer); ++i) {
+            ASSERT_EQ(flogfs_write(&fwrite, buffer, sizeof(buffer)), sizeof(buffer));
+        }
+        ASSERT_TRUE(flogfs_close_write(&fwrite));
+        ASSERT_TRUE(flogfs_rm("bench.bin"));
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+    auto pages = (FileSize / PageSize) * Passes;
+
+    std::cout << "Write and remove: " << elapsed.count() / pages << "ns per page" << std::endl;
+    RecordProperty("ns_per_page", (int)(elapsed.count() / pages));
+}
+
+static void write_call_latency(bool bounded) {
+    constexpr uint32_t FileSize = 1024 * 1024;
+    constexpr uint32_t RecordSize = 256;
+
+    uint8_t buffer[4096] = { 0 };
+    std::vector<int64_t> latencies;
+
+    initialize_and_open();
+
+    // Deleted blocks are erased as they're needed, which is the expensive case
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "filler.bin"));
+    while (flogfs_write(&fwrite, buffer, sizeof(buffer)) == sizeof(buffer)) {
+    }
+    // It may lose its last tail sector, which doesn't matter as it's deleted
+    flogfs_close_write(&fwrite);
+    ASSERT_TRUE(flogfs_rm("filler.bin"));
+
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "bench.bin"));
+    flogfs_write_bounded(&fwrite, bounded);
+
+    for (uint32_t written = 0; written < FileSize; ) {
+        auto started = std::chrono::steady_clock::now();
+        auto n = flogfs_write(&fwrite, buffer, RecordSize);
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+
+        latencies.push_back(elapsed.count());
+        written += n;
+
+        // The maintenance a bounded writer schedules between calls
+        if (bounded) {
+            flogfs_gc_step(1);
+        }
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    std::sort(latencies.begin(), latencies.end());
+    auto p50 = latencies[latencies.size() / 2];
+    auto p99 = latencies[latencies.size() * 99 / 100];
+    auto max = latencies.back();
+
+    std::cout << (bounded ? "Bounded" : "Unbounded") << " write: p50 " << p50 << "ns p99 " << p99 << "ns max " << max
+              << "ns" << std::endl;
+    ::testing::Test::RecordProperty("p50_ns", (int)p50);
+    ::testing::Test::RecordProperty("p99_ns", (int)p99);
+    ::testing::Test::RecordProperty("max_ns", (int)max);
+}
+
+TEST_F(BenchmarkSuite, WriteCallLatency) {
+    write_call_latency(false);
+}
+
+TEST_F(BenchmarkSuite, BoundedWriteCallLatency) {
+    write_call_latency(true);
+}
+
+TEST_F(BenchmarkSuite, ConcurrentWriters) {
+    constexpr uint32_t FileSize = 96 * 1024;
+    constexpr uint32_t RecordSize = 64;
+
+    initialize_and_open();
+
+    auto pass = 0;
+    for (auto writers : { 1, 2, 4 }) {
+        std::vector<std::thread> threads;
+
+        auto started = std::chrono::steady_clock::now();
+
+        for (auto w = 0; w < writers; ++w) {
+            std::string name = "bench" + std::to_string(pass) + "-" + std::to_string(w) + ".bin";
+            threads.emplace_back([name] {
+                uint8_t buffer[RecordSize] = { 0 };
+                uint32_t const n = RecordSize;
+
+                flog_write_file_t fwrite;
+                EXPECT_TRUE(flogfs_open_write(&fwrite, name.c_str()));
+                for (uint32_t i = 0; i < FileSize / RecordSize; ++i) {
+                    EXPECT_EQ(flogfs_write(&fwrite, buffer, n), n);
+                }
+                EXPECT_TRUE(flogfs_close_write(&fwrite));
+                EXPECT_TRUE(flogfs_rm(name.c_str()));
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+        auto records = (FileSize / RecordSize) * writers;
+
+        std::cout << writers << " writers: " << elapsed.count() / records << "ns per record" << std::endl;
+        RecordProperty("ns_per_record_" + std::to_string(writers), (int)(elapsed.count() / records));
+        pass++;
+    }
+}
+
+TEST_F(BenchmarkSuite, ConcurrentReaders) {
+    constexpr uint32_t FileSize = 256 * 1024;
+    constexpr int32_t Passes = 4;
+
+    uint8_t buffer[4096] = { 0 };
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "bench.bin"));
+    for (auto i = 0; i < FileSize / sizeof(buffer); ++i) {
+        ASSERT_EQ(flogfs_write(&fwrite, buffer, sizeof(buffer)), sizeof(buffer));
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    // Reads take the flash lock alone, so they only wait on a writer while
+    // it's at the flash
+    for (auto readers : { 1, 2, 4 }) {
+        std::vector<std::thread> threads;
+
+        auto started = std::chrono::steady_clock::now();
+
+        for (auto r = 0; r < readers; ++r) {
+            threads.emplace_back([] {
+                uint8_t buffer[4096];
+                uint32_t const size = FileSize;
+
+                for (auto pass = 0; pass < Passes; ++pass) {
+                    flog_read_file_t fread;
+                    EXPECT_TRUE(flogfs_open_read(&fread, "bench.bin"));
+                    uint32_t total = 0;
+                    uint32_t n;
+                    while ((n = flogfs_read(&fread, buffer, sizeof(buffer))) > 0) {
+                        total += n;
+                    }
+                    EXPECT_EQ(total, size);
+                    EXPECT_TRUE(flogfs_close_read(&fread));
+                }
+            });
+        }
+        threads.emplace_back([] {
+            uint8_t buffer[64] = { 0 };
+
+            flog_write_file_t fwrite;
+            EXPECT_TRUE(flogfs_open_write(&fwrite, "log.bin"));
+            for (uint32_t i = 0; i < FileSize / 4 / sizeof(buffer); ++i) {
+                EXPECT_EQ(flogfs_write(&fwrite, buffer, sizeof(buffer)), sizeof(buffer));
+            }
+            EXPECT_TRUE(flogfs_close_write(&fwrite));
+            EXPECT_TRUE(flogfs_rm("log.bin"));
+        });
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+        auto pages = (FileSize / (FS_SECTOR_SIZE * FS_SECTORS_PER_PAGE)) * Passes * readers;
+
+        std::cout << readers << " readers and a writer: " << elapsed.count() / pages << "ns per page" << std::endl;
+        RecordProperty("ns_per_page_" + std::to_string(readers), (int)(elapsed.count() / pages));
+    }
+}
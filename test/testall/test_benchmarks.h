@@ -0,0 +1,11 @@
+#include <gtest/gtest.h>
+
+class BenchmarkSuite : public ::testing::Test {
+protected:
+    BenchmarkSuite();
+    virtual ~BenchmarkSuite();
+
+    virtual void SetUp();
+    virtual void TearDown();
+
+};
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
 #include <flogfs.h>
 #include <flogfs_linux_mmap.h>
 
@@ -208,3 +213,1728 @@ TEST_F(FileOpsSuite, ListFiles) {
 
     ASSERT_EQ(expected_names, actual_names);
 }
+
+TEST_F(FileOpsSuite, FileIdsAfterCleanUnmount) {
+    uint8_t pattern[256];
+
+    initialize_and_open();
+
+    flog_write_file_t first;
+    ASSERT_TRUE(flogfs_open_write(&first, "first.bin"));
+    ASSERT_EQ(flogfs_write(&first, pattern, sizeof(pattern)), sizeof(pattern));
+    ASSERT_TRUE(flogfs_close_write(&first));
+
+    unmount_and_close();
+
+    initialize_and_open(false, false);
+
+    flog_write_file_t second;
+    ASSERT_TRUE(flogfs_open_write(&second, "second.bin"));
+    ASSERT_GT(second.id, first.id);
+    ASSERT_TRUE(flogfs_close_write(&second));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "first.bin"));
+    ASSERT_EQ(flogfs_read_file_size(&fread), sizeof(pattern));
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    ASSERT_EQ(get_file_listing(), (std::vector<std::string>{ "first.bin", "second.bin" }));
+}
+
+TEST_F(FileOpsSuite, FileIdsAfterUncleanUnmount) {
+    initialize_and_open();
+
+    flog_write_file_t first;
+    ASSERT_TRUE(flogfs_open_write(&first, "first.bin"));
+    ASSERT_TRUE(flogfs_close_write(&first));
+
+    unmount_and_close();
+
+    // Consumes the checkpoint, so the next mount has to inspect
+    initialize_and_open(false, false);
+
+    flog_write_file_t second;
+    ASSERT_TRUE(flogfs_open_write(&second, "second.bin"));
+    ASSERT_TRUE(flogfs_close_write(&second));
+
+    flush_and_close();
+
+    initialize_and_open(false, false);
+
+    flog_write_file_t third;
+    ASSERT_TRUE(flogfs_open_write(&third, "third.bin"));
+    ASSERT_GT(third.id, second.id);
+    ASSERT_GT(second.id, first.id);
+    ASSERT_TRUE(flogfs_close_write(&third));
+}
+
+TEST_F(FileOpsSuite, RepeatedUnmountFillsCheckpointBlock) {
+    initialize_and_open();
+
+    flog_file_id_t last_id = 0;
+
+    // More unmounts than there are checkpoint entries in a block
+    for (auto i = 0; i < 40; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "file-%02d.bin", i);
+
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, name));
+        ASSERT_GT(file.id, last_id);
+        last_id = file.id;
+
+        unmount_and_close();
+
+        initialize_and_open(false, false);
+    }
+
+    ASSERT_EQ(get_file_listing().size(), 40);
+}
+
+TEST_F(FileOpsSuite, CleanMountPrimesFromAgeTable) {
+    initialize_and_open();
+
+    auto names = generate_random_file_names(5);
+    write_files_randomly(names, 5, 4096, 16384);
+
+    unmount_and_close();
+
+    initialize_and_open(false, false);
+
+    // The table is only read, so it's still around until it gets reclaimed
+    ASSERT_EQ(analyze_file_system().number_of_blocks(FLOG_BLOCK_TYPE_AGE_TABLE), 1);
+
+    ASSERT_EQ(get_file_listing().size(), names.size());
+
+    // Enough to need blocks beyond those the table handed out
+    auto more = generate_random_file_names(10);
+    write_files_randomly(more, 5, 4096, 16384);
+
+    unmount_and_close();
+
+    initialize_and_open(false, false);
+
+    ASSERT_EQ(get_file_listing().size(), more.size());
+}
+
+TEST_F(FileOpsSuite, AgeTableRecordsBadBlocks) {
+    initialize_and_open();
+
+    // The last block too, which the table's final entries must still cover
+    flogfs_linux_mark_bad_block(30);
+    flogfs_linux_mark_bad_block(47);
+
+    auto names = generate_random_file_names(5);
+    write_files_randomly(names, 5, 4096, 16384);
+
+    unmount_and_close();
+
+    initialize_and_open(false, false);
+
+    // Falling back to the scan would have reclaimed the table
+    ASSERT_EQ(analyze_file_system().number_of_blocks(FLOG_BLOCK_TYPE_AGE_TABLE), 1);
+
+    ASSERT_EQ(get_file_listing().size(), names.size());
+}
+
+TEST_F(FileOpsSuite, FillingTheVolumeUsesEveryFreeBlock) {
+    uint8_t pattern[4096] = { 0 };
+
+    initialize_and_open();
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    while (flogfs_write(&file, pattern, sizeof(pattern)) == sizeof(pattern)) {
+    }
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    // Every block that isn't the inode table or the checkpoint should be holding data
+    auto analysis = analyze_file_system();
+    auto used = analysis.number_of_file_blocks() + analysis.number_of_inode_blocks() +
+                analysis.number_of_blocks(FLOG_BLOCK_TYPE_CHECKPOINT);
+    ASSERT_EQ(used, 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, ThresholdKeepsWearEven) {
+    uint8_t pattern[4096] = { 0 };
+
+    initialize_and_open();
+
+    for (auto i = 0; i < 50; ++i) {
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+        file.base_threshold = 48;
+        for (auto j = 0; j < 20; ++j) {
+            ASSERT_EQ(flogfs_write(&file, pattern, sizeof(pattern)), sizeof(pattern));
+        }
+        ASSERT_TRUE(flogfs_close_write(&file));
+        ASSERT_TRUE(flogfs_rm("file.bin"));
+    }
+
+    auto analysis = analyze_file_system();
+    flog_block_age_t youngest = FLOG_BLOCK_AGE_INVALID, oldest = 0;
+    for (auto &ba : analysis.blocks()) {
+        if (ba.valid_block && ba.type_id == FLOG_BLOCK_TYPE_UNALLOCATED) {
+            youngest = std::min(youngest, ba.age);
+            oldest = std::max(oldest, ba.age);
+        }
+    }
+    ASSERT_LE(oldest - youngest, 1);
+}
+
+TEST_F(FileOpsSuite, GcStepLeavesNoErasesForWrites) {
+    uint8_t pattern[4096] = { 0 };
+
+    initialize_and_open();
+
+    while (flogfs_gc_step(4) == 4) {
+    }
+
+    auto &log = flogfs_linux_get_log();
+    auto erases = log.count(OperationType::EraseBlock);
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    for (auto i = 0; i < 256; ++i) {
+        ASSERT_EQ(flogfs_write(&file, pattern, sizeof(pattern)), sizeof(pattern));
+    }
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    ASSERT_EQ(log.count(OperationType::EraseBlock), erases);
+
+    // Refilling the preallocation list has nothing left to erase either
+    while (flogfs_gc_step(4) == 4) {
+    }
+    ASSERT_EQ(log.count(OperationType::EraseBlock), erases);
+}
+
+static int32_t used_blocks() {
+    auto analysis = analyze_file_system();
+    return analysis.number_of_file_blocks() + analysis.number_of_inode_blocks() +
+           analysis.number_of_blocks(FLOG_BLOCK_TYPE_CHECKPOINT);
+}
+
+static void write_until_full(const char *name) {
+    uint8_t pattern[4096] = { 0 };
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, name));
+    uint32_t written = 0;
+    uint32_t n;
+    do {
+        n = flogfs_write(&file, pattern, sizeof(pattern));
+        written += n;
+    } while (n == sizeof(pattern));
+
+    // The last tail sector may have no block to go before, and close has to
+    // say when that loses data
+    auto closed = flogfs_close_write(&file);
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, name));
+    if (closed) {
+        ASSERT_EQ(flogfs_read_file_size(&fread), written);
+    } else {
+        ASSERT_LT(flogfs_read_file_size(&fread), written);
+    }
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, RmDefersErasing) {
+    initialize_and_open();
+
+    write_until_full("first.bin");
+
+    auto &log = flogfs_linux_get_log();
+    auto erases = log.count(OperationType::EraseBlock);
+
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+    ASSERT_EQ(log.count(OperationType::EraseBlock), erases);
+
+    while (flogfs_gc_step(4) == 4) {
+    }
+    ASSERT_GT(log.count(OperationType::EraseBlock), erases);
+
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, RmReclaimsOnDemand) {
+    initialize_and_open();
+
+    write_until_full("first.bin");
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+
+    // Nothing free, so allocation has to reclaim as it goes
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, RmReclaimResumesAfterUncleanUnmount) {
+    initialize_and_open();
+
+    write_until_full("first.bin");
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+    ASSERT_EQ(flogfs_gc_step(3), 3);
+
+    flush_and_close();
+
+    initialize_and_open(false, false);
+
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, RmReclaimResumesAfterCleanUnmount) {
+    initialize_and_open();
+
+    write_until_full("first.bin");
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+    ASSERT_EQ(flogfs_gc_step(3), 3);
+
+    unmount_and_close();
+
+    initialize_and_open(false, false);
+
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+static void write_and_rm_many(bool clean) {
+    // Twice what the reclaim queue holds, a few blocks each
+    const auto nfiles = 8;
+    const uint32_t size = 100 * 1024;
+    uint8_t pattern[1024] = { 0 };
+
+    initialize_and_open();
+
+    for (auto i = 0; i < nfiles; ++i) {
+        flog_write_file_t file;
+        auto name = "file" + std::to_string(i) + ".bin";
+        ASSERT_TRUE(flogfs_open_write(&file, name.c_str()));
+        for (uint32_t written = 0; written < size; written += sizeof(pattern)) {
+            ASSERT_EQ(flogfs_write(&file, pattern, sizeof(pattern)), sizeof(pattern));
+        }
+        ASSERT_TRUE(flogfs_close_write(&file));
+    }
+
+    auto &log = flogfs_linux_get_log();
+    auto erases = log.count(OperationType::EraseBlock);
+    for (auto i = 0; i < nfiles; ++i) {
+        auto name = "file" + std::to_string(i) + ".bin";
+        ASSERT_TRUE(flogfs_rm(name.c_str()));
+    }
+    ASSERT_EQ(log.count(OperationType::EraseBlock), erases);
+
+    if (clean) {
+        unmount_and_close();
+    } else {
+        flush_and_close();
+    }
+    initialize_and_open(false, false);
+
+    // Files that didn't fit in the queue are found again once it's empty
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, RmManyDefersErasingAcrossCleanUnmount) {
+    write_and_rm_many(true);
+}
+
+TEST_F(FileOpsSuite, RmManyDefersErasingAcrossUncleanUnmount) {
+    write_and_rm_many(false);
+}
+
+#if FS_FILE_INDEX_SIZE
+TEST_F(FileOpsSuite, IndexedLookupsSkipTheInodeTable) {
+    initialize_and_open();
+
+    auto names = generate_random_file_names(8);
+    for (auto &name : names) {
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, name.c_str()));
+        ASSERT_TRUE(flogfs_close_write(&file));
+    }
+
+    auto &log = flogfs_linux_get_log();
+    auto opened = log.count(OperationType::OpenPage);
+
+    ASSERT_FALSE(flogfs_check_exists("missing.bin"));
+    ASSERT_EQ(log.count(OperationType::OpenPage), opened);
+
+    ASSERT_TRUE(flogfs_check_exists(names[5].c_str()));
+    ASSERT_LE(log.count(OperationType::OpenPage), opened + 1);
+}
+#endif
+
+TEST_F(FileOpsSuite, LookupsSurviveIndexOverflow) {
+    initialize_and_open();
+
+    // Enough to need a second inode block and more than the index holds
+    auto names = generate_random_file_names(36);
+    for (auto &name : names) {
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, name.c_str()));
+        ASSERT_TRUE(flogfs_close_write(&file));
+    }
+
+    for (auto i = 0; i < names.size(); i += 2) {
+        ASSERT_TRUE(flogfs_rm(names[i].c_str()));
+    }
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, names[4].c_str()));
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    auto verify = [&]() {
+        for (auto i = 0; i < names.size(); ++i) {
+            ASSERT_EQ(flogfs_check_exists(names[i].c_str()), i % 2 == 1 || i == 4) << names[i];
+        }
+        ASSERT_EQ(get_file_listing().size(), names.size() / 2 + 1);
+    };
+
+    verify();
+
+    unmount_and_close();
+    initialize_and_open(false, false);
+    verify();
+
+    flush_and_close();
+    initialize_and_open(false, false);
+    verify();
+}
+
+static void create_empty_files(std::vector<std::string> &names) {
+    for (auto &name : names) {
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, name.c_str()));
+        ASSERT_TRUE(flogfs_close_write(&file));
+    }
+}
+
+TEST_F(FileOpsSuite, CompactDropsDeletedEntries) {
+    initialize_and_open();
+
+    auto names = generate_random_file_names(36);
+    create_empty_files(names);
+
+    std::vector<std::string> kept;
+    for (auto i = 0; i < names.size(); ++i) {
+        if (i % 6 == 0) {
+            kept.push_back(names[i]);
+        } else {
+            ASSERT_TRUE(flogfs_rm(names[i].c_str()));
+        }
+    }
+    while (flogfs_gc_step(4) == 4) {
+    }
+
+    ASSERT_EQ(analyze_file_system().number_of_inode_blocks(), 2);
+
+    flog_write_file_t before;
+    ASSERT_TRUE(flogfs_open_write(&before, "before.bin"));
+    ASSERT_TRUE(flogfs_close_write(&before));
+    kept.push_back("before.bin");
+
+    ASSERT_TRUE(flogfs_compact());
+    while (flogfs_gc_step(4) == 4) {
+    }
+
+    ASSERT_EQ(analyze_file_system().number_of_inode_blocks(), 1);
+
+    auto verify = [&]() {
+        auto listing = get_file_listing();
+        std::sort(listing.begin(), listing.end());
+        std::sort(kept.begin(), kept.end());
+        ASSERT_EQ(listing, kept);
+        for (auto &name : kept) {
+            ASSERT_TRUE(flogfs_check_exists(name.c_str()));
+        }
+        ASSERT_FALSE(flogfs_check_exists(names[1].c_str()));
+    };
+
+    verify();
+
+    unmount_and_close();
+    initialize_and_open(false, false);
+    verify();
+
+    flush_and_close();
+    initialize_and_open(false, false);
+    verify();
+
+    // IDs of deleted files are never handed out again
+    flog_write_file_t after;
+    ASSERT_TRUE(flogfs_open_write(&after, "after.bin"));
+    ASSERT_GT(after.id, before.id);
+    ASSERT_TRUE(flogfs_close_write(&after));
+}
+
+TEST_F(FileOpsSuite, CompactSurvivesUncleanUnmount) {
+    initialize_and_open();
+
+    auto names = generate_random_file_names(8);
+    create_empty_files(names);
+    write_until_full("big.bin");
+    for (auto i = 0; i < names.size(); i += 2) {
+        ASSERT_TRUE(flogfs_rm(names[i].c_str()));
+    }
+    ASSERT_TRUE(flogfs_rm("big.bin"));
+
+    // The deleted big file still has blocks to reclaim, so it's carried over
+    ASSERT_TRUE(flogfs_compact());
+
+    flush_and_close();
+    initialize_and_open(false, false);
+
+    ASSERT_EQ(get_file_listing().size(), names.size() / 2);
+    for (auto i = 0; i < names.size(); ++i) {
+        ASSERT_EQ(flogfs_check_exists(names[i].c_str()), i % 2 == 1) << names[i];
+    }
+
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+static uint32_t flash_programs() {
+    auto &log = flogfs_linux_get_log();
+    return log.count(OperationType::WriteSector) + log.count(OperationType::WriteSpare) +
+           log.count(OperationType::WritePage) + log.count(OperationType::EraseBlock);
+}
+
+TEST_F(FileOpsSuite, CompactSurvivesPowerLossPartWay) {
+    auto names = generate_random_file_names(36);
+
+    for (int32_t lost_after = 0; ; ++lost_after) {
+        initialize_and_open();
+
+        create_empty_files(names);
+        for (auto i = 0; i < names.size(); i += 2) {
+            ASSERT_TRUE(flogfs_rm(names[i].c_str()));
+        }
+        while (flogfs_gc_step(4) == 4) {
+        }
+
+        auto before = flash_programs();
+        flogfs_linux_lose_power_after(lost_after);
+        // Whatever compaction thinks happened, only what reached flash counts
+        flogfs_compact();
+        auto finished = flash_programs() - before < lost_after;
+
+        flush_and_close();
+        initialize_and_open(false, false);
+
+        ASSERT_EQ(get_file_listing().size(), names.size() / 2) << lost_after;
+        for (auto i = 0; i < names.size(); ++i) {
+            ASSERT_EQ(flogfs_check_exists(names[i].c_str()), i % 2 == 1) << names[i] << " " << lost_after;
+        }
+
+        // Blocks of the unfinished table are erased before they're reused
+        write_until_full("second.bin");
+        ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK) << lost_after;
+
+        if (finished) {
+            break;
+        }
+        flush_and_close();
+    }
+}
+
+TEST_F(FileOpsSuite, OrphanedBlocksAreReused) {
+    for (int32_t lost_after = 0; ; ++lost_after) {
+        initialize_and_open();
+
+        // Power lost between a new file's first block and its inode entry
+        // leaves that block behind, owned by no file
+        auto before = flash_programs();
+        flogfs_linux_lose_power_after(lost_after);
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, "new.bin"));
+        auto finished = flash_programs() - before < lost_after;
+
+        flush_and_close();
+        initialize_and_open(false, false);
+
+        write_until_full("fill.bin");
+
+        std::vector<flog_file_id_t> ids;
+        for (auto &name : get_file_listing()) {
+            flog_read_file_t reader;
+            ASSERT_TRUE(flogfs_open_read(&reader, name.c_str()));
+            ids.push_back(reader.id);
+            ASSERT_TRUE(flogfs_close_read(&reader));
+        }
+        for (auto &block : analyze_file_system().blocks()) {
+            if (block.is_file()) {
+                ASSERT_NE(std::find(ids.begin(), ids.end(), block.file_id), ids.end()) << block.block << " " << lost_after;
+            }
+        }
+
+        if (finished) {
+            break;
+        }
+        flush_and_close();
+    }
+}
+
+TEST_F(FileOpsSuite, CompactReclaimsForNewTable) {
+    initialize_and_open();
+
+    // Every block low enough for a table belongs to the deleted file
+    write_until_full("big.bin");
+    ASSERT_TRUE(flogfs_rm("big.bin"));
+
+    ASSERT_TRUE(flogfs_compact());
+
+    flush_and_close();
+    initialize_and_open(false, false);
+
+    ASSERT_EQ(get_file_listing().size(), 0);
+
+    write_until_full("second.bin");
+    ASSERT_EQ(used_blocks(), 48 - FS_FIRST_BLOCK);
+}
+
+TEST_F(FileOpsSuite, CloseRecordsShortenOpens) {
+    uint8_t pattern[256] = { 0 };
+    uint32_t size = 0;
+
+    initialize_and_open();
+
+    auto append = [&](uint32_t bytes) {
+        flog_write_file_t file;
+        ASSERT_TRUE(flogfs_open_write(&file, "big.bin"));
+        ASSERT_EQ(flogfs_write_file_size(&file), size);
+        for (uint32_t i = 0; i < bytes; i += sizeof(pattern)) {
+            ASSERT_EQ(flogfs_write(&file, pattern, sizeof(pattern)), sizeof(pattern));
+        }
+        size += bytes;
+        ASSERT_TRUE(flogfs_close_write(&file));
+    };
+
+    auto verify = [&]() {
+        auto &log = flogfs_linux_get_log();
+        auto opened = log.count(OperationType::OpenPage);
+        flog_read_file_t file;
+        ASSERT_TRUE(flogfs_open_read(&file, "big.bin"));
+        ASSERT_EQ(flogfs_read_file_size(&file), size);
+        ASSERT_TRUE(flogfs_close_read(&file));
+        // A full walk of the chain takes more than 30
+        ASSERT_LE(log.count(OperationType::OpenPage), opened + 16);
+    };
+
+    append(768 * 1024);
+    verify();
+
+    unmount_and_close();
+    initialize_and_open(false, false);
+    verify();
+
+    append(8 * 1024);
+    flush_and_close();
+    initialize_and_open(false, false);
+    verify();
+
+    ASSERT_TRUE(flogfs_compact());
+    verify();
+
+    flush_and_close();
+    initialize_and_open(false, false);
+    verify();
+}
+
+TEST_F(FileOpsSuite, SeekUsesKnownBlocks) {
+    const uint32_t size = 768 * 1024;
+    uint32_t words[64];
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "big.bin"));
+    for (uint32_t position = 0; position < size; position += sizeof(words)) {
+        for (uint32_t i = 0; i < 64; ++i) {
+            words[i] = position / sizeof(uint32_t) + i;
+        }
+        ASSERT_EQ(flogfs_write(&fwrite, (uint8_t *)words, sizeof(words)), sizeof(words));
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "big.bin"));
+
+    auto &log = flogfs_linux_get_log();
+    auto check = [&](flog_read_file_t *file, uint32_t position) {
+        uint32_t word;
+        ASSERT_TRUE(flogfs_read_seek(file, position));
+        ASSERT_EQ(flogfs_read_tell(file), position);
+        ASSERT_EQ(flogfs_read(file, (uint8_t *)&word, sizeof(word)), sizeof(word));
+        ASSERT_EQ(word, position / sizeof(uint32_t));
+    };
+
+    check(&fread, 0);
+    check(&fread, size - 4096);
+    check(&fread, size / 2);
+    check(&fread, 4);
+
+    // Going backwards so the read head's block is never any help. Both still
+    // walk the sectors of the block they land in.
+    uint32_t warm = 0;
+    uint32_t cold = 0;
+    for (uint32_t position = size - size / 16; position > 0; position -= size / 16) {
+        auto opened = log.count(OperationType::OpenPage);
+        check(&fread, position);
+        warm += log.count(OperationType::OpenPage) - opened;
+
+        flog_read_file_t fresh;
+        ASSERT_TRUE(flogfs_open_read(&fresh, "big.bin"));
+        opened = log.count(OperationType::OpenPage);
+        check(&fresh, position);
+        cold += log.count(OperationType::OpenPage) - opened;
+        ASSERT_TRUE(flogfs_close_read(&fresh));
+    }
+    ASSERT_LT(warm * 3, cold * 2);
+
+    // Seeking forward from the read head doesn't go back to a known block
+    check(&fread, size - 2 * 4096);
+    auto opened = log.count(OperationType::OpenPage);
+    check(&fread, size - 4096);
+    ASSERT_LE(log.count(OperationType::OpenPage), opened + 6);
+
+    ASSERT_FALSE(flogfs_read_seek(&fread, size + 1));
+    ASSERT_EQ(flogfs_read_tell(&fread), size - 4096 + 4);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+#if FS_READ_CACHE_PAGES
+TEST_F(FileOpsSuite, ReadCacheServesInterleavedReaders) {
+    uint8_t pattern[256];
+
+    initialize_and_open();
+
+    for (auto name : { "a.bin", "b.bin" }) {
+        flog_write_file_t fwrite;
+        ASSERT_TRUE(flogfs_open_write(&fwrite, name));
+        for (auto i = 0; i < 16; ++i) {
+            memset(pattern, name[0] + i, sizeof(pattern));
+            ASSERT_EQ(flogfs_write(&fwrite, pattern, sizeof(pattern)), sizeof(pattern));
+        }
+        ASSERT_TRUE(flogfs_close_write(&fwrite));
+    }
+
+    flog_read_file_t a, b;
+    ASSERT_TRUE(flogfs_open_read(&a, "a.bin"));
+    ASSERT_TRUE(flogfs_open_read(&b, "b.bin"));
+
+    flog_read_cache_stats_t before, after;
+    flogfs_read_cache_stats(&before);
+    auto &log = flogfs_linux_get_log();
+    auto opened = log.count(OperationType::OpenPage);
+
+    for (auto i = 0; i < 16 * 4; ++i) {
+        uint8_t chunk[64];
+        ASSERT_EQ(flogfs_read(&a, chunk, sizeof(chunk)), sizeof(chunk));
+        ASSERT_EQ(chunk[0], 'a' + i / 4);
+        ASSERT_EQ(flogfs_read(&b, chunk, sizeof(chunk)), sizeof(chunk));
+        ASSERT_EQ(chunk[0], 'b' + i / 4);
+    }
+
+    flogfs_read_cache_stats(&after);
+    // Each file covers three pages, the block header pushes it past two
+    ASSERT_LE(log.count(OperationType::OpenPage), opened + 6);
+    ASSERT_LE(after.misses - before.misses, 6);
+    ASSERT_GT(after.hits - before.hits, 128);
+
+    ASSERT_TRUE(flogfs_close_read(&a));
+    ASSERT_TRUE(flogfs_close_read(&b));
+}
+#endif
+
+TEST_F(FileOpsSuite, ReadCacheSeesNewWrites) {
+    uint8_t pattern[256];
+    uint8_t temporary[256];
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "file.bin"));
+    memset(pattern, 1, sizeof(pattern));
+    ASSERT_EQ(flogfs_write(&fwrite, pattern, sizeof(pattern)), sizeof(pattern));
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    ASSERT_EQ(flogfs_read(&fread, temporary, sizeof(temporary)), sizeof(temporary));
+    ASSERT_EQ(flogfs_read(&fread, temporary, sizeof(temporary)), 0);
+
+    // Appends land in the page the reader has cached
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "file.bin"));
+    memset(pattern, 2, sizeof(pattern));
+    ASSERT_EQ(flogfs_write(&fwrite, pattern, sizeof(pattern)), sizeof(pattern));
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    ASSERT_EQ(flogfs_read(&fread, temporary, sizeof(temporary)), sizeof(temporary));
+    ASSERT_EQ(temporary[0], 2);
+    ASSERT_EQ(temporary[sizeof(temporary) - 1], 2);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, ReadViewMatchesRead) {
+    const uint32_t size = 48 * 1024;
+    uint32_t words[64];
+    uint8_t buffer[FS_SECTOR_SIZE];
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "file.bin"));
+    for (uint32_t position = 0; position < size; position += sizeof(words)) {
+        for (uint32_t i = 0; i < 64; ++i) {
+            words[i] = position / sizeof(uint32_t) + i;
+        }
+        ASSERT_EQ(flogfs_write(&fwrite, (uint8_t *)words, sizeof(words)), sizeof(words));
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+
+    // Start part way into a sector to check views pick up from the read head
+    ASSERT_EQ(flogfs_read(&fread, (uint8_t *)words, 8), 8);
+
+    std::vector<uint8_t> contents((uint8_t *)words, (uint8_t *)words + 8);
+    flog_read_span_t span;
+    while (flogfs_read_view(&fread, &span, buffer) > 0) {
+        // Everything on this backend can be mapped
+        ASSERT_NE(span.data, buffer);
+        contents.insert(contents.end(), span.data, span.data + span.length);
+    }
+    ASSERT_EQ(span.data, nullptr);
+    ASSERT_EQ(flogfs_read_tell(&fread), size);
+
+    ASSERT_EQ(contents.size(), size);
+    for (uint32_t position = 0; position < size; position += sizeof(uint32_t)) {
+        ASSERT_EQ(*(uint32_t *)&contents[position], position / sizeof(uint32_t)) << position;
+    }
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, LargeReadsUseBulkReads) {
+    const uint32_t size = 96 * 1024;
+    std::vector<uint32_t> words(size / sizeof(uint32_t));
+    for (uint32_t i = 0; i < words.size(); ++i) {
+        words[i] = i;
+    }
+
+    initialize_and_open();
+
+    // Reopening leaves a partly filled sector in the middle of a block
+    uint32_t written = 0;
+    for (uint32_t part : { 10u * 1024 + 100, 20u * 1024, size - 30 * 1024 - 100 }) {
+        flog_write_file_t fwrite;
+        ASSERT_TRUE(flogfs_open_write(&fwrite, "file.bin"));
+        ASSERT_EQ(flogfs_write(&fwrite, (uint8_t *)words.data() + written, part), part);
+        ASSERT_TRUE(flogfs_close_write(&fwrite));
+        written += part;
+    }
+
+    auto &log = flogfs_linux_get_log();
+    auto bulk = log.count(OperationType::ReadSectors);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    std::vector<uint32_t> contents(words.size() + 16);
+    ASSERT_EQ(flogfs_read(&fread, (uint8_t *)contents.data(), contents.size() * sizeof(uint32_t)), size);
+    contents.resize(words.size());
+    ASSERT_EQ(contents, words);
+    ASSERT_EQ(flogfs_read_tell(&fread), size);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    ASSERT_GT(log.count(OperationType::ReadSectors), bulk);
+}
+
+TEST_F(FileOpsSuite, FollowedReadersSeeNewData) {
+    uint8_t data[FS_SECTOR_SIZE * 3];
+    uint8_t buffer[sizeof(data)];
+    uint32_t notified = 0;
+
+    for (uint32_t i = 0; i < sizeof(data); ++i) {
+        data[i] = i * 7;
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+    ASSERT_EQ(flogfs_write(&fwrite, data, 100), 100);
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+    flogfs_read_follow(&fread, [](flog_read_file_t *, void *arg) { ++*(uint32_t *)arg; }, &notified);
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), 100);
+    ASSERT_FALSE(flogfs_read_has_data(&fread));
+
+    // Polling at the end of the file shouldn't go back to flash
+    auto &log = flogfs_linux_get_log();
+    auto opened = log.count(OperationType::OpenPage);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), 0);
+    }
+    ASSERT_EQ(log.count(OperationType::OpenPage), opened);
+
+    ASSERT_EQ(flogfs_write(&fwrite, data + 100, 50), 50);
+    ASSERT_TRUE(flogfs_read_has_data(&fread));
+    ASSERT_EQ(notified, 1);
+
+    ASSERT_EQ(flogfs_write(&fwrite, data + 150, sizeof(data) - 150), sizeof(data) - 150);
+    ASSERT_EQ(notified, 2);
+
+    // Closing doesn't add anything the reader couldn't already see
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+    ASSERT_EQ(notified, 2);
+
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), sizeof(data) - 100);
+    ASSERT_EQ(memcmp(buffer, data + 100, sizeof(data) - 100), 0);
+    ASSERT_FALSE(flogfs_read_has_data(&fread));
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, ReadersSeeUnflushedWrites) {
+    // Enough to cross a couple of blocks in odd sized pieces
+    const uint32_t size = 80 * 1024;
+    const uint32_t piece = 97;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> contents;
+    uint8_t buffer[FS_SECTOR_SIZE];
+    flog_read_span_t span;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 13 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+
+    flog_read_file_t fread, fview;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+    ASSERT_TRUE(flogfs_open_read(&fview, "log.txt"));
+
+    auto &log = flogfs_linux_get_log();
+    auto written = log.count(OperationType::WriteSector);
+    ASSERT_EQ(flogfs_write(&fwrite, data.data(), 10), 10);
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), 10);
+    ASSERT_EQ(memcmp(buffer, data.data(), 10), 0);
+    // Reading didn't make the writer commit anything
+    ASSERT_EQ(log.count(OperationType::WriteSector), written);
+
+    contents.insert(contents.end(), buffer, buffer + 10);
+    for (uint32_t position = 10; position < size; position += piece) {
+        uint32_t n = std::min(piece, size - position);
+        ASSERT_EQ(flogfs_write(&fwrite, &data[position], n), n);
+
+        // Catch up every so often so reads cover both flash and the buffer
+        if ((position / piece) % 7 == 0) {
+            uint32_t count;
+            while ((count = flogfs_read(&fread, buffer, sizeof(buffer))) > 0) {
+                contents.insert(contents.end(), buffer, buffer + count);
+            }
+            ASSERT_EQ(flogfs_read_tell(&fread), position + n);
+        }
+        while (flogfs_read_view(&fview, &span, buffer) > 0) {
+        }
+        ASSERT_EQ(flogfs_read_tell(&fview), position + n);
+    }
+
+    uint32_t count;
+    while ((count = flogfs_read(&fread, buffer, sizeof(buffer))) > 0) {
+        contents.insert(contents.end(), buffer, buffer + count);
+    }
+    ASSERT_EQ(contents, data);
+
+    // Everything the readers saw has to survive closing
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+    ASSERT_TRUE(flogfs_close_read(&fread));
+    ASSERT_TRUE(flogfs_close_read(&fview));
+
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+    contents.clear();
+    while ((count = flogfs_read(&fread, buffer, sizeof(buffer))) > 0) {
+        contents.insert(contents.end(), buffer, buffer + count);
+    }
+    ASSERT_EQ(contents, data);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, LargeReadsIncludeUnflushedWrites) {
+    const uint32_t size = 10000;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> buffer(2 * size);
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 11 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+    ASSERT_EQ(flogfs_write(&fwrite, data.data(), size), size);
+
+    // One read covering whole sectors on flash and the writer's buffer
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+    ASSERT_EQ(flogfs_read(&fread, buffer.data(), buffer.size()), size);
+    ASSERT_EQ(memcmp(buffer.data(), data.data(), size), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+}
+
+TEST_F(FileOpsSuite, ReverseReadsCostWhatTheyRead) {
+    // Enough blocks that walking the chain from the start would stand out
+    const uint32_t size = 640 * 1024;
+    const uint32_t tail = 96 * 1024;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> contents;
+    uint8_t buffer[FS_SECTOR_SIZE];
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 7 + (i >> 9);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+    ASSERT_EQ(flogfs_write(&fwrite, data.data(), size), size);
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+
+    auto &log = flogfs_linux_get_log();
+    auto opened = log.count(OperationType::OpenPage);
+
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, 0));
+    ASSERT_EQ(flogfs_read_tell(&fread), size);
+    while (flogfs_read_tell(&fread) > size - tail) {
+        uint32_t count = flogfs_read_reverse(&fread, buffer, 300);
+        ASSERT_GT(count, 0);
+        contents.insert(contents.begin(), buffer, buffer + count);
+    }
+    ASSERT_EQ(flogfs_read_tell(&fread), size - tail - (300 - tail % 300) % 300);
+    ASSERT_TRUE(std::equal(contents.begin(), contents.end(), data.end() - contents.size()));
+
+    // Roughly a page per 2k read, plus a couple of headers per block stepped over
+    ASSERT_LE(log.count(OperationType::OpenPage), opened + tail / 2048 + 16);
+
+    // The skip table picked up the blocks on the way, so this is cheap too
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, tail / 2));
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), sizeof(buffer));
+    ASSERT_EQ(memcmp(buffer, &data[size - tail / 2], sizeof(buffer)), 0);
+
+    // Offsets past the start stop there
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, size + 10));
+    ASSERT_EQ(flogfs_read_tell(&fread), 0);
+    ASSERT_EQ(flogfs_read_reverse(&fread, buffer, sizeof(buffer)), 0);
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), sizeof(buffer));
+    ASSERT_EQ(memcmp(buffer, data.data(), sizeof(buffer)), 0);
+
+    // All the way back to the start
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, 0));
+    contents.clear();
+    uint32_t count;
+    while ((count = flogfs_read_reverse(&fread, buffer, sizeof(buffer))) > 0) {
+        contents.insert(contents.begin(), buffer, buffer + count);
+    }
+    ASSERT_EQ(contents, data);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, ReverseReadsIncludeUnflushedWrites) {
+    uint8_t data[FS_SECTOR_SIZE * 2];
+    uint8_t buffer[sizeof(data)];
+
+    for (uint32_t i = 0; i < sizeof(data); ++i) {
+        data[i] = i * 3;
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+    ASSERT_EQ(flogfs_write(&fwrite, data, 700), 700);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+
+    // Some of these are committed and some are still with the writer
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, 0));
+    ASSERT_EQ(flogfs_read_tell(&fread), 700);
+    ASSERT_EQ(flogfs_read_reverse(&fread, buffer, 400), 400);
+    ASSERT_EQ(memcmp(buffer, data + 300, 400), 0);
+
+    ASSERT_EQ(flogfs_write(&fwrite, data + 700, sizeof(data) - 700), sizeof(data) - 700);
+    ASSERT_EQ(flogfs_read(&fread, buffer, sizeof(buffer)), sizeof(data) - 300);
+    ASSERT_EQ(memcmp(buffer, data + 300, sizeof(data) - 300), 0);
+
+    ASSERT_EQ(flogfs_read_reverse(&fread, buffer, sizeof(buffer)), sizeof(data));
+    ASSERT_EQ(memcmp(buffer, data, sizeof(data)), 0);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+}
+
+TEST_F(FileOpsSuite, ReverseReadsAfterWriterCloses) {
+    uint8_t data[FS_SECTOR_SIZE * 2];
+    uint8_t buffer[sizeof(data)];
+
+    for (uint32_t i = 0; i < sizeof(data); ++i) {
+        data[i] = i * 5;
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "log.txt"));
+    ASSERT_EQ(flogfs_write(&fwrite, data, 700), 700);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "log.txt"));
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, 0));
+    ASSERT_EQ(flogfs_read_tell(&fread), 700);
+
+    // The end found above was partly in the writer's buffer
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+    ASSERT_EQ(flogfs_read_reverse(&fread, buffer, sizeof(buffer)), 700);
+    ASSERT_EQ(memcmp(buffer, data, 700), 0);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, ReverseReadsAfterPowerLossAtBlockBoundary) {
+    const uint32_t large = 40 * 1024;
+    std::vector<uint8_t> data(large);
+    uint8_t buffer[300];
+
+    for (uint32_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    // Leave the file's second block linked from its tail but still unwritten
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    auto first_block = file.block;
+    uint32_t written = 0;
+    while (file.block == first_block) {
+        ASSERT_EQ(flogfs_write(&file, data.data() + written, 100), 100);
+        written += 100;
+    }
+
+    flush_and_close();
+
+    initialize_and_open(false, false);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    auto size = flogfs_read_file_size(&fread);
+    ASSERT_GT(size, sizeof(buffer));
+    ASSERT_LE(size, written);
+
+    ASSERT_TRUE(flogfs_read_seek_end(&fread, 0));
+    ASSERT_EQ(flogfs_read_tell(&fread), size);
+    ASSERT_EQ(flogfs_read_reverse(&fread, buffer, sizeof(buffer)), sizeof(buffer));
+    ASSERT_EQ(memcmp(buffer, &data[size - sizeof(buffer)], sizeof(buffer)), 0);
+
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, VectoredWritesAndReadsMatch) {
+    const uint32_t records = 300;
+    uint32_t header, trailer;
+    uint8_t payload[37];
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "records.bin"));
+    for (uint32_t i = 0; i < records; ++i) {
+        header = i;
+        memset(payload, i, sizeof(payload));
+        trailer = ~i;
+        flog_iovec_t iov[] = { { &header, sizeof(header) }, { payload, sizeof(payload) }, { &trailer, sizeof(trailer) } };
+        ASSERT_EQ(flogfs_writev(&fwrite, iov, 3), sizeof(header) + sizeof(payload) + sizeof(trailer));
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "records.bin"));
+    for (uint32_t i = 0; i < records; ++i) {
+        flog_iovec_t iov[] = { { &header, sizeof(header) }, { payload, sizeof(payload) }, { &trailer, sizeof(trailer) } };
+        ASSERT_EQ(flogfs_readv(&fread, iov, 3), sizeof(header) + sizeof(payload) + sizeof(trailer));
+        ASSERT_EQ(header, i);
+        ASSERT_EQ(payload[0], (uint8_t)i);
+        ASSERT_EQ(payload[sizeof(payload) - 1], (uint8_t)i);
+        ASSERT_EQ(trailer, ~i);
+    }
+
+    // The end of the file cuts the vector short
+    flog_iovec_t iov[] = { { &header, sizeof(header) }, { payload, sizeof(payload) } };
+    ASSERT_EQ(flogfs_readv(&fread, iov, 2), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, StreamedWritesProgramWholePages) {
+    const uint32_t size = 100 * 1024;
+    const uint32_t piece = 100;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> contents(size);
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 11 + (i >> 10);
+    }
+
+    initialize_and_open();
+
+    auto &log = flogfs_linux_get_log();
+    auto sectors = log.count(OperationType::WriteSector);
+    auto pages = log.count(OperationType::WritePage);
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "stream.bin"));
+    for (uint32_t position = 0; position < size; position += piece) {
+        uint32_t n = std::min(piece, size - position);
+        ASSERT_EQ(flogfs_write(&fwrite, &data[position], n), n);
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    // Only the first page of each block and the end of the file go a sector at a
+    // time. The header sectors take two writes each.
+    const uint32_t page_size = FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+    const uint32_t blocks = size / (30 * 1024) + 1;
+#if FS_WRITE_PAGES
+    ASSERT_GE(log.count(OperationType::WritePage) - pages, size / page_size - 2 * blocks);
+    ASSERT_LE(log.count(OperationType::WriteSector) - sectors, 5 * blocks + 2 * FS_SECTORS_PER_PAGE);
+#else
+    ASSERT_EQ(log.count(OperationType::WritePage), pages);
+#endif
+
+    // Closing part way through a page programs what's held as sectors
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "stream.bin"));
+    ASSERT_EQ(flogfs_write(&fwrite, data.data(), FS_SECTOR_SIZE * 5 / 2), FS_SECTOR_SIZE * 5 / 2);
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "stream.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), size), size);
+    ASSERT_EQ(contents, data);
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), size), FS_SECTOR_SIZE * 5 / 2);
+    ASSERT_EQ(memcmp(contents.data(), data.data(), FS_SECTOR_SIZE * 5 / 2), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, AlignedWritesTakeOneCallPerSector) {
+    const uint32_t size = 96 * 1024;
+    const uint32_t batch = 4096;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> contents(size);
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 13 + (i >> 9);
+    }
+
+    initialize_and_open();
+
+    auto &log = flogfs_linux_get_log();
+    auto sectors = log.count(OperationType::WriteSector);
+    auto pages = log.count(OperationType::WritePage);
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "aligned.bin"));
+    for (uint32_t position = 0; position < size; position += batch) {
+        ASSERT_EQ(flogfs_write(&fwrite, &data[position], batch), batch);
+    }
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    // Headers are gathered in with their data, so each block's INIT, second and
+    // TAIL sectors cost a call apiece and everything else goes a page at a time
+    const uint32_t page_size = FS_SECTORS_PER_PAGE * FS_SECTOR_SIZE;
+    const uint32_t blocks = size / (30 * 1024) + 1;
+#if FS_WRITE_PAGES
+    ASSERT_GE(log.count(OperationType::WritePage) - pages, size / page_size - blocks);
+    ASSERT_LE(log.count(OperationType::WriteSector) - sectors, 3 * blocks + FS_SECTORS_PER_PAGE);
+#else
+    ASSERT_EQ(log.count(OperationType::WritePage), pages);
+    ASSERT_LE(log.count(OperationType::WriteSector) - sectors, size / FS_SECTOR_SIZE + blocks + 1);
+#endif
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "aligned.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), size), size);
+    ASSERT_EQ(contents, data);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, SyncedWritesSurvivePowerLoss) {
+    const uint32_t large = 40 * 1024;
+    std::vector<uint8_t> data(large);
+    std::vector<uint8_t> contents(large);
+
+    for (uint32_t i = 0; i < large; ++i) {
+        data[i] = i * 3 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t small_file;
+    flog_write_file_t large_file;
+    ASSERT_TRUE(flogfs_open_write(&small_file, "small.bin"));
+    ASSERT_TRUE(flogfs_open_write(&large_file, "large.bin"));
+
+    ASSERT_EQ(flogfs_write(&small_file, data.data(), 100), 100);
+    ASSERT_TRUE(flogfs_sync(&small_file, FLOG_SYNC_DATA));
+
+    // Syncing again has nothing to do
+    auto &log = flogfs_linux_get_log();
+    auto writes = log.count(OperationType::WriteSector);
+    ASSERT_TRUE(flogfs_sync(&small_file, FLOG_SYNC_DATA));
+    ASSERT_EQ(log.count(OperationType::WriteSector), writes);
+
+    // Writes after a sync carry on in the next sector
+    ASSERT_EQ(flogfs_write(&small_file, data.data() + 100, 50), 50);
+    ASSERT_EQ(flogfs_write(&large_file, data.data(), large), large);
+    ASSERT_TRUE(flogfs_sync_all(FLOG_SYNC_RECORD));
+    ASSERT_EQ(flogfs_write(&small_file, data.data() + 150, 20), 20);
+
+    flush_and_close();
+
+    initialize_and_open(false, false);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "small.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), large), 150);
+    ASSERT_EQ(memcmp(contents.data(), data.data(), 150), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    ASSERT_TRUE(flogfs_open_read(&fread, "large.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), large), large);
+    ASSERT_EQ(contents, data);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    // The record lets an append find the end of the file
+    ASSERT_TRUE(flogfs_open_write(&large_file, "large.bin"));
+    ASSERT_EQ(flogfs_write_file_size(&large_file), large);
+    ASSERT_TRUE(flogfs_close_write(&large_file));
+}
+
+TEST_F(FileOpsSuite, InterleavedWritersDontFlushEachOther) {
+    const int nfiles = 4;
+    const uint32_t size = 100 * 1024;
+    uint8_t pattern[100];
+
+    for (uint32_t i = 0; i < sizeof(pattern); ++i) {
+        pattern[i] = i;
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t files[nfiles];
+    for (auto i = 0; i < nfiles; ++i) {
+        ASSERT_TRUE(flogfs_open_write(&files[i], ("file" + std::to_string(i) + ".bin").c_str()));
+    }
+    for (uint32_t written = 0; written < size; written += sizeof(pattern)) {
+        for (auto i = 0; i < nfiles; ++i) {
+            ASSERT_EQ(flogfs_write(&files[i], pattern, sizeof(pattern)), sizeof(pattern));
+        }
+    }
+    for (auto i = 0; i < nfiles; ++i) {
+        ASSERT_TRUE(flogfs_close_write(&files[i]));
+    }
+
+    // Moving to a new block doesn't flush anyone else's partial sector, so
+    // only the last data sector of each file is short. The init sector holds
+    // a header, so it's measured against the fullest one.
+    auto analysis = analyze_file_system();
+    uint16_t full_init = 0;
+    for (auto &ba : analysis.blocks()) {
+        for (auto &fs : ba.files) {
+            if (fs.valid && fs.sector == FLOG_INIT_SECTOR) {
+                full_init = std::max(full_init, fs.size);
+            }
+        }
+    }
+    auto partial = 0;
+    for (auto &ba : analysis.blocks()) {
+        for (auto &fs : ba.files) {
+            if (!fs.valid || fs.sector == FLOG_TAIL_SECTOR || fs.size == 0) {
+                continue;
+            }
+            if (fs.size < (fs.sector == FLOG_INIT_SECTOR ? full_init : FS_SECTOR_SIZE)) {
+                partial++;
+            }
+        }
+    }
+    ASSERT_LE(partial, nfiles);
+}
+
+TEST_F(FileOpsSuite, UnwrittenNextBlockSurvivesPowerLoss) {
+    const uint32_t large = 40 * 1024;
+    std::vector<uint8_t> data(large + 100);
+    std::vector<uint8_t> contents(large + 100);
+
+    for (uint32_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    // Leave the file's second block linked from its tail but still unwritten
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    auto first_block = file.block;
+    uint32_t written = 0;
+    while (file.block == first_block) {
+        ASSERT_EQ(flogfs_write(&file, data.data() + written, 100), 100);
+        written += 100;
+    }
+    ASSERT_LE(written, large);
+
+    flush_and_close();
+
+    initialize_and_open(false, false);
+
+    // Another file filling the volume mustn't be handed that block
+    write_until_full("filler.bin");
+
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    auto kept = flogfs_write_file_size(&file);
+    ASSERT_LE(kept, written);
+    ASSERT_EQ(flogfs_write(&file, data.data() + kept, 100), 100);
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), contents.size()), kept + 100);
+    ASSERT_EQ(memcmp(contents.data(), data.data(), kept + 100), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, UnwrittenNextBlockSurvivesCleanRemount) {
+    const uint32_t large = 40 * 1024;
+    std::vector<uint8_t> data(large + 100);
+    std::vector<uint8_t> contents(large + 100);
+
+    for (uint32_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    auto first_block = file.block;
+    uint32_t written = 0;
+    while (file.block == first_block) {
+        ASSERT_EQ(flogfs_write(&file, data.data() + written, 100), 100);
+        written += 100;
+    }
+    ASSERT_LE(written, large);
+
+    flush_and_close();
+
+    // The age table written by a clean unmount has to hold the block back too
+    initialize_and_open(false, false);
+    unmount_and_close();
+    initialize_and_open(false, false);
+
+    uint8_t pattern[4096];
+    for (uint32_t i = 0; i < sizeof(pattern); ++i) {
+        pattern[i] = i * 3 + 1;
+    }
+    flog_write_file_t filler;
+    ASSERT_TRUE(flogfs_open_write(&filler, "filler.bin"));
+    uint32_t filled = 0;
+    uint32_t n;
+    do {
+        n = flogfs_write(&filler, pattern, sizeof(pattern));
+        filled += n;
+    } while (n == sizeof(pattern));
+    auto closed = flogfs_close_write(&filler);
+
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    auto kept = flogfs_write_file_size(&file);
+    ASSERT_LE(kept, written);
+    ASSERT_EQ(flogfs_write(&file, data.data() + kept, 100), 100);
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), contents.size()), kept + 100);
+    ASSERT_EQ(memcmp(contents.data(), data.data(), kept + 100), 0);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+
+    // A full file system may cost the filler its last tail sector, which
+    // close reports, but what it does have has to be its own
+    ASSERT_TRUE(flogfs_open_read(&fread, "filler.bin"));
+    ASSERT_GT(flogfs_read_file_size(&fread), filled - FS_SECTOR_SIZE);
+    ASSERT_EQ(closed, flogfs_read_file_size(&fread) == filled);
+    uint8_t temporary[sizeof(pattern)];
+    while ((n = flogfs_read(&fread, temporary, sizeof(temporary))) > 0) {
+        ASSERT_EQ(memcmp(temporary, pattern, n), 0);
+    }
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, BoundedWritesLeaveErasesToGcSteps) {
+    const uint32_t size = 256 * 1024;
+    uint8_t pattern[1024];
+
+    for (uint32_t i = 0; i < sizeof(pattern); ++i) {
+        pattern[i] = i * 5;
+    }
+
+    initialize_and_open();
+
+    // Leave the volume with nothing erased, so new blocks mean reclaiming
+    write_until_full("first.bin");
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    flogfs_write_bounded(&file, 1);
+
+    auto &log = flogfs_linux_get_log();
+    uint32_t written = 0;
+    uint32_t most = 0;
+    auto stalls = 0;
+    while (written < size) {
+        auto operations = log.size();
+        auto erases = log.count(OperationType::EraseBlock);
+        auto n = flogfs_write(&file, pattern + written % sizeof(pattern), sizeof(pattern) - written % sizeof(pattern));
+        ASSERT_EQ(log.count(OperationType::EraseBlock), erases);
+        most = std::max(most, log.size() - operations);
+        written += n;
+
+        // Out of preallocated blocks, which is for the maintenance call to fix
+        if (n == 0) {
+            ASSERT_GT(flogfs_gc_step(4), 0);
+            stalls++;
+        }
+    }
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    ASSERT_GT(stalls, 0);
+    // Each sector takes at most an open, a write and a spare write, and
+    // sectors held for a whole page may be programmed along with them
+    ASSERT_LE(most, 3 * (FS_BOUNDED_WRITE_SECTORS + FS_SECTORS_PER_PAGE));
+
+    flog_read_file_t fread;
+    uint8_t contents[sizeof(pattern)];
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    ASSERT_EQ(flogfs_read_file_size(&fread), written);
+    for (uint32_t position = 0; position < written; position += sizeof(contents)) {
+        ASSERT_EQ(flogfs_read(&fread, contents, sizeof(contents)), sizeof(contents));
+        ASSERT_EQ(memcmp(contents, pattern, sizeof(contents)), 0);
+    }
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+#if FS_WRITE_BEHIND
+TEST_F(FileOpsSuite, WriteBehindLeavesFlashToTheFlusher) {
+    const uint32_t size = 64 * 1024;
+    const uint32_t queue_size = FS_WRITE_BEHIND * FS_SECTOR_SIZE;
+    std::vector<uint8_t> data(size);
+    std::vector<uint8_t> contents(size);
+    std::atomic<uint32_t> committed{ 0 };
+
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = i * 17 + (i >> 8);
+    }
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "behind.bin"));
+    flogfs_write_behind(&fwrite, [](flog_write_file_t *, uint32_t n, void *arg) { *(std::atomic<uint32_t> *)arg = n; }, &committed);
+
+    // Queueing never touches flash, and stops when the queue is full
+    auto &log = flogfs_linux_get_log();
+    auto writes = log.size();
+    ASSERT_EQ(flogfs_write_async(&fwrite, data.data(), queue_size + 100), queue_size);
+    ASSERT_EQ(log.size(), writes);
+    ASSERT_EQ(flogfs_write_queued_size(&fwrite), queue_size);
+
+    ASSERT_TRUE(flogfs_write_behind_flush());
+    ASSERT_FALSE(flogfs_write_behind_flush());
+    ASSERT_GT(committed, 0);
+    ASSERT_GT(log.size(), writes);
+
+    // With a flusher thread draining it the producer only copies
+    ASSERT_TRUE(flogfs_linux_start_flusher());
+    uint32_t position = queue_size;
+    while (position < size) {
+        uint32_t n = flogfs_write_async(&fwrite, &data[position], std::min<uint32_t>(1000, size - position));
+        if (n == 0) {
+            std::this_thread::yield();
+        }
+        position += n;
+    }
+    ASSERT_EQ(flogfs_write_queued_size(&fwrite), size);
+
+    // Closing writes what the flusher hasn't got to yet
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+    flogfs_linux_stop_flusher();
+    ASSERT_EQ(committed, size);
+
+    flog_read_file_t fread;
+    ASSERT_TRUE(flogfs_open_read(&fread, "behind.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), size), size);
+    ASSERT_EQ(contents, data);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+
+TEST_F(FileOpsSuite, BoundedWriteKeepsQueuedBytes) {
+    uint8_t chunk[1000];
+
+    for (uint32_t i = 0; i < sizeof(chunk); ++i) {
+        chunk[i] = i * 7 + (i >> 4);
+    }
+
+    initialize_and_open();
+
+    // Leave the volume with nothing erased, so bounded writes run dry
+    write_until_full("first.bin");
+    ASSERT_TRUE(flogfs_rm("first.bin"));
+
+    flog_write_file_t file;
+    ASSERT_TRUE(flogfs_open_write(&file, "file.bin"));
+    flogfs_write_bounded(&file, 1);
+
+    std::vector<uint8_t> expected;
+    while (true) {
+        auto n = flogfs_write(&file, chunk, sizeof(chunk));
+        if (n == 0) {
+            break;
+        }
+        expected.insert(expected.end(), chunk, chunk + n);
+    }
+    ASSERT_EQ(flogfs_write_queued_size(&file), expected.size());
+
+    // The queue can't be drained yet, so it's still there after the write
+    ASSERT_EQ(flogfs_write_async(&file, chunk, sizeof(chunk)), sizeof(chunk));
+    expected.insert(expected.end(), chunk, chunk + sizeof(chunk));
+    ASSERT_EQ(flogfs_write(&file, chunk, 100), 0);
+    ASSERT_EQ(flogfs_write_queued_size(&file), expected.size());
+
+    ASSERT_GT(flogfs_gc_step(4), 0);
+    ASSERT_EQ(flogfs_write(&file, chunk, 100), 100);
+    expected.insert(expected.end(), chunk, chunk + 100);
+    ASSERT_EQ(flogfs_write_queued_size(&file), expected.size());
+    ASSERT_TRUE(flogfs_close_write(&file));
+
+    flog_read_file_t fread;
+    std::vector<uint8_t> contents(expected.size());
+    ASSERT_TRUE(flogfs_open_read(&fread, "file.bin"));
+    ASSERT_EQ(flogfs_read(&fread, contents.data(), contents.size()), contents.size());
+    ASSERT_EQ(contents, expected);
+    ASSERT_TRUE(flogfs_close_read(&fread));
+}
+#endif
+
+TEST_F(FileOpsSuite, ConcurrentWritersAndReaders) {
+    const int writers = 4;
+    const int readers = 2;
+    const uint32_t record = 100;
+    const uint32_t size = 640 * record;
+    std::vector<uint8_t> shared(size);
+
+    for (uint32_t i = 0; i < size; ++i) {
+        shared[i] = i * 11 + (i >> 8);
+    }
+
+    auto expected = [](int writer, uint32_t position) -> uint8_t {
+        return position * 3 + writer * 29 + (position >> 9);
+    };
+
+    initialize_and_open();
+
+    flog_write_file_t fwrite;
+    ASSERT_TRUE(flogfs_open_write(&fwrite, "shared.bin"));
+    ASSERT_EQ(flogfs_write(&fwrite, shared.data(), size), size);
+    ASSERT_TRUE(flogfs_close_write(&fwrite));
+
+    std::vector<std::thread> threads;
+    for (auto w = 0; w < writers; ++w) {
+        threads.emplace_back([w, size, record, &expected] {
+            std::string name = "file" + std::to_string(w) + ".bin";
+            std::vector<uint8_t> buffer(record);
+
+            flog_write_file_t file;
+            EXPECT_TRUE(flogfs_open_write(&file, name.c_str()));
+            for (uint32_t position = 0; position < size; position += record) {
+                for (uint32_t i = 0; i < record; ++i) {
+                    buffer[i] = expected(w, position + i);
+                }
+                EXPECT_EQ(flogfs_write(&file, buffer.data(), record), record);
+                std::this_thread::yield();
+            }
+            EXPECT_TRUE(flogfs_close_write(&file));
+        });
+    }
+    for (auto r = 0; r < readers; ++r) {
+        threads.emplace_back([size, &shared] {
+            std::vector<uint8_t> contents(size);
+
+            for (auto pass = 0; pass < 4; ++pass) {
+                flog_read_file_t file;
+                EXPECT_TRUE(flogfs_open_read(&file, "shared.bin"));
+                EXPECT_EQ(flogfs_read(&file, contents.data(), size), size);
+                EXPECT_EQ(contents, shared);
+                EXPECT_TRUE(flogfs_close_read(&file));
+            }
+        });
+    }
+    // And one reading a file while it's written, buffered data included
+    threads.emplace_back([size, &expected] {
+        std::vector<uint8_t> contents(size);
+        uint32_t n = 0;
+
+        while (n < size) {
+            flog_read_file_t file;
+            if (!flogfs_open_read(&file, "file0.bin")) {
+                std::this_thread::yield();
+                continue;
+            }
+            n = flogfs_read(&file, contents.data(), size);
+            for (uint32_t i = 0; i < n; ++i) {
+                EXPECT_EQ(contents[i], expected(0, i));
+            }
+            EXPECT_TRUE(flogfs_close_read(&file));
+        }
+    });
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<uint8_t> contents(size + 1);
+    for (auto w = 0; w < writers; ++w) {
+        std::string name = "file" + std::to_string(w) + ".bin";
+
+        flog_read_file_t file;
+        ASSERT_TRUE(flogfs_open_read(&file, name.c_str()));
+        ASSERT_EQ(flogfs_read(&file, contents.data(), size + 1), size);
+        for (uint32_t i = 0; i < size; ++i) {
+            ASSERT_EQ(contents[i], expected(w, i));
+        }
+        ASSERT_TRUE(flogfs_close_read(&file));
+    }
+}
@@ -29,6 +29,11 @@ void flush_and_close() {
     ASSERT_TRUE(flogfs_linux_close());
 }
 
+void unmount_and_close() {
+    ASSERT_TRUE(flogfs_unmount());
+    ASSERT_TRUE(flogfs_linux_close());
+}
+
 std::vector<std::string> generate_random_file_names(int32_t number) {
     std::vector<std::string> names;
     for (auto i = 0; i < number; ++i) {
@@ -9,6 +9,8 @@ void initialize_and_open(bool truncate = true, bool format = true);
 
 void flush_and_close();
 
+void unmount_and_close();
+
 std::vector<std::string> generate_random_file_names(int32_t number);
 
 std::vector<std::string> get_file_listing();